@@ -24,14 +24,18 @@
 #include <iostream>         /* cout */
 #include <iomanip>          /* setw, setfill, ... */
 #include <fstream>          /* ifstream, ofstream */
+#include <sstream>          /* istringstream */
 #include <string.h>         /* strcmp */
 #include "Options.hpp"
+#include "port_profile.hpp"  /* PROFILE_MAX_READS */
+#include "supervisor.hpp"    /* SUPERVISOR_PER_BUS */
 
 
 Options::Options(
     int argc,
     char* argv[]
-) {
+) : optValue()
+{
 	// Retrieve options
 	int opt_index = 0;
 	int opt;
@@ -67,6 +71,9 @@ Options::Options(
         /* In / Out */
         case 'i':   if (strcmp(optarg, IN_OUT_EEPROM_NAME) == 0)
                         optValue.flags.in_ftdidev = 1;
+                    else if (ImagePack::split_spec( optarg,
+                                optValue.iFname, optValue.iKey ))
+                        optValue.flags.in_pack = 1;
                     else
                         optValue.iFname = string( optarg );
                     break;
@@ -106,6 +113,145 @@ Options::Options(
                     optValue.update.serial          = optarg;   break;
 #endif
 
+        /* Any ftdi_eeprom_value: FIELD=VALUE */
+        case LOPT_SET: {
+                    string err;
+
+                    if (optValue.plan.add( optarg, err ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid --set: " << err << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.flags.update = 1;
+                    break;
+                    }
+
+        /* ----- PACK ----- */
+        case LOPT_BUILD_PACK:
+                    optValue.flags.build_pack = 1;
+                    optValue.pack.fname = string( optarg );     break;
+        case LOPT_ARCHIVE:
+                    optValue.flags.archive = 1;
+                    optValue.store = string( optarg );          break;
+        case LOPT_SNAPSHOT_CACHE:
+                    optValue.snapshotDir = string( optarg );    break;
+        case LOPT_RECORD:
+                    optValue.recordFname = string( optarg );    break;
+        case LOPT_REPLAY:
+                    optValue.replayFname = string( optarg );    break;
+        case LOPT_REPLAY_SPEED:
+                    optValue.replaySpeed = strtod( optarg, &token );
+                    if ( (*token != '\0') || (optValue.replaySpeed < 0) ) {
+                        logger(LOGL_ERROR) << "Invalid --replay-speed: " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.flags.replay_speed = 1;
+                    break;
+        case LOPT_SERIAL_RANGE:
+                    if (parseSerialRange( optarg ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid serial range: " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    break;
+
+        /* ----- DAEMON ----- */
+        case LOPT_SERVE:
+                    optValue.flags.serve = 1;
+                    optValue.sockPath = string( optarg );       break;
+        case LOPT_CLIENT:
+                    optValue.flags.client = 1;
+                    optValue.sockPath = string( optarg );       break;
+
+        /* ----- CHECKSUM ----- */
+        case LOPT_CHIP:
+                    if (FTDISession::chip_parse( optarg, &optValue.chip ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid chip type: " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.flags.chip = 1;
+                    break;
+        case LOPT_IMAGE_SIZE:
+                    optValue.imageSize = stoi( optarg, nullptr, 0 );    break;
+
+        /* ----- SCAN ----- */
+        case LOPT_SCAN:
+                    optValue.flags.scan = 1;
+                    optValue.golden = string( optarg );         break;
+        case LOPT_IMAGE: {
+                    string spec( optarg );
+                    size_t pos = spec.find('=');
+                    enum ftdi_chip_type type;
+
+                    if ( (pos == string::npos) || (pos + 1 == spec.size())
+                        || (FTDISession::chip_parse( spec.substr(0, pos), &type ) < 0) ) {
+                        logger(LOGL_ERROR) << "Invalid --image (TYPE=FILE): " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.images.push_back( make_pair(type, spec.substr(pos + 1)) );
+                    break;
+                    }
+        case LOPT_CAPTURE:
+                    optValue.captureDir = string( optarg );     break;
+        case LOPT_USER_DATA:
+                    optValue.userData = string( optarg );       break;
+        case LOPT_INDEX:
+                    optValue.indexDir = string( optarg );       break;
+        case LOPT_FIND: {
+                    string err;
+
+                    if (DumpIndex::parse_query( optarg, &optValue.query, err ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid --find: " << err << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.flags.find = 1;
+                    break;
+                    }
+        case LOPT_SHARD:
+                    if (strcmp(optarg, "bus") == 0) {
+                        optValue.shard = SUPERVISOR_PER_BUS;
+                    } else {
+                        optValue.shard = (int)strtol( optarg, &token, 0 );
+                        if ( (*token != '\0') || (optValue.shard <= 0) ) {
+                            logger(LOGL_ERROR) << "Invalid --shard (bus, N devices): " << optarg << endl;
+                            throw -EINVAL;
+                        }
+                    }
+                    optValue.flags.shard = 1;
+                    break;
+        case LOPT_SELF_TEST:
+                    if (SelfTest::parse( optarg, &optValue.selfTest ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid --self-test: " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    break;
+
+        case LOPT_PROFILE:
+                    optValue.profileReads = (int)strtol( optarg, &token, 0 );
+                    if ( (*token != '\0') || (optValue.profileReads <= 0)
+                        || (optValue.profileReads > PROFILE_MAX_READS) ) {
+                        logger(LOGL_ERROR) << "Invalid --profile (reads per port): " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    break;
+        case LOPT_ALLOW:
+                    if ( !optValue.allow.empty() )
+                        optValue.allow += ",";
+                    optValue.allow += string( optarg );         break;
+
+        /* ----- LOG ----- */
+        case LOPT_LOG:
+                    if (LogSink::parse_format( optarg, &optValue.logFormat ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid --log (human, json): " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    optValue.flags.log = 1;
+                    break;
+        case LOPT_LOG_LEVEL:
+                    if (LogSink::parse_level( optarg, &optValue.logLevel ) < 0) {
+                        logger(LOGL_ERROR) << "Invalid --log-level: " << optarg << endl;
+                        throw -EINVAL;
+                    }
+                    break;
+
 		case '?': /* Unknown option (ignore) */
 		default : /* Do nothing */		break;
 		} // End of switch(opt)
@@ -114,8 +260,23 @@ Options::Options(
 
     /* ---------- Get extra information ---------- */
 
-    // Get input file size
-    if ( isInFile() ) {
+    // Get input file size (image size for pack / store)
+    if ( isInPack() && ImageStore::is_store( getInFname() ) ) {
+        ImageStore store;
+        unsigned char img[FTDI_MAX_EEPROM_SIZE];
+        unsigned int size;
+        uint64_t key;
+
+        optValue.flags.in_store = 1;
+        if ( (ImageStore::parse_key( getInKey(), &key ) == 0)
+            && (store.open( getInFname(), false ) == 0)
+            && (store.get( key, img, &size ) == 0) )
+            optValue.iFsize = size;
+    } else if ( isInPack() ) {
+        ImagePack pack;
+        if ( pack.open( getInFname() ) == 0 )
+            optValue.iFsize = pack.get_image_size();
+    } else if ( isInFile() ) {
         ifstream in( getInFname(), ios::binary | ios::ate );
         if ( in.good() )
             optValue.iFsize = in.tellg();
@@ -124,6 +285,32 @@ Options::Options(
 
 }
 
+/* PREFIX:FIRST:COUNT, e.g. "FT:000100:500" -> FT000100 ... FT000599 */
+int Options::parseSerialRange( char *arg )
+{
+    string  s( arg );
+    size_t  p1, p2;
+    string  first, count;
+
+    if ((p2 = s.rfind(':')) == string::npos)        return -EINVAL;
+    if ((p1 = s.rfind(':', p2 - 1)) == string::npos) return -EINVAL;
+    if ((p2 == 0) || (p1 + 1 >= p2))                return -EINVAL;
+
+    first = s.substr(p1 + 1, p2 - p1 - 1);
+    count = s.substr(p2 + 1);
+    if ( first.empty() || count.empty()
+        || (first.find_first_not_of("0123456789") != string::npos)
+        || (count.find_first_not_of("0123456789") != string::npos) )
+        return -EINVAL;
+
+    optValue.pack.prefix = s.substr(0, p1);
+    optValue.pack.first  = stoul( first, nullptr, 10 );
+    optValue.pack.count  = stoul( count, nullptr, 10 );
+    optValue.pack.width  = first.size();
+
+    return (optValue.pack.count > 0) ? 0 : -EINVAL;
+}
+
 void Options::applyHiddenRules()
 {
     /* if IN/OUT were not defined, but Bus or ID are provided
@@ -145,16 +332,33 @@ void Options::applyHiddenRules()
      */
     if ( !isOutputDefined() && isUpdate() ) {
         if ( isInFTDIDEV() )    setOutFTDIDEV();
-        if ( isInFile() )       setOutFile( getInFname() );
+        /* never write back into a pack */
+        if ( isInFile() && !isInPack() )
+                                setOutFile( getInFname() );
     }
 
 }
 
 int Options::validateOptions( int eeprom_size )
 {
+    if ( isRecord() && isReplay() ) {
+        logger(LOGL_ERROR) << "record and replay can not be used together!" << endl;
+        return -EINVAL;
+    }
+
+    /* adaptive: a limit on threads, async has one */
+    if ( isAdaptive() && isAsync() ) {
+        logger(LOGL_ERROR) << "adaptive can not be used with async!" << endl;
+        return -EINVAL;
+    }
+
+    /* Image by chip type: no input / output, the devices are selected */
+    if ( isImageByChip() )
+        return 0;
+
     /* Need Input, eithre from FTDIDEV or File */
     if ( !isInputDefined() ) {
-        cerr << "No Input (EEPROM or File) specified!" << endl;
+        logger(LOGL_ERROR) << "No Input (EEPROM or File) specified!" << endl;
         return EXIT_FAILURE;
 
         return -EINVAL;
@@ -163,36 +367,78 @@ int Options::validateOptions( int eeprom_size )
     /* FTDIDEV depends on Bus/ID */
     if ( isInFTDIDEV() || isOutFTDIDEV() ) {
         if ( !(isBusDefined() || isIdDefined()) ) {
-            cerr << "bus:dev or vid:pid is not provided!" << endl;
+            logger(LOGL_ERROR) << "bus:dev or vid:pid is not provided!" << endl;
             return -EINVAL;
         }
     }
 
+    /* the self-test runs on the device just written */
+    if ( isSelfTest() && (!isOutFTDIDEV() || isReplay()) ) {
+        logger(LOGL_ERROR) << "self-test needs output to EEPROM (not replayed)!" << endl;
+        return -EINVAL;
+    }
+
     /* Input file existence */
     if ( isInFile() ) {
         /* check optValue.iFsize instead of opening file to check f.good()
          * as it had been done in Constructor
          */
+        if ( isInStore() && (optValue.iFsize == 0) ) {
+            logger(LOGL_ERROR) << "Key, " << getInKey() << ", is not in store "
+                 << getInFname() << "!" << endl;
+            return -EINVAL;
+        }
         if ( optValue.iFsize == 0 ) {
-            cerr << "Input file, " << getInFname()
+            logger(LOGL_ERROR) << "Input file, " << getInFname()
                  << ", does not exist or size is zero!" << endl;
             return -EINVAL;
         }
 
+        if ( isInPack() && !isInStore()
+            && (getInKey().size() > FTPK_KEY_SIZE) ) {
+            logger(LOGL_ERROR) << "Serial, " << getInKey() << ", is too long for pack!"
+                 << endl;
+            return -EINVAL;
+        }
+
         /* Input file size > EEPROM size */
         if ( isOutFTDIDEV() && ( optValue.iFsize > eeprom_size ) ) {
-            cerr << "Input file size ("
+            logger(LOGL_ERROR) << "Input file size ("
                  << hex << optValue.iFsize << ") > EEPROM size ("
                  << eeprom_size << ")!" << dec << endl;
             return -EINVAL;
         }
     }
 
+    /* Pack needs a template (the input) and serials */
+    if ( isBuildPack() && (optValue.pack.count == 0) ) {
+        logger(LOGL_ERROR) << "build-pack requires serial-range!" << endl;
+        return -EINVAL;
+    }
+
+    /* Checksum modes work on files (one image, or an archive of images) */
+    if ( isCheckSum() || isFixSum() ) {
+        if ( !isInFile() || isInPack() ) {
+            logger(LOGL_ERROR) << "check/fix-checksum requires an input file!" << endl;
+            return -EINVAL;
+        }
+        if ( getImageSize() == 0 ) {
+            logger(LOGL_ERROR) << "image-size is required for an archive!" << endl;
+            return -EINVAL;
+        }
+        if ( optValue.iFsize % getImageSize() ) {
+            logger(LOGL_ERROR) << "Input file size (" << optValue.iFsize
+                 << ") is not a multiple of image-size ("
+                 << getImageSize() << ")!" << endl;
+            return -EINVAL;
+        }
+    }
+
     /* Output file overwrite: use ifstream to test, not typo */
     if ( isOutFile() ) {
         ifstream out( getOutFname(), ios::binary | ios::ate );
         if ( out.good() ) {
-            cerr << "Output file, " << getOutFname()
+            logger(LOGL_WARN) << "Output file, " << getOutFname()
                   << ", already exists. Overwrite!" << endl;
         }
 
@@ -224,44 +470,149 @@ void Options::ShowHelp( void )
          << "  manufacturer Manufacturer field" << endl
          << "   product     Product field" << endl
          << "    serial     Serial field" << endl
+         << endl
+         << "set            FIELD=VALUE, any EEPROM value (repeatable)" << endl
+         << "               vid, pid, release-number, self-powered," << endl
+         << "               remote-wakeup, max-power: patched directly" << endl
+         << "               in the binary (no decode/encode)" << endl
+         << "               FIELDs:" << endl;
+    {
+        istringstream   names( PatchPlan::field_names() );
+        string          name, line;
+
+        while (names >> name) {
+            if (line.size() + name.size() > 56) {
+                cout << "                 " << line << endl;
+                line.clear();
+            }
+            line += name + " ";
+        }
+        cout << "                 " << line << endl;
+    }
+    cout << endl
+         << "build-pack     Build image pack from input (as template)" << endl
+         << "serial-range   PREFIX:FIRST:COUNT serials of the pack" << endl
+         << "               e.g. FT:000100:500 -> FT000100 .. FT000599" << endl
+         << "               Read back with --in pack.ftpk#SERIAL" << endl
+         << "archive        Put output image into a store (path), by" << endl
+         << "               content: prints the KEY, read back with" << endl
+         << "               --in store.ftds#KEY" << endl
+         << "snapshot-cache Directory of the last image read per device" << endl
+         << "               (port, serial, bcdDevice): a read re-reads" << endl
+         << "               only the checksum word if unchanged" << endl
+         << "record         Record the device's USB operations (with" << endl
+         << "               time) into a file" << endl
+         << "replay         Serve a recording instead of a device" << endl
+         << "replay-speed   X times the recorded speed (default 1," << endl
+         << "               0: no wait)" << endl
+         << endl
+         << "stream         stdin -> update-xxx -> stdout, images are" << endl
+         << "               prefixed by 2 bytes length (little endian)" << endl
+         << endl
+         << "serve          Serve jobs on UNIX domain socket (path)" << endl
+         << "client         Send jobs (stdin lines) to the socket (path)" << endl
+         << endl
+         << "check-checksum Verify checksum of every image in input" << endl
+         << "fix-checksum   Repair checksum of every image in input" << endl
+         << "               (in place)" << endl
+         << "image-size     Bytes per image when input is an archive" << endl
+         << "               (concatenated images), default: file size" << endl
+         << "chip           Chip type of file input: AM BM 2232C R" << endl
+         << "               2232H 4232H 232H 230X (default: BM)" << endl
+         << endl
+         << "scan           Compare every connected device (id vid:pid," << endl
+         << "               default: FTDI ids) with a golden image, read" << endl
+         << "               only. One summary line per device" << endl
+         << "allow          Per-unit fields not compared (comma list," << endl
+         << "               default: serial; 'none': compare all)" << endl
+         << "profile        N word reads on every device (id vid:pid)," << endl
+         << "               one at a time: latency per port and hub," << endl
+         << "               slowest first (e.g. 64)" << endl
+         << endl
+         << "image          TYPE=FILE, template for a chip type (repeat" << endl
+         << "               per type). The device's chip type and EEPROM" << endl
+         << "               size select the image, encoded once with" << endl
+         << "               the update-xxx / set options" << endl
+         << "all            Program every device matching id (default:" << endl
+         << "               FTDI ids) instead of one bus:dev / vid:pid" << endl
+         << "async          One thread drives every device (asynchronous" << endl
+         << "               USB transfers) instead of a thread per device" << endl
+         << "adaptive       Devices programmed at once (up to 64) follow" << endl
+         << "               the per-word latency of the transfers (AIMD)" << endl
+         << "capture        Dump every device (bus:dev, id, all) into a" << endl
+         << "               directory, SERIAL.bin each, written in" << endl
+         << "               batches (io_uring or threads, fsync per batch)" << endl
+         << "user-data      FILE: written into the user area of every" << endl
+         << "               device (bus:dev, id, all), PACK: the user" << endl
+         << "               area of the device's serial image. Only the" << endl
+         << "               changed words (and checksum) are written" << endl
+         << "index          Index the dumps (NAME.bin) of a directory:" << endl
+         << "               new or changed ones decoded, others kept" << endl
+         << "find           Look up the index of --index DIR, e.g." << endl
+         << "               serial=FT0005, vid=0x403,pid=0x6015,since=-7d" << endl
+         << "               (since / until: -Nd, -Nh, YYYY-MM-DD)" << endl
+         << "shard          bus | N: every device (id vid:pid) written" << endl
+         << "               by worker processes, one per USB bus or per" << endl
+         << "               N devices; a hung worker is killed and" << endl
+         << "               replaced. One line per device" << endl
+         << "self-test      After the write, on the open device, every" << endl
+         << "               port: bitbang[:MASK[:P,P..]] pins read back," << endl
+         << "               loop[:MASK[:P,P..]] D0-3 wired to D4-7, or" << endl
+         << "               uart[:BAUD] TXD wired to RXD" << endl
+         << endl
+         << "log            human | json: messages as records of one" << endl
+         << "               writer thread (stderr), with time and device" << endl
+         << "log-level      debug | info | warn | error (default debug)" << endl
          << endl;
 }
 
 void Options::ShowOpts( void )
 {
-    cout.setf(ios::hex, ios::basefield);
-    cout << setfill('0');
-    cout << "(bus:dev) = "
+    logger(LOGL_DEBUG) << "(bus:dev) = " << hex << setfill('0')
          << setw(3) << optValue.bus << ":"
          << setw(3) << optValue.dev << endl;
-    cout << "(vid:pid) = "
+    logger(LOGL_DEBUG) << "(vid:pid) = " << hex << setfill('0')
          << setw(4) << optValue.vid << ":"
          << setw(4) << optValue.pid << endl;
-    cout.unsetf(ios::hex);
 
-    cout << "flag: open_bus = "
+    logger(LOGL_DEBUG) << "flag: open_bus = "
          << (optValue.flags.open_bus ? "Yes" : "No") << endl;
-    cout << "flag: open_id = "
+    logger(LOGL_DEBUG) << "flag: open_id = "
          << (optValue.flags.open_id ? "Yes" : "No") << endl;
-    cout << "flag: verbose = "
+    logger(LOGL_DEBUG) << "flag: verbose = "
          << (optValue.flags.verbose ? "Yes" : "No") << endl;
-    cout << "flag: view_binary = "
+    logger(LOGL_DEBUG) << "flag: view_binary = "
          << (optValue.flags.view_binary ? "Yes" : "No") << endl;
-    cout << "flag: view_human = "
+    logger(LOGL_DEBUG) << "flag: view_human = "
          << (optValue.flags.view_human ? "Yes" : "No") << endl;
-    cout << "flag: in_ftdidev = "
+    logger(LOGL_DEBUG) << "flag: in_ftdidev = "
          << (optValue.flags.in_ftdidev ? "Yes" : "No") << endl;
-    cout << "flag: out_ftdidev = "
+    logger(LOGL_DEBUG) << "flag: out_ftdidev = "
          << (optValue.flags.out_ftdidev ? "Yes" : "No") << endl;
-
-    cout << "In  = "
-         << (isInFile()
+    logger(LOGL_DEBUG) << "flag: build_pack = "
+         << (optValue.flags.build_pack ? "Yes" : "No") << endl;
+
+    logger(LOGL_DEBUG) << "flag: archive = "
+         << (optValue.flags.archive ? "Yes" : "No") << endl;
+
+    logger(LOGL_DEBUG) << "In  = "
+         << (isInStore()
+            ? ("(store) " + getInFname() + PACK_KEY_SEPARATOR + getInKey())
+            : isInPack()
+            ? ("(pack) " + getInFname() + PACK_KEY_SEPARATOR + getInKey())
+            : isInFile()
             ? ("(file) " + getInFname())
             : (isInFTDIDEV() ? "EEPROM" : "(null)") ) << endl;
-    cout << "Out = "
+    logger(LOGL_DEBUG) << "Out = "
          << (isOutFile()
             ? ("(file) " + getOutFname())
             : (isOutFTDIDEV() ? "EEPROM" : "(null)") ) << endl;
+    if ( isBuildPack() ) {
+        logger(LOGL_DEBUG) << "Pack = " << getPackFname() << " ("
+             << getPackPrefix() << setw(getPackWidth()) << setfill('0')
+             << getPackFirst() << " x " << getPackCount() << ")"
+             << endl;
+    }
 
-    cout << endl;
+    logger(LOGL_DEBUG) << endl;
 }
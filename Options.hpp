@@ -25,7 +25,16 @@
 #define _OPTIONS_HPP_
 
 #include <string>           /* string */
+#include <vector>           /* vector */
+#include <utility>          /* pair */
 #include <getopt.h>		// getopt_long()
+#include "image_pack.hpp"
+#include "image_store.hpp"
+#include "self_test.hpp"
+#include "log_sink.hpp"
+#include "dump_index.hpp"
+#include "patch_plan.hpp"
+#include "ftdi_session.hpp"   /* FTDI_MAX_EEPROM_SIZE, chip names */
 
 
 using namespace std;
@@ -34,6 +43,35 @@ using namespace std;
 #define IN_OUT_EEPROM_NAME          "EEPROM"
 
 
+/* Long options without a short form: getopt_long() returns these */
+enum LONG_OPT_ID {
+    LOPT_BUILD_PACK = 0x100,        /* --build-pack */
+    LOPT_SERIAL_RANGE,              /* --serial-range */
+    LOPT_SERVE,                     /* --serve */
+    LOPT_CLIENT,                    /* --client */
+    LOPT_SET,                       /* --set FIELD=VALUE */
+    LOPT_CHIP,                      /* --chip */
+    LOPT_IMAGE_SIZE,                /* --image-size */
+    LOPT_SCAN,                      /* --scan */
+    LOPT_ALLOW,                     /* --allow */
+    LOPT_ARCHIVE,                   /* --archive */
+    LOPT_IMAGE,                     /* --image TYPE=FILE */
+    LOPT_SNAPSHOT_CACHE,            /* --snapshot-cache DIR */
+    LOPT_RECORD,                    /* --record FILE */
+    LOPT_REPLAY,                    /* --replay FILE */
+    LOPT_REPLAY_SPEED,              /* --replay-speed X */
+    LOPT_SELF_TEST,                 /* --self-test SPEC */
+    LOPT_LOG,                       /* --log FORMAT */
+    LOPT_LOG_LEVEL,                 /* --log-level LEVEL */
+    LOPT_CAPTURE,                   /* --capture DIR */
+    LOPT_PROFILE,                   /* --profile N */
+    LOPT_SHARD,                     /* --shard bus|N */
+    LOPT_INDEX,                     /* --index DIR */
+    LOPT_FIND,                      /* --find QUERY */
+    LOPT_USER_DATA,                 /* --user-data FILE */
+};
+
+
 typedef struct OPT_FLAGS_S {
     int verbose;                    /* Verbose mode */
 
@@ -47,6 +85,30 @@ typedef struct OPT_FLAGS_S {
 
     int in_ftdidev;                 /* Read from FTDI Device (EEPROM) */
     int out_ftdidev;                /* Write to FTDI Device (EEPROM) */
+
+    int in_pack;                    /* Read from pack#serial or store#key */
+    int in_store;                   /* ... and it is a store (magic) */
+    int build_pack;                 /* Build image pack from input */
+    int archive;                    /* Put output image into store */
+
+    int stream;                     /* stdin -> update -> stdout */
+
+    int serve;                      /* daemon on UNIX domain socket */
+    int client;                     /* client of the daemon */
+
+    int chip;                       /* --chip given (file has no chip type) */
+    int check_sum;                  /* verify checksum of every image */
+    int fix_sum;                    /* repair checksum of every image */
+
+    int scan;                       /* drift scan against golden image */
+
+    int all;                        /* every matching device */
+    int async;                      /* one thread, libusb async transfers */
+    int adaptive;                   /* sessions at once follow latency */
+    int replay_speed;               /* --replay-speed given */
+    int log;                        /* --log: records to the log sink */
+    int shard;                      /* --shard: worker processes */
+    int find;                       /* --find: look up, no index build */
 } OPT_FLAGS_T;
 
 typedef struct OPT_UPDATE_S {
@@ -63,6 +125,14 @@ typedef struct OPT_UPDATE_S {
 #endif
 } OPT_UPDATE_T;
 
+typedef struct OPT_PACK_S {
+    string          fname;          /* Pack to be built */
+    string          prefix;         /* serial = prefix + zero padded number */
+    unsigned long   first;
+    unsigned long   count;
+    unsigned int    width;          /* digits, from the 'first' string */
+} OPT_PACK_T;
+
 typedef struct OPT_VALUE_S {
     OPT_FLAGS_T flags;
 
@@ -75,11 +145,42 @@ typedef struct OPT_VALUE_S {
     unsigned int    pid;
 
     string          iFname;         /* EEPROM, or Input file name */
+    string          iKey;           /* serial of the image in pack */
     string          oFname;         /* EEPROM, or Output file name */
 
     long            iFsize;         /* Input file size (compare with EEPROM size) */
 
     OPT_UPDATE_T    update;
+    PatchPlan       plan;           /* --set FIELD=VALUE, compiled */
+
+    OPT_PACK_T      pack;
+    string          store;          /* --archive */
+    string          snapshotDir;    /* --snapshot-cache */
+    string          recordFname;    /* --record */
+    string          replayFname;    /* --replay */
+    double          replaySpeed;    /* --replay-speed, 0: no wait */
+
+    string          sockPath;       /* --serve / --client socket */
+
+    enum ftdi_chip_type chip;       /* --chip */
+    unsigned int    imageSize;      /* --image-size, images in archive */
+
+    string          golden;         /* --scan golden image */
+    string          allow;          /* --allow, comma separated */
+
+    /* --image TYPE=FILE: template per chip type */
+    vector< pair<enum ftdi_chip_type, string> > images;
+
+    SELF_TEST_SPEC_T    selfTest;   /* --self-test, mode NONE: not given */
+    string          captureDir;     /* --capture */
+    int             profileReads;   /* --profile, 0: not given */
+    int             shard;          /* --shard, devices per worker, 0: per bus */
+    string          indexDir;       /* --index */
+    DUMPX_QUERY_T   query;          /* --find */
+    string          userData;       /* --user-data, file or pack */
+
+    enum LOG_FORMAT logFormat;      /* --log */
+    enum LOG_LEVEL  logLevel;       /* --log-level, default debug */
 
 } OPT_VALUE_T;
 
@@ -93,7 +194,7 @@ private:
      *
      * Options.hpp: error: too many initializers for ‘const option [0]’
      */
-    const struct option long_opts[14] = {
+    const struct option long_opts[44] = {
         {"help",        no_argument,        NULL,   'h'},
 
         {"verbose",     no_argument,        &(optValue.flags.verbose), 1},
@@ -122,12 +223,51 @@ private:
         {"update-product",      required_argument,  NULL,   'y'},
         {"update-serial",       required_argument,  NULL,   'z'},
 
+        {"set",                 required_argument,  NULL,   LOPT_SET},
+
+        {"build-pack",          required_argument,  NULL,   LOPT_BUILD_PACK},
+        {"serial-range",        required_argument,  NULL,   LOPT_SERIAL_RANGE},
+        {"archive",             required_argument,  NULL,   LOPT_ARCHIVE},
+        {"snapshot-cache",      required_argument,  NULL,   LOPT_SNAPSHOT_CACHE},
+        {"record",              required_argument,  NULL,   LOPT_RECORD},
+        {"replay",              required_argument,  NULL,   LOPT_REPLAY},
+        {"replay-speed",        required_argument,  NULL,   LOPT_REPLAY_SPEED},
+
+        {"stream",      no_argument,        &(optValue.flags.stream), 1},
+
+        {"serve",       required_argument,  NULL,   LOPT_SERVE},
+        {"client",      required_argument,  NULL,   LOPT_CLIENT},
+
+        {"chip",        required_argument,  NULL,   LOPT_CHIP},
+        {"image-size",  required_argument,  NULL,   LOPT_IMAGE_SIZE},
+        {"check-checksum", no_argument,     &(optValue.flags.check_sum), 1},
+        {"fix-checksum",   no_argument,     &(optValue.flags.fix_sum),   1},
+
+        {"scan",        required_argument,  NULL,   LOPT_SCAN},
+        {"allow",       required_argument,  NULL,   LOPT_ALLOW},
+        {"profile",     required_argument,  NULL,   LOPT_PROFILE},
+
+        {"image",       required_argument,  NULL,   LOPT_IMAGE},
+        {"all",         no_argument,        &(optValue.flags.all), 1},
+        {"async",       no_argument,        &(optValue.flags.async), 1},
+        {"adaptive",    no_argument,        &(optValue.flags.adaptive), 1},
+        {"capture",     required_argument,  NULL,   LOPT_CAPTURE},
+        {"index",       required_argument,  NULL,   LOPT_INDEX},
+        {"find",        required_argument,  NULL,   LOPT_FIND},
+        {"self-test",   required_argument,  NULL,   LOPT_SELF_TEST},
+        {"user-data",   required_argument,  NULL,   LOPT_USER_DATA},
+        {"shard",       required_argument,  NULL,   LOPT_SHARD},
+
+        {"log",         required_argument,  NULL,   LOPT_LOG},
+        {"log-level",   required_argument,  NULL,   LOPT_LOG_LEVEL},
+
         {NULL, 0, NULL, 0},
     };
 
 protected:
 
     OPT_VALUE_T     optValue;           /* values from parameters */
+    DeviceLog       logger;             /* not a device */
 
     void setInFTDIDEV() {
         optValue.flags.in_ftdidev = 1;
@@ -142,6 +282,8 @@ protected:
         optValue.oFname = fName;
     }
 
+    int  parseSerialRange( char *arg );
+
 public:
     /* Constructor / Destructor */
     Options(int argc, char* argv[]);
@@ -175,15 +317,97 @@ public:
     bool    isOutFile()     { return !getOutFname().empty(); }
     long    getInFileSize() { return optValue.iFsize; }
 
+    bool    isInPack()      { return optValue.flags.in_pack; }
+    bool    isInStore()     { return optValue.flags.in_store; }
+    string  getInKey()      { return optValue.iKey; }
+
+    bool    isStream()      { return optValue.flags.stream; }
+
+    bool    isServe()       { return optValue.flags.serve; }
+    bool    isClient()      { return optValue.flags.client; }
+    string  getSockPath()   { return optValue.sockPath; }
+
+    bool    isChipDefined() { return optValue.flags.chip; }
+    enum ftdi_chip_type getChip()   { return optValue.chip; }
+
+    bool    isCheckSum()    { return optValue.flags.check_sum; }
+    bool    isFixSum()      { return optValue.flags.fix_sum; }
+    /* --image-size, or the whole input file when it fits in one EEPROM */
+    unsigned int getImageSize() {
+                if (optValue.imageSize)
+                    return optValue.imageSize;
+                return (optValue.iFsize <= FTDI_MAX_EEPROM_SIZE)
+                        ? (unsigned int)optValue.iFsize : 0;
+    }
+
+    bool    isScan()        { return optValue.flags.scan; }
+    string  getGolden()     { return optValue.golden; }
+    bool    isAllowDefined(){ return !optValue.allow.empty(); }
+    string  getAllow()      { return optValue.allow; }
+
+    bool    isProfile()         { return optValue.profileReads > 0; }
+    int     getProfileReads()   { return optValue.profileReads; }
+
+    bool    isAll()         { return optValue.flags.all; }
+    bool    isAsync()       { return optValue.flags.async; }
+    bool    isAdaptive()    { return optValue.flags.adaptive; }
+    bool    isImageByChip() { return !optValue.images.empty(); }
+    const vector< pair<enum ftdi_chip_type, string> > &getImages()
+                            { return optValue.images; }
+
+    bool    isCapture()     { return !optValue.captureDir.empty(); }
+    string  getCaptureDir() { return optValue.captureDir; }
+
+    bool    isUserData()    { return !optValue.userData.empty(); }
+    string  getUserData()   { return optValue.userData; }
+
+    bool    isIndex()       { return !optValue.indexDir.empty(); }
+    string  getIndexDir()   { return optValue.indexDir; }
+    bool    isFind()        { return optValue.flags.find; }
+    const DUMPX_QUERY_T &getQuery() { return optValue.query; }
+
+    bool    isShard()       { return optValue.flags.shard; }
+    int     getShard()      { return optValue.shard; }
+
+    bool    isSelfTest()    { return optValue.selfTest.mode != SELF_TEST_NONE; }
+    const SELF_TEST_SPEC_T &getSelfTest()   { return optValue.selfTest; }
+
+    bool    isLog()         { return optValue.flags.log; }
+    enum LOG_FORMAT getLogFormat()  { return optValue.logFormat; }
+    enum LOG_LEVEL  getLogLevel()   { return optValue.logLevel; }
+
+    bool    isBuildPack()   { return optValue.flags.build_pack; }
+    string  getPackFname()  { return optValue.pack.fname; }
+    string  getPackPrefix() { return optValue.pack.prefix; }
+    unsigned long getPackFirst()    { return optValue.pack.first; }
+    unsigned long getPackCount()    { return optValue.pack.count; }
+    unsigned int  getPackWidth()    { return optValue.pack.width; }
+
+    bool    isArchive()     { return optValue.flags.archive; }
+    string  getStoreFname() { return optValue.store; }
+
+    bool    isSnapshotCache()   { return !optValue.snapshotDir.empty(); }
+    string  getSnapshotDir()    { return optValue.snapshotDir; }
+
+    bool    isRecord()          { return !optValue.recordFname.empty(); }
+    string  getRecordFname()    { return optValue.recordFname; }
+    bool    isReplay()          { return !optValue.replayFname.empty(); }
+    string  getReplayFname()    { return optValue.replayFname; }
+    double  getReplaySpeed()
+            { return optValue.flags.replay_speed ? optValue.replaySpeed : 1.0; }
+
     bool    isInputDefined() {
                 return ( isInFTDIDEV() || !getInFname().empty() );
             }
     bool    isOutputDefined() {
-                return ( isOutFTDIDEV() || !getOutFname().empty() );
+                return ( isOutFTDIDEV() || !getOutFname().empty()
+                        || isBuildPack() || isArchive() );
             }
     void    setOutNULL() {
         optValue.flags.out_ftdidev = 0;
         optValue.oFname.clear();
+        optValue.flags.build_pack = 0;
+        optValue.flags.archive = 0;
     }
 
 
@@ -201,6 +425,17 @@ public:
     bool    isUpdate_serial()       { return (getUpdate_serial() != NULL); }
 #endif
 
+    const OPT_UPDATE_T &getUpdate()     { return optValue.update; }
+    PatchPlan   &getPlan()              { return optValue.plan; }
+
+    /* only fixed offset fields: no decode / encode needed */
+    bool    isDirectPatch() {
+                return optValue.plan.is_direct()
+                    && !isUpdate_vid() && !isUpdate_pid()
+                    && !isUpdate_manufacturer() && !isUpdate_product()
+                    && !isUpdate_serial();
+    }
+
     unsigned int getUpdate_vid()        { return optValue.update.vid; };
     unsigned int getUpdate_pid()        { return optValue.update.pid; };
 
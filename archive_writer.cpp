@@ -0,0 +1,520 @@
+/*
+    Implementation of ArchiveWriter class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <cerrno>           /* errno */
+#include <stdlib.h>         /* calloc, free */
+#include <string.h>         /* memset */
+#include <algorithm>        /* max, min */
+#include <fcntl.h>          /* open, openat */
+#include <unistd.h>         /* close, write, fsync */
+#include <stdio.h>          /* renameat */
+#include "archive_writer.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#if defined(HAVE_IO_URING)
+#include <stdint.h>         /* uintptr_t */
+#include <sys/mman.h>       /* mmap */
+#include <sys/syscall.h>    /* __NR_io_uring_xxx */
+#include <linux/io_uring.h>
+#endif
+
+
+#if defined(HAVE_IO_URING)
+
+/* io_uring without liburing: the rings mapped, one submission at a time
+ * (prepare SQEs, then submit them all and wait for all their CQEs)
+ */
+struct ArchiveRing {
+    int             fd;
+    void            *sq_ptr, *cq_ptr;
+    size_t          sq_len, cq_len, sqes_len;
+    unsigned        *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned        pending;        /* prepared, not submitted */
+};
+
+static const int ring_ops[] = {
+    IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC,
+    IORING_OP_CLOSE, IORING_OP_RENAMEAT,
+};
+
+static void ring_close( struct ArchiveRing *r )
+{
+    if (r->sqes && (r->sqes != MAP_FAILED))
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && (r->cq_ptr != MAP_FAILED) && (r->cq_ptr != r->sq_ptr))
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && (r->sq_ptr != MAP_FAILED))
+        munmap(r->sq_ptr, r->sq_len);
+    ::close(r->fd);
+    delete r;
+}
+
+/* NULL: no io_uring, or an opcode of ring_ops not supported */
+static struct ArchiveRing *ring_open( unsigned entries )
+{
+    struct io_uring_params  p;
+    struct io_uring_probe   *probe;
+    struct ArchiveRing      *r;
+    size_t  probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    char    *b;
+    bool    ok = true;
+    int     fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return NULL;
+
+    r = new ArchiveRing();
+    r->fd = fd;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = max(r->sq_len, r->cq_len);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ptr
+              : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len,
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+    if ( (r->sq_ptr == MAP_FAILED) || (r->cq_ptr == MAP_FAILED)
+        || (r->sqes == MAP_FAILED) ) {
+        ring_close( r );
+        return NULL;
+    }
+
+    b = (char *)r->sq_ptr;
+    r->sq_head  = (unsigned *)(b + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(b + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(b + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(b + p.sq_off.array);
+    b = (char *)r->cq_ptr;
+    r->cq_head  = (unsigned *)(b + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(b + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(b + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(b + p.cq_off.cqes);
+
+    /* RENAMEAT is 5.11: ask rather than fail in the middle of a batch */
+    probe = (struct io_uring_probe *)calloc(1, probe_len);
+    if ( (probe == NULL)
+        || (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) ) {
+        ok = false;
+    } else {
+        for (size_t i = 0; i < sizeof(ring_ops) / sizeof(ring_ops[0]); i++) {
+            ok = ok && (ring_ops[i] <= probe->last_op)
+                    && (probe->ops[ring_ops[i]].flags & IO_URING_OP_SUPPORTED);
+        }
+    }
+    free(probe);
+
+    if ( !ok ) {
+        ring_close( r );
+        return NULL;
+    }
+    return r;
+}
+
+static struct io_uring_sqe *ring_sqe( struct ArchiveRing *r, uint64_t user_data )
+{
+    unsigned idx = (*r->sq_tail + r->pending) & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    r->sq_array[idx] = idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    r->pending++;
+    return sqe;
+}
+
+/* submit the prepared SQEs, res[user_data] = result of each */
+static int ring_run( struct ArchiveRing *r, vector<int> &res )
+{
+    unsigned n = r->pending, submitted = 0, done = 0;
+    unsigned head, tail;
+    long     ret;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+
+    while (done < n) {
+        ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        submitted += ret;
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++, done++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+            if (cqe->user_data < res.size())
+                res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+#else   /* HAVE_IO_URING */
+
+struct ArchiveRing { int fd; };
+
+static struct ArchiveRing *ring_open( unsigned entries ) { return NULL; }
+static void ring_close( struct ArchiveRing *r ) { delete r; }
+
+#endif  /* HAVE_IO_URING */
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+ArchiveWriter::ArchiveWriter()
+    : dir_fd(-1), ring(NULL), busy(false), stopping(false),
+      files(0), batches(0), errors(0)
+{
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+/* ------------------------------------------------------------------ */
+
+int ArchiveWriter::open( string dir, bool use_ring )
+{
+    if (writer.joinable())
+        return -EBUSY;
+
+    if ((dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -errno;
+    this->dir = dir;
+    names.clear();
+
+    /* write + fsync of every file of a batch in flight at once */
+    if (use_ring)
+        ring = ring_open( 2 * ARCHIVE_BATCH );
+
+    stopping = false;
+    writer = thread( &ArchiveWriter::run, this );
+    return 0;
+}
+
+int ArchiveWriter::put( string name, const unsigned char *buf, unsigned int size,
+                        int *rc )
+{
+    ARCHIVE_ITEM_T item;
+
+    if ( !writer.joinable() )
+        return -EBADF;
+    if ( name.empty() || (name.find('/') != string::npos) )
+        return -EINVAL;
+
+    item.name = name;
+    item.data.assign( buf, buf + size );
+    item.rc   = rc;
+
+    {
+        lock_guard<mutex> l( lock );
+
+        if ( !names.insert( name ).second )
+            return -EEXIST;
+        queue.push_back( std::move(item) );
+    }
+    queued.notify_one();
+    return 0;
+}
+
+void ArchiveWriter::flush( void )
+{
+    unique_lock<mutex> l( lock );
+
+    idle.wait( l, [this] { return queue.empty() && !busy; } );
+}
+
+int ArchiveWriter::close( void )
+{
+    if ( writer.joinable() ) {
+        flush();
+        {
+            lock_guard<mutex> l( lock );
+            stopping = true;
+        }
+        queued.notify_one();
+        writer.join();
+    }
+
+    if (ring) {
+        ring_close( ring );
+        ring = NULL;
+    }
+    if (dir_fd >= 0) {
+        ::close(dir_fd);
+        dir_fd = -1;
+    }
+
+    return (int)errors;
+}
+
+void ArchiveWriter::run( void )
+{
+    vector<ARCHIVE_ITEM_T> b;
+
+    for (;;) {
+        {
+            unique_lock<mutex> l( lock );
+
+            queued.wait( l, [this] { return stopping || !queue.empty(); } );
+            if ( queue.empty() )
+                return;
+
+            /* what is queued now is the batch */
+            b.clear();
+            while ( !queue.empty() && (b.size() < ARCHIVE_BATCH) ) {
+                b.push_back( std::move(queue.front()) );
+                queue.pop_front();
+            }
+            busy = true;
+        }
+
+        write_batch( b );
+
+        {
+            lock_guard<mutex> l( lock );
+            busy = false;
+        }
+        idle.notify_all();
+    }
+}
+
+void ArchiveWriter::write_batch( vector<ARCHIVE_ITEM_T> &b )
+{
+    vector<int> rc( b.size(), 0 );
+    bool    renamed = false;
+    size_t  i;
+
+    if (ring)
+        batch_ring( b, rc );
+    else
+        batch_threads( b, rc );
+
+    for (i = 0; i < b.size(); i++)
+        renamed |= (rc[i] == 0);
+
+    /* the renames of the whole batch, one fsync */
+    if ( renamed && (fsync(dir_fd) < 0) ) {
+        int err = -errno;
+
+        for (i = 0; i < b.size(); i++)
+            if (rc[i] == 0)
+                rc[i] = err;
+    }
+
+    for (i = 0; i < b.size(); i++) {
+        (rc[i] == 0) ? files++ : errors++;
+        if (b[i].rc)
+            *b[i].rc = rc[i];
+    }
+    batches++;
+}
+
+/* open, write, fsync, close, rename: one file, blocking */
+int ArchiveWriter::write_one( ARCHIVE_ITEM_T &item )
+{
+    string  tmp = item.name + ARCHIVE_TMP_SUFFIX;
+    size_t  off = 0;
+    ssize_t n;
+    int     fd, rc = 0;
+
+    fd = openat(dir_fd, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                ARCHIVE_FILE_MODE);
+    if (fd < 0)
+        return -errno;
+
+    while (off < item.data.size()) {
+        if ((n = ::write(fd, item.data.data() + off, item.data.size() - off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -errno;
+            break;
+        }
+        off += n;
+    }
+    if ( (rc == 0) && (fsync(fd) < 0) )
+        rc = -errno;
+    if ( (::close(fd) < 0) && (rc == 0) )
+        rc = -errno;
+    if ( (rc == 0) && (renameat(dir_fd, tmp.c_str(), dir_fd, item.name.c_str()) < 0) )
+        rc = -errno;
+
+    if (rc < 0)
+        unlinkat(dir_fd, tmp.c_str(), 0);
+    return rc;
+}
+
+void ArchiveWriter::batch_threads( vector<ARCHIVE_ITEM_T> &b, vector<int> &rc )
+{
+    size_t nthreads = min(b.size(), (size_t)ARCHIVE_THREADS);
+    vector<thread> workers;
+
+    for (size_t k = 0; k < nthreads; k++) {
+        workers.push_back( thread( [this, &b, &rc, k, nthreads]() {
+            for (size_t i = k; i < b.size(); i += nthreads)
+                rc[i] = write_one( b[i] );
+        } ) );
+    }
+    for (size_t k = 0; k < workers.size(); k++)
+        workers[k].join();
+}
+
+#if defined(HAVE_IO_URING)
+
+/* every step of every file of the batch in one submission */
+void ArchiveWriter::batch_ring( vector<ARCHIVE_ITEM_T> &b, vector<int> &rc )
+{
+    size_t          n = b.size(), i;
+    vector<string>  tmp( n );
+    vector<int>     fd( n, -1 ), res;
+    int             err;
+
+    /* 1. open NAME.tmp */
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = ring_sqe( ring, i );
+
+        tmp[i] = b[i].name + ARCHIVE_TMP_SUFFIX;
+        sqe->opcode     = IORING_OP_OPENAT;
+        sqe->fd         = dir_fd;
+        sqe->addr       = (uintptr_t)tmp[i].c_str();
+        sqe->len        = ARCHIVE_FILE_MODE;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    }
+    res.assign( n, 0 );
+    if ((err = ring_run( ring, res )) < 0) {
+        rc.assign( n, err );
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (res[i] < 0)
+            rc[i] = res[i];
+        else
+            fd[i] = res[i];
+    }
+
+    /* 2. write, then fsync (linked: no fsync after a failed write) */
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+
+        if (fd[i] < 0)
+            continue;
+
+        sqe = ring_sqe( ring, 2 * i );
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags  = IOSQE_IO_LINK;
+        sqe->fd     = fd[i];
+        sqe->addr   = (uintptr_t)b[i].data.data();
+        sqe->len    = b[i].data.size();
+        sqe->off    = 0;
+
+        sqe = ring_sqe( ring, 2 * i + 1 );
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd     = fd[i];
+    }
+    res.assign( 2 * n, 0 );
+    if ((err = ring_run( ring, res )) < 0)
+        rc.assign( n, err );
+    for (i = 0; (err == 0) && (i < n); i++) {
+        if (fd[i] < 0)
+            continue;
+        if (res[2 * i] < 0)
+            rc[i] = res[2 * i];
+        else if ((size_t)res[2 * i] != b[i].data.size())
+            rc[i] = -EIO;       /* short write */
+        else if (res[2 * i + 1] < 0)
+            rc[i] = res[2 * i + 1];
+    }
+
+    /* 3. close */
+    for (i = 0; i < n; i++) {
+        if (fd[i] >= 0) {
+            struct io_uring_sqe *sqe = ring_sqe( ring, i );
+
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd     = fd[i];
+        }
+    }
+    res.assign( n, 0 );
+    if (ring_run( ring, res ) < 0) {
+        for (i = 0; i < n; i++)
+            if (fd[i] >= 0)
+                ::close(fd[i]);
+        rc.assign( n, -EIO );
+    }
+
+    /* 4. rename NAME.tmp NAME */
+    for (i = 0; i < n; i++) {
+        if ( (fd[i] >= 0) && (rc[i] == 0) ) {
+            struct io_uring_sqe *sqe = ring_sqe( ring, i );
+
+            sqe->opcode       = IORING_OP_RENAMEAT;
+            sqe->fd           = dir_fd;
+            sqe->addr         = (uintptr_t)tmp[i].c_str();
+            sqe->len          = dir_fd;
+            sqe->addr2        = (uintptr_t)b[i].name.c_str();
+            sqe->rename_flags = 0;
+        }
+    }
+    res.assign( n, 0 );
+    if ((err = ring_run( ring, res )) < 0)
+        rc.assign( n, err );
+    for (i = 0; i < n; i++) {
+        if ( (rc[i] == 0) && (res[i] < 0) )
+            rc[i] = res[i];
+        if ( (fd[i] >= 0) && (rc[i] < 0) )
+            unlinkat(dir_fd, tmp[i].c_str(), 0);
+    }
+}
+
+#else   /* HAVE_IO_URING */
+
+void ArchiveWriter::batch_ring( vector<ARCHIVE_ITEM_T> &b, vector<int> &rc )
+{
+    batch_threads( b, rc );
+}
+
+#endif  /* HAVE_IO_URING */
@@ -0,0 +1,113 @@
+/*
+    Header of ArchiveWriter class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _ARCHIVE_WRITER_HPP_
+#define _ARCHIVE_WRITER_HPP_
+
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <deque>            /* deque */
+#include <set>              /* set */
+#include <thread>           /* thread */
+#include <mutex>            /* mutex */
+#include <condition_variable>
+
+
+using namespace std;
+
+
+/* Many images into one directory, one file each, written in batches by one
+ * writer thread: put() only queues. A batch is what is queued when the
+ * writer gets to it (at most ARCHIVE_BATCH files):
+ *
+ *  open NAME.tmp -> write -> fsync -> close -> rename NAME.tmp NAME (all files)
+ *  fsync directory (once per batch)
+ *
+ * Each step is one io_uring submission for the whole batch (write + fsync
+ * linked per file). Without io_uring (old kernel, no opcode, seccomp), the
+ * files of a batch go to ARCHIVE_THREADS threads instead. A file is either
+ * there complete or not at all. A name is put once per open(): a second
+ * one (same NAME.tmp, same rename) is refused.
+ */
+#define ARCHIVE_BATCH           (64)
+#define ARCHIVE_THREADS         (8)
+#define ARCHIVE_TMP_SUFFIX      ".tmp"
+#define ARCHIVE_FILE_MODE       (0644)
+
+struct ArchiveRing;
+
+typedef struct ARCHIVE_ITEM_S {
+    string                  name;   /* in the directory */
+    vector<unsigned char>   data;
+    int                     *rc;    /* caller's, set when done: 0 / -errno */
+} ARCHIVE_ITEM_T;
+
+
+class ArchiveWriter {
+
+private:
+    string          dir;
+    int             dir_fd;
+    struct ArchiveRing  *ring;      /* NULL: threads */
+
+    mutex               lock;
+    condition_variable  queued;
+    condition_variable  idle;
+    deque<ARCHIVE_ITEM_T>   queue;
+    set<string>     names;          /* put since open() */
+    bool            busy;           /* a batch is being written */
+    bool            stopping;
+    thread          writer;
+
+    unsigned long   files, batches, errors;
+
+    void    run( void );
+    void    write_batch( vector<ARCHIVE_ITEM_T> &b );
+    void    batch_ring( vector<ARCHIVE_ITEM_T> &b, vector<int> &rc );
+    void    batch_threads( vector<ARCHIVE_ITEM_T> &b, vector<int> &rc );
+    int     write_one( ARCHIVE_ITEM_T &item );
+
+public:
+    /* Constructor / Destructor */
+    ArchiveWriter();
+    ~ArchiveWriter();               /* close() */
+
+    /* existing directory; use_ring false: threads only */
+    int     open( string dir, bool use_ring = true );
+    /* copy of buf queued; *rc (if not NULL) set once written.
+     * -EEXIST: name already put since open()
+     */
+    int     put( string name, const unsigned char *buf, unsigned int size,
+                 int *rc = NULL );
+    void    flush( void );          /* wait: everything queued written */
+    int     close( void );          /* flush, stop; returns errors */
+
+    const char      *backend()      { return ring ? "io_uring" : "threads"; }
+    unsigned long   get_files()     { return files; }
+    unsigned long   get_batches()   { return batches; }
+    unsigned long   get_errors()    { return errors; }
+
+};  /* class ArchiveWriter */
+
+#endif  /* _ARCHIVE_WRITER_HPP_ */
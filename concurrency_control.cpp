@@ -0,0 +1,138 @@
+/*
+    Implementation of ConcurrencyControl class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cmath>            /* floor, lround */
+#include "concurrency_control.hpp"
+#include "log_sink.hpp"     /* DeviceLog */
+
+
+/* ------------------------------------------------------------------ */
+
+ConcurrencyControl::ConcurrencyControl( unsigned int max, unsigned int start )
+    : max(max < CONCURRENCY_MIN ? CONCURRENCY_MIN : max), active(0),
+      epoch(0), settled_sum(0), settled_n(0), stats()
+{
+    if (start > this->max)
+        start = this->max;
+    if (start < CONCURRENCY_MIN)
+        start = CONCURRENCY_MIN;
+
+    limit = start;
+    stats.limit = stats.peak = start;
+}
+
+unsigned long ConcurrencyControl::acquire( void )
+{
+    unique_lock<mutex> l( lock );
+
+    cv.wait( l, [this]() { return active < (unsigned int)floor(limit); } );
+    active++;
+
+    return epoch;
+}
+
+void ConcurrencyControl::release( void )
+{
+    {
+        lock_guard<mutex> l( lock );
+        active--;
+    }
+    cv.notify_one();
+}
+
+void ConcurrencyControl::sample( unsigned long e, enum CONCURRENCY_XFER xfer,
+                                 long us, unsigned int words, bool failed )
+{
+    unsigned int before, after;
+    double per_word = 0;
+    bool congested;
+
+    if ( !failed && (words == 0) )
+        return;
+
+    {
+        lock_guard<mutex> l( lock );
+        double &base = stats.baseline_us[xfer];
+
+        before = (unsigned int)floor(limit);
+        stats.samples++;
+
+        if (failed) {
+            stats.errors++;
+            congested = true;
+        } else {
+            /* 1 us at least: a baseline of 0 would be 'none' */
+            per_word = (double)((us > 0) ? us : 1) / words;
+            if (base == 0)
+                base = per_word;
+            congested = (per_word > CONCURRENCY_LATENCY_X * base);
+
+            if (per_word < base)
+                base += CONCURRENCY_BASE_DOWN * (per_word - base);
+            else if ( !congested )
+                base += CONCURRENCY_BASE_UP * (per_word - base);
+        }
+
+        if (congested) {
+            /* once per congestion: not for sessions older than the decrease */
+            if (e == epoch) {
+                limit *= CONCURRENCY_DECREASE;
+                if (limit < CONCURRENCY_MIN)
+                    limit = CONCURRENCY_MIN;
+                epoch++;
+                stats.decreases++;
+            }
+        } else {
+            limit += 1.0 / limit;
+            if (limit > max)
+                limit = max;
+        }
+
+        after = (unsigned int)floor(limit);
+        if (after > stats.peak)
+            stats.peak = after;
+        if (stats.decreases > 0) {
+            settled_sum += limit;
+            settled_n++;
+        }
+    }
+
+    if (after != before) {
+        DeviceLog log;
+
+        log(LOGL_DEBUG) << "Concurrency " << before << " -> " << after
+                        << (failed ? " (transfer failed)"
+                            : (after < before) ? " (latency)" : "") << endl;
+        if (after > before)
+            cv.notify_all();
+    }
+}
+
+CONCURRENCY_STATS_T ConcurrencyControl::get_stats( void )
+{
+    lock_guard<mutex> l( lock );
+
+    stats.limit   = (unsigned int)floor(limit);
+    stats.settled = (settled_n > 0) ? (unsigned int)lround(settled_sum / settled_n)
+                                    : stats.limit;
+    return stats;
+}
@@ -0,0 +1,107 @@
+/*
+    Header of ConcurrencyControl class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _CONCURRENCY_CONTROL_HPP_
+#define _CONCURRENCY_CONTROL_HPP_
+
+#include <cstddef>          /* size_t */
+#include <mutex>            /* mutex */
+#include <condition_variable>   /* condition_variable */
+
+
+using namespace std;
+
+
+/* How many device sessions run at once, AIMD on the per-word latency of
+ * the EEPROM transfers (read, write: each against its own baseline):
+ *
+ *  transfer ok, latency <= X * baseline    limit += 1 / limit
+ *                                          (+1 once limit sessions are done)
+ *  transfer failed (timeout), or slower    limit *= CONCURRENCY_DECREASE
+ *
+ * The baseline is a smoothed minimum: a lower sample pulls it down by
+ * CONCURRENCY_BASE_DOWN of the gap, an uncongested higher one up by
+ * CONCURRENCY_BASE_UP. One fast outlier does not make every later sample
+ * look congested, congested samples never raise it.
+ *
+ * A session only decreases the limit if it started after the last decrease:
+ * the sessions already running when the bus got congested count once.
+ *
+ * 'settled' is the mean limit since the first decrease (the sawtooth around
+ * what the bus takes), the limit itself when it never had to decrease.
+ */
+#define CONCURRENCY_START       (4)
+#define CONCURRENCY_MIN         (1)
+#define CONCURRENCY_LATENCY_X   (2.0)   /* congested: X * baseline per word */
+#define CONCURRENCY_DECREASE    (0.5)
+#define CONCURRENCY_BASE_DOWN   (0.25)  /* baseline EWMA weights */
+#define CONCURRENCY_BASE_UP     (0.0625)
+
+enum CONCURRENCY_XFER {
+    CONCURRENCY_READ = 0,
+    CONCURRENCY_WRITE,
+    CONCURRENCY_XFERS
+};
+
+typedef struct CONCURRENCY_STATS_S {
+    unsigned int    limit;          /* now */
+    unsigned int    settled;
+    unsigned int    peak;
+    size_t          samples;
+    size_t          errors;         /* failed transfers */
+    size_t          decreases;
+    double          baseline_us[CONCURRENCY_XFERS];     /* per word, 0: none */
+} CONCURRENCY_STATS_T;
+
+
+class ConcurrencyControl {
+
+private:
+    mutex           lock;
+    condition_variable  cv;
+    unsigned int    max;
+    unsigned int    active;
+    double          limit;
+    unsigned long   epoch;          /* decreases so far */
+    double          settled_sum;
+    size_t          settled_n;
+    CONCURRENCY_STATS_T stats;
+
+public:
+    /* Constructor / Destructor */
+    ConcurrencyControl( unsigned int max, unsigned int start = CONCURRENCY_START );
+    ~ConcurrencyControl() {}
+
+    /* waits for a session slot; returns the epoch to sample() with */
+    unsigned long   acquire( void );
+    void            release( void );
+
+    /* one transfer of 'words' EEPROM words */
+    void    sample( unsigned long epoch, enum CONCURRENCY_XFER xfer,
+                    long us, unsigned int words, bool failed );
+
+    CONCURRENCY_STATS_T get_stats( void );
+
+};  /* class ConcurrencyControl */
+
+#endif  /* _CONCURRENCY_CONTROL_HPP_ */
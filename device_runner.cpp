@@ -0,0 +1,78 @@
+/*
+    Implementation of DeviceRunner class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <thread>           /* thread */
+#include <atomic>           /* atomic */
+#include "device_runner.hpp"
+#include "ftdi_server.hpp"  /* escape */
+
+
+/* ------------------------------------------------------------------ */
+
+void DeviceRunner::for_each( size_t count, size_t threads,
+                             const function<void (size_t)> &fn )
+{
+    vector<thread>  workers;
+    atomic<size_t>  next( 0 );
+    size_t  i;
+
+    /* one USB round trip after another per device: devices in parallel */
+    threads = min(count, threads);
+    for (i = 0; i < threads; i++) {
+        workers.push_back( thread( [&]() {
+            size_t n;
+
+            while ((n = next++) < count)
+                fn( n );
+        } ) );
+    }
+    for (i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+long DeviceRunner::elapsed_ms( chrono::steady_clock::time_point t )
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - t).count();
+}
+
+void DeviceRunner::device_line( FILE *out, const RUN_DEVICE_T &d, const char *status,
+                                const string &fields, const string &tail )
+{
+    string line;
+
+    line = "device bus=" + to_string(d.bus) + " dev=" + to_string(d.dev)
+         + " status=" + status + fields + " ms=" + to_string(d.ms);
+    if (d.rc < 0)
+        line += " error=" + FTDIServer::escape(d.err);
+    line += tail;
+
+    fprintf(out, "%s\n", line.c_str());
+}
+
+void DeviceRunner::summary( FILE *out, size_t devices, const string &fields,
+                            chrono::steady_clock::time_point t0 )
+{
+    fprintf(out, "summary devices=%zu%s ms=%ld\n",
+        devices, fields.c_str(), elapsed_ms( t0 ));
+    fflush(out);
+}
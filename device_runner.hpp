@@ -0,0 +1,103 @@
+/*
+    Header of DeviceRunner class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _DEVICE_RUNNER_HPP_
+#define _DEVICE_RUNNER_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <functional>       /* function */
+#include <chrono>           /* steady_clock */
+
+
+using namespace std;
+
+
+/* What the multi-device modes (drift scan, rack, capture, user data) share:
+ * the devices, run on a pool of threads (each takes the next device), one
+ * line per device and a summary (values %XX escaped, like the daemon):
+ *
+ *  device bus=1 dev=5 status=ok FIELDS ms=212
+ *  device bus=1 dev=7 status=error ms=3 error=EEPROM%20is%20blank
+ *  summary devices=2 FIELDS ms=231
+ *
+ * A mode's device record starts with RUN_DEVICE_T (derived struct).
+ */
+#define RUNNER_MAX_THREADS      (64)
+
+typedef struct RUN_DEVICE_S {
+    int             bus, dev;       /* 0: use vid:pid */
+    int             vid, pid;
+
+    int             rc;
+    string          err;
+    long            ms;             /* run() */
+} RUN_DEVICE_T;
+
+
+class DeviceRunner {
+
+public:
+    template <class T>
+    static void add( vector<T> &devs, int bus, int dev, int vid, int pid )
+    {
+        T d = T();
+
+        d.bus = bus;
+        d.dev = dev;
+        d.vid = vid;
+        d.pid = pid;
+        devs.push_back( d );
+    }
+
+    /* fn(n) for every n < count, on up to threads threads */
+    static void for_each( size_t count, size_t threads,
+                          const function<void (size_t)> &fn );
+
+    /* fn(device) for every device, its ms set */
+    template <class T, class F>
+    static void run( vector<T> &devs, size_t threads, F fn )
+    {
+        for_each( devs.size(), threads, [&devs, &fn]( size_t n ) {
+            chrono::steady_clock::time_point t = chrono::steady_clock::now();
+
+            fn( devs[n] );
+            devs[n].ms = elapsed_ms( t );
+        } );
+    }
+
+    static long elapsed_ms( chrono::steady_clock::time_point t );
+
+    /* device bus=B dev=D status=S FIELDS ms=N [error=E] TAIL
+     * (fields, tail: " name=value" each, escaped by the caller)
+     */
+    static void device_line( FILE *out, const RUN_DEVICE_T &d, const char *status,
+                             const string &fields, const string &tail = "" );
+    /* summary devices=N FIELDS ms=M (since t0), flushed */
+    static void summary( FILE *out, size_t devices, const string &fields,
+                         chrono::steady_clock::time_point t0 );
+
+};  /* class DeviceRunner */
+
+#endif  /* _DEVICE_RUNNER_HPP_ */
@@ -0,0 +1,507 @@
+/*
+    Implementation of DumpIndex class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <fstream>          /* ifstream */
+#include <sstream>          /* istringstream */
+#include <algorithm>        /* sort, lower_bound */
+#include <numeric>          /* iota */
+#include <unordered_map>    /* unordered_map */
+#include <cerrno>           /* errno */
+#include <cstring>          /* memcmp, strcmp */
+#include <cstdlib>          /* strtol */
+#include <fcntl.h>          /* open */
+#include <unistd.h>         /* close, fsync */
+#include <dirent.h>         /* opendir */
+#include <sys/mman.h>       /* mmap */
+#include <sys/stat.h>       /* stat */
+#include "dump_index.hpp"
+#include "ftdi_session.hpp"
+#include "eeprom_checksum.hpp"
+
+
+/* release number (bcdDevice, word 3) libftdi writes, by chip type */
+static const struct {
+    unsigned int        release;
+    enum ftdi_chip_type type;
+} dumpx_release[] = {
+    { 0x0200, TYPE_AM    },
+    { 0x0400, TYPE_BM    },
+    { 0x0500, TYPE_2232C },
+    { 0x0600, TYPE_R     },
+    { 0x0700, TYPE_2232H },
+    { 0x0800, TYPE_4232H },
+    { 0x0900, TYPE_232H  },
+    { 0x1000, TYPE_230X  },
+};
+
+/* Decode one dump the way a read EEPROM is; a dump that does not decode is
+ * still indexed (by file name), without ids or strings.
+ */
+static void decode_dump( const string &path, enum ftdi_chip_type fallback,
+                         DUMPX_IMAGE_T &img )
+{
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    CHECKSUM_LAYOUT_T layout;
+    FTDISession     ses;
+    string          manufacturer;
+    int             v;
+
+    img.chip = fallback;
+    if ( (img.size == 0) || (img.size > FTDI_MAX_EEPROM_SIZE) || (img.size & 1) )
+        return;
+
+    ifstream in( path, ios::binary );
+    in.read(reinterpret_cast<char *>(buf), img.size);
+    if ( !in.good() )
+        return;
+
+    img.chip = DumpIndex::chip_guess( buf, img.size, fallback );
+    img.checksum_ok =
+        (EEPROMChecksum::layout(img.chip, img.size, &layout) == 0)
+        && EEPROMChecksum::check(buf, layout);
+
+    if (ses.load( buf, img.size ) < 0)
+        return;
+    ses.context()->type = img.chip;
+    if (ses.decode() < 0)
+        return;
+
+    if (ses.get_value( VENDOR_ID, &v ) == 0)    img.vid = v;
+    if (ses.get_value( PRODUCT_ID, &v ) == 0)   img.pid = v;
+    ses.get_strings( manufacturer, img.product, img.serial );
+    img.decoded = true;
+}
+
+/* offset of s in the string table, each string once */
+static uint32_t add_string( vector<char> &table,
+                            unordered_map<string, uint32_t> &seen, const string &s )
+{
+    unordered_map<string, uint32_t>::const_iterator it = seen.find( s );
+    uint32_t off;
+
+    if (it != seen.end())
+        return it->second;
+
+    off = table.size();
+    table.insert( table.end(), s.begin(), s.end() );
+    table.push_back( '\0' );
+    seen[s] = off;
+    return off;
+}
+
+static int write_index( const string &dir, vector<DUMPX_IMAGE_T> &all )
+{
+    vector<DUMPX_ENTRY_T>   entries( all.size() );
+    vector<uint32_t>        by_id( all.size() );
+    vector<char>            table;
+    unordered_map<string, uint32_t> seen;
+    DUMPX_HEADER_T h;
+    string path = dir + "/" + DUMPX_FILE;
+    string tmp = path + ".tmp";
+    int fd, rc = 0;
+    size_t i;
+
+    sort( all.begin(), all.end(),
+        []( const DUMPX_IMAGE_T &a, const DUMPX_IMAGE_T &b ) {
+            return (a.serial != b.serial) ? (a.serial < b.serial) : (a.file < b.file);
+        } );
+
+    add_string( table, seen, "" );
+    for (i = 0; i < all.size(); i++) {
+        DUMPX_ENTRY_T &e = entries[i];
+
+        memset(&e, 0, sizeof(e));
+        e.mtime   = all[i].mtime;
+        e.file    = add_string( table, seen, all[i].file );
+        e.serial  = add_string( table, seen, all[i].serial );
+        e.product = add_string( table, seen, all[i].product );
+        e.size    = all[i].size;
+        e.vid     = all[i].vid;
+        e.pid     = all[i].pid;
+        e.chip    = all[i].chip;
+        e.flags   = (all[i].decoded ? DUMPX_DECODED : 0)
+                  | (all[i].checksum_ok ? DUMPX_CHECKSUM_OK : 0);
+    }
+
+    iota( by_id.begin(), by_id.end(), 0 );
+    sort( by_id.begin(), by_id.end(),
+        [&entries]( uint32_t a, uint32_t b ) {
+            const DUMPX_ENTRY_T &x = entries[a], &y = entries[b];
+
+            if (x.vid != y.vid)     return x.vid < y.vid;
+            if (x.pid != y.pid)     return x.pid < y.pid;
+            if (x.mtime != y.mtime) return x.mtime < y.mtime;
+            return a < b;
+        } );
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DUMPX_MAGIC, sizeof(h.magic));
+    h.version = DUMPX_VERSION;
+    h.header_size = sizeof(DUMPX_HEADER_T);
+    h.count = entries.size();
+    h.strings = table.size();
+
+    if ((fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -errno;
+
+    errno = 0;
+    if ( (::write(fd, &h, sizeof(h)) != sizeof(h))
+        || (::write(fd, entries.data(), entries.size() * sizeof(DUMPX_ENTRY_T))
+            != (ssize_t)(entries.size() * sizeof(DUMPX_ENTRY_T)))
+        || (::write(fd, by_id.data(), by_id.size() * sizeof(uint32_t))
+            != (ssize_t)(by_id.size() * sizeof(uint32_t)))
+        || (::write(fd, table.data(), table.size()) != (ssize_t)table.size())
+        || (fsync(fd) < 0) )
+        rc = errno ? -errno : -EIO;
+
+    ::close(fd);
+
+    if ( (rc == 0) && (rename(tmp.c_str(), path.c_str()) < 0) )
+        rc = -errno;
+    if (rc < 0)
+        unlink(tmp.c_str());
+
+    return rc;
+}
+
+static bool query_match( const DUMPX_IMAGE_T &img, const DUMPX_QUERY_T &q )
+{
+    return ( !q.by_serial || (img.serial == q.serial) )
+        && ( !q.vid   || (img.vid == q.vid) )
+        && ( !q.pid   || (img.pid == q.pid) )
+        && ( !q.since || (img.mtime >= q.since) )
+        && ( !q.until || (img.mtime <  q.until) );
+}
+
+/* "-7d", "-12h" (before now), "2017-06-01" (local midnight), or seconds */
+static int parse_time( const string &s, time_t *t )
+{
+    struct tm tm;
+    const char *end;
+    char *p;
+    long n;
+
+    if ( (s.size() > 2) && (s[0] == '-') ) {
+        n = strtol( s.c_str() + 1, &p, 10 );
+        if ( (n <= 0) || (p[0] == '\0') || (p[1] != '\0') )
+            return -EINVAL;
+        if (*p == 'd')          n *= 24 * 3600;
+        else if (*p == 'h')     n *= 3600;
+        else                    return -EINVAL;
+        *t = time(NULL) - n;
+        return 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if ( ((end = strptime( s.c_str(), "%Y-%m-%d", &tm )) != NULL) && (*end == '\0') ) {
+        tm.tm_isdst = -1;
+        *t = mktime( &tm );
+        return 0;
+    }
+
+    n = strtol( s.c_str(), &p, 10 );
+    if ( s.empty() || (*p != '\0') || (n <= 0) )
+        return -EINVAL;
+    *t = n;
+    return 0;
+}
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+DumpIndex::DumpIndex()
+    : map(NULL), map_size(0), entries(NULL), by_id(NULL), strings(NULL),
+      strings_size(0), count(0)
+{
+}
+
+DumpIndex::~DumpIndex()
+{
+    close();
+}
+
+/* ------------------------------------------------------------------ */
+
+int DumpIndex::open( string dir )
+{
+    const DUMPX_HEADER_T *h;
+    struct stat st;
+    size_t need;
+    int fd;
+
+    close();
+
+    if ((fd = ::open((dir + "/" + DUMPX_FILE).c_str(), O_RDONLY)) < 0)
+        return -errno;
+
+    if ( (fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(DUMPX_HEADER_T)) ) {
+        ::close(fd);
+        return -EINVAL;
+    }
+
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return -errno;
+    }
+
+    h = static_cast<const DUMPX_HEADER_T *>(map);
+    need = sizeof(DUMPX_HEADER_T)
+         + h->count * (sizeof(DUMPX_ENTRY_T) + sizeof(uint32_t)) + h->strings;
+    if ( (memcmp(h->magic, DUMPX_MAGIC, sizeof(h->magic)) != 0)
+        || (h->version != DUMPX_VERSION)
+        || (h->header_size != sizeof(DUMPX_HEADER_T))
+        || (h->count > map_size) || (h->strings > map_size)
+        || (need != map_size) || (h->strings == 0) )
+    {
+        close();
+        return -EINVAL;
+    }
+
+    count   = h->count;
+    entries = reinterpret_cast<const DUMPX_ENTRY_T *>(h + 1);
+    by_id   = reinterpret_cast<const uint32_t *>(entries + count);
+    strings = reinterpret_cast<const char *>(by_id + count);
+    strings_size = h->strings;
+
+    /* every offset ends in the table */
+    if (strings[strings_size - 1] != '\0') {
+        close();
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void DumpIndex::close( void )
+{
+    if (map)
+        munmap(map, map_size);
+
+    map = NULL;
+    map_size = 0;
+    entries = NULL;
+    by_id = NULL;
+    strings = NULL;
+    strings_size = 0;
+    count = 0;
+}
+
+DUMPX_IMAGE_T DumpIndex::image( const DUMPX_ENTRY_T &e ) const
+{
+    DUMPX_IMAGE_T img;
+
+    img.file    = str( e.file );
+    img.serial  = str( e.serial );
+    img.product = str( e.product );
+    img.mtime   = e.mtime;
+    img.size    = e.size;
+    img.vid     = e.vid;
+    img.pid     = e.pid;
+    img.chip    = (enum ftdi_chip_type)e.chip;
+    img.decoded     = (e.flags & DUMPX_DECODED) != 0;
+    img.checksum_ok = (e.flags & DUMPX_CHECKSUM_OK) != 0;
+    return img;
+}
+
+int DumpIndex::find( const DUMPX_QUERY_T &q, vector<DUMPX_IMAGE_T> &found )
+{
+    size_t i;
+
+    if ( !map )
+        return -EBADF;
+
+    if (q.by_serial) {
+        const DUMPX_ENTRY_T *e = lower_bound( entries, entries + count, q.serial,
+            [this]( const DUMPX_ENTRY_T &x, const string &s ) {
+                return strcmp( str(x.serial), s.c_str() ) < 0;
+            } );
+
+        for ( ; (e < entries + count) && (q.serial == str(e->serial)); e++) {
+            DUMPX_IMAGE_T img = image( *e );
+
+            if ( query_match(img, q) )
+                found.push_back( img );
+        }
+    } else if (q.vid) {
+        /* (vid, pid, mtime) order: pid 0 starts the vid, since 0 the pid */
+        const uint32_t *p = lower_bound( by_id, by_id + count, q,
+            [this]( uint32_t n, const DUMPX_QUERY_T &k ) {
+                const DUMPX_ENTRY_T &x = entries[ (n < count) ? n : 0 ];
+
+                if (x.vid != k.vid)     return x.vid < k.vid;
+                if (x.pid != k.pid)     return x.pid < k.pid;
+                return k.pid && (x.mtime < (int64_t)k.since);
+            } );
+
+        for ( ; p < by_id + count; p++) {
+            const DUMPX_ENTRY_T &x = entries[ (*p < count) ? *p : 0 ];
+
+            if ( (x.vid != q.vid) || (q.pid && (x.pid != q.pid))
+                || (q.pid && q.until && (x.mtime >= (int64_t)q.until)) )
+                break;
+
+            DUMPX_IMAGE_T img = image( x );
+            if ( query_match(img, q) )
+                found.push_back( img );
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            DUMPX_IMAGE_T img = image( entries[i] );
+
+            if ( query_match(img, q) )
+                found.push_back( img );
+        }
+    }
+
+    return 0;
+}
+
+int DumpIndex::build( string dir, enum ftdi_chip_type fallback,
+                      DUMPX_STATS_T *stats )
+{
+    unordered_map<string, DUMPX_IMAGE_T>  old;
+    unordered_map<string, DUMPX_IMAGE_T>::iterator it;
+    vector<DUMPX_IMAGE_T>   all;
+    DumpIndex       prev;
+    DIR             *d;
+    struct dirent   *de;
+    struct stat     st;
+    size_t          i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    /* no index yet (or an unusable one): every dump is new */
+    if (prev.open( dir ) == 0) {
+        for (i = 0; i < prev.count; i++) {
+            DUMPX_IMAGE_T img = prev.image( prev.entries[i] );
+
+            old[img.file] = img;
+        }
+        prev.close();
+    }
+
+    if ((d = opendir( dir.c_str() )) == NULL)
+        return -errno;
+
+    while ((de = readdir( d )) != NULL) {
+        string name( de->d_name );
+        string path = dir + "/" + name;
+
+        if ( (name.size() <= strlen(DUMPX_SUFFIX))
+            || (name.compare(name.size() - strlen(DUMPX_SUFFIX), string::npos,
+                             DUMPX_SUFFIX) != 0) )
+            continue;
+        if ( (stat(path.c_str(), &st) < 0) || !S_ISREG(st.st_mode) )
+            continue;
+
+        if ( ((it = old.find( name )) != old.end())
+            && (it->second.mtime == (int64_t)st.st_mtime)
+            && (it->second.size == (unsigned int)st.st_size) )
+        {
+            all.push_back( it->second );
+            old.erase( it );
+            stats->kept++;
+            continue;
+        }
+        if (it != old.end())
+            old.erase( it );
+
+        DUMPX_IMAGE_T img = DUMPX_IMAGE_T();
+        img.file  = name;
+        img.mtime = st.st_mtime;
+        img.size  = ((size_t)st.st_size > 0xFFFF) ? 0xFFFF : st.st_size;
+        decode_dump( path, fallback, img );
+
+        all.push_back( img );
+        stats->decoded++;
+        if ( !img.decoded )
+            stats->failed++;
+    }
+    closedir( d );
+
+    stats->files   = all.size();
+    stats->removed = old.size();
+
+    return write_index( dir, all );
+}
+
+enum ftdi_chip_type DumpIndex::chip_guess( const unsigned char *img,
+                                           unsigned int size,
+                                           enum ftdi_chip_type fallback )
+{
+    unsigned int release;
+    size_t i;
+
+    if (size < 8)
+        return fallback;
+
+    release = img[6] | (img[7] << 8);
+    for (i = 0; i < sizeof(dumpx_release) / sizeof(dumpx_release[0]); i++) {
+        if (dumpx_release[i].release == release)
+            return dumpx_release[i].type;
+    }
+    return fallback;
+}
+
+int DumpIndex::parse_query( string spec, DUMPX_QUERY_T *q, string &err )
+{
+    istringstream   in( spec );
+    string          item, key, value;
+    size_t          pos;
+    char            *p;
+
+    *q = DUMPX_QUERY_T();
+
+    while (getline(in, item, ',')) {
+        if ((pos = item.find('=')) == string::npos) {
+            err = "not KEY=VALUE: " + item;
+            return -EINVAL;
+        }
+        key   = item.substr(0, pos);
+        value = item.substr(pos + 1);
+
+        if (key == "serial") {
+            q->by_serial = true;
+            q->serial = value;
+        } else if ( (key == "vid") || (key == "pid") ) {
+            unsigned long id = strtoul( value.c_str(), &p, 0 );
+
+            if ( value.empty() || (*p != '\0') || (id == 0) || (id > 0xFFFF) ) {
+                err = "bad " + key + ": " + value;
+                return -EINVAL;
+            }
+            ((key == "vid") ? q->vid : q->pid) = id;
+        } else if ( (key == "since") || (key == "until") ) {
+            if (parse_time( value, (key == "since") ? &q->since : &q->until ) < 0) {
+                err = "bad " + key + ": " + value;
+                return -EINVAL;
+            }
+        } else {
+            err = "unknown key: " + key;
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
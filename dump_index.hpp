@@ -0,0 +1,157 @@
+/*
+    Header of DumpIndex class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _DUMP_INDEX_HPP_
+#define _DUMP_INDEX_HPP_
+
+#include <stdint.h>         /* uint64_t, ... */
+#include <time.h>           /* time_t */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <ftdi.h>
+
+
+using namespace std;
+
+
+/* Index of a directory of EEPROM dumps (NAME.bin, e.g. --capture), every
+ * dump decoded once (FTDISession::decode, as FTDIDEV::decode):
+ *
+ *  DIR/dumps.idx   DUMPX_HEADER_T
+ *                  DUMPX_ENTRY_T[count], sorted by serial (then file)
+ *                  uint32_t[count], entries sorted by vid, pid, mtime
+ *                  strings (NUL terminated; entries hold their offsets)
+ *
+ * Lookups are binary searches in the mapped index: by serial, by vid[:pid]
+ * (and a time range with both). build() decodes only the dumps that are
+ * new or changed (name, mtime, size) since the index was written, drops
+ * the removed ones, and rewrites the index (tmp + rename).
+ *
+ * A dump does not say its chip type: the release number (bcdDevice) libftdi
+ * writes for each chip type tells it; unknown ones are decoded as the
+ * fallback type.
+ */
+#define DUMPX_MAGIC             "FTDD"
+#define DUMPX_VERSION           (1)
+#define DUMPX_FILE              "dumps.idx"
+#define DUMPX_SUFFIX            ".bin"
+
+/* DUMPX_ENTRY_T flags */
+#define DUMPX_DECODED           (1 << 0)    /* 0: strings / ids not known */
+#define DUMPX_CHECKSUM_OK       (1 << 1)
+
+typedef struct DUMPX_HEADER_S {
+    char        magic[4];           /* DUMPX_MAGIC */
+    uint16_t    version;            /* DUMPX_VERSION */
+    uint16_t    header_size;        /* sizeof(DUMPX_HEADER_T) */
+    uint64_t    count;
+    uint64_t    strings;            /* bytes of the string table */
+    uint8_t     reserved[40];
+} DUMPX_HEADER_T;
+
+typedef struct DUMPX_ENTRY_S {
+    int64_t     mtime;              /* of the dump, seconds */
+    uint32_t    file;               /* string offsets */
+    uint32_t    serial;
+    uint32_t    product;
+    uint16_t    size;               /* bytes of the dump */
+    uint16_t    vid;
+    uint16_t    pid;
+    uint8_t     chip;               /* enum ftdi_chip_type */
+    uint8_t     flags;              /* DUMPX_xxx */
+    uint8_t     reserved[4];
+} DUMPX_ENTRY_T;
+
+/* one entry, strings resolved */
+typedef struct DUMPX_IMAGE_S {
+    string      file;
+    string      serial;
+    string      product;
+    int64_t     mtime;
+    unsigned int    size;
+    unsigned int    vid, pid;
+    enum ftdi_chip_type chip;
+    bool        decoded;
+    bool        checksum_ok;
+} DUMPX_IMAGE_T;
+
+/* "serial=FT0005", "vid=0x403,pid=0x6015,since=-7d" (all given must match) */
+typedef struct DUMPX_QUERY_S {
+    bool        by_serial;
+    string      serial;
+    unsigned int    vid, pid;       /* 0: any */
+    time_t      since, until;       /* mtime in [since, until), 0: open */
+} DUMPX_QUERY_T;
+
+typedef struct DUMPX_STATS_S {
+    size_t      files;              /* dumps indexed */
+    size_t      decoded;            /* new or changed: decoded */
+    size_t      kept;               /* unchanged: entry of the old index */
+    size_t      removed;            /* in the old index, gone */
+    size_t      failed;             /* not decoded (still indexed) */
+} DUMPX_STATS_T;
+
+
+class DumpIndex {
+
+private:
+    void            *map;
+    size_t          map_size;
+    const DUMPX_ENTRY_T *entries;
+    const uint32_t  *by_id;
+    const char      *strings;
+    size_t          strings_size;
+    size_t          count;
+
+    const char      *str( uint32_t off ) const
+            { return (off < strings_size) ? strings + off : ""; }
+    DUMPX_IMAGE_T   image( const DUMPX_ENTRY_T &e ) const;
+
+public:
+    /* Constructor / Destructor */
+    DumpIndex();
+    ~DumpIndex();
+
+    /* DIR/dumps.idx, mapped read only */
+    int     open( string dir );
+    void    close( void );
+
+    size_t  get_count()     { return count; }
+
+    /* matches, by serial or by vid, pid, mtime */
+    int     find( const DUMPX_QUERY_T &q, vector<DUMPX_IMAGE_T> &found );
+
+    /* (re)index DIR: only new or changed dumps are decoded */
+    static int  build( string dir, enum ftdi_chip_type fallback,
+                       DUMPX_STATS_T *stats );
+
+    /* chip type from the release number of an encoded image */
+    static enum ftdi_chip_type  chip_guess( const unsigned char *img,
+                                            unsigned int size,
+                                            enum ftdi_chip_type fallback );
+
+    static int  parse_query( string spec, DUMPX_QUERY_T *q, string &err );
+
+};  /* class DumpIndex */
+
+#endif  /* _DUMP_INDEX_HPP_ */
@@ -0,0 +1,400 @@
+/*
+    Implementation of EEPROMChecksum class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include "eeprom_checksum.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+
+/* Bulk kernels: the checksum is a serial chain within one image, but images
+ * are independent. Run one image per 16-bit lane: load 8 words of 8 images,
+ * transpose 8x8 in registers, then xor/rotate word by word on all lanes.
+ * AVX2 does the same on two groups of 8 images (one per 128-bit half).
+ */
+#define LANES_SSE2              (8)
+#define LANES_AVX2              (16)
+
+
+/* ------------------------------------------------------------------ */
+
+static inline uint16_t get_word( const unsigned char *img, unsigned int i )
+{
+    return img[i*2] | (img[i*2+1] << 8);
+}
+
+static inline void put_word( unsigned char *img, unsigned int i, uint16_t w )
+{
+    img[i*2]   = w & 0xFF;
+    img[i*2+1] = w >> 8;
+}
+
+/* one segment [from, to) of one image, scalar */
+static inline uint16_t chain( uint16_t c, const unsigned char *img,
+                              unsigned int from, unsigned int to )
+{
+    for (unsigned int i = from; i < to; i++) {
+        c ^= get_word(img, i);
+        c = (c << 1) | (c >> 15);
+    }
+    return c;
+}
+
+/* ------------------------------------------------------------------ */
+
+int EEPROMChecksum::layout( enum ftdi_chip_type type, unsigned int size,
+                            CHECKSUM_LAYOUT_T *l )
+{
+    /* 93C46/56/66: 0x80/0x100/0x100 bytes; libftdi may see 0x40 */
+    if ( (size < 0x10) || (size > 0x100) || (size & 1) )
+        return -EINVAL;
+
+    /* FT232R: internal EEPROM, 0x80 bytes only */
+    if ( (type == TYPE_R) && (size != 0x80) )
+        return -EINVAL;
+
+    l->size = size;
+    l->words = size / 2 - 1;
+    l->skip_from = l->skip_to = 0;
+
+    /* FT230X: user area is not covered */
+    if ( (type == TYPE_230X) && (l->words > 0x40) ) {
+        l->skip_from = 0x12;
+        l->skip_to   = 0x40;
+    }
+
+    return 0;
+}
+
+uint16_t EEPROMChecksum::compute( const unsigned char *img,
+                                  const CHECKSUM_LAYOUT_T &l )
+{
+    uint16_t c = CHECKSUM_SEED;
+
+    if (l.skip_to) {
+        c = chain(c, img, 0, l.skip_from);
+        c = chain(c, img, l.skip_to, l.words);
+    } else {
+        c = chain(c, img, 0, l.words);
+    }
+
+    return c;
+}
+
+bool EEPROMChecksum::check( const unsigned char *img, const CHECKSUM_LAYOUT_T &l )
+{
+    return compute(img, l) == get_word(img, l.words);
+}
+
+void EEPROMChecksum::fix( unsigned char *img, const CHECKSUM_LAYOUT_T &l )
+{
+    put_word(img, l.words, compute(img, l));
+}
+
+/* ------------------------------------------------------------------ */
+
+#if defined(__SSE2__)
+
+static inline void transpose_sse2( __m128i r[8] )
+{
+    __m128i a[8], b[8];
+
+    for (int i = 0; i < 4; i++) {
+        a[i*2]   = _mm_unpacklo_epi16(r[i*2], r[i*2+1]);
+        a[i*2+1] = _mm_unpackhi_epi16(r[i*2], r[i*2+1]);
+    }
+
+    b[0] = _mm_unpacklo_epi32(a[0], a[2]);
+    b[1] = _mm_unpackhi_epi32(a[0], a[2]);
+    b[2] = _mm_unpacklo_epi32(a[1], a[3]);
+    b[3] = _mm_unpackhi_epi32(a[1], a[3]);
+    b[4] = _mm_unpacklo_epi32(a[4], a[6]);
+    b[5] = _mm_unpackhi_epi32(a[4], a[6]);
+    b[6] = _mm_unpacklo_epi32(a[5], a[7]);
+    b[7] = _mm_unpackhi_epi32(a[5], a[7]);
+
+    for (int i = 0; i < 4; i++) {
+        r[i*2]   = _mm_unpacklo_epi64(b[i], b[i+4]);
+        r[i*2+1] = _mm_unpackhi_epi64(b[i], b[i+4]);
+    }
+}
+
+static inline __m128i step_sse2( __m128i c, __m128i w )
+{
+    c = _mm_xor_si128(c, w);
+    return _mm_or_si128(_mm_slli_epi16(c, 1), _mm_srli_epi16(c, 15));
+}
+
+static __m128i chain_sse2( __m128i c, const unsigned char *img[LANES_SSE2],
+                           unsigned int from, unsigned int to )
+{
+    __m128i r[8];
+    unsigned int i = from;
+
+    for ( ; i + 8 <= to; i += 8) {
+        for (int k = 0; k < 8; k++)
+            r[k] = _mm_loadu_si128((const __m128i *)(img[k] + i*2));
+        transpose_sse2(r);
+        for (int k = 0; k < 8; k++)
+            c = step_sse2(c, r[k]);
+    }
+
+    /* tail: less than 8 words */
+    for ( ; i < to; i++) {
+        __m128i w = _mm_set_epi16(
+            get_word(img[7], i), get_word(img[6], i),
+            get_word(img[5], i), get_word(img[4], i),
+            get_word(img[3], i), get_word(img[2], i),
+            get_word(img[1], i), get_word(img[0], i));
+        c = step_sse2(c, w);
+    }
+
+    return c;
+}
+
+static void group_sse2( const unsigned char *img[LANES_SSE2],
+                        const CHECKSUM_LAYOUT_T &l, uint16_t *out )
+{
+    __m128i c = _mm_set1_epi16((short)CHECKSUM_SEED);
+
+    if (l.skip_to) {
+        c = chain_sse2(c, img, 0, l.skip_from);
+        c = chain_sse2(c, img, l.skip_to, l.words);
+    } else {
+        c = chain_sse2(c, img, 0, l.words);
+    }
+
+    _mm_storeu_si128((__m128i *)out, c);
+}
+
+#endif  /* __SSE2__ */
+
+
+#if defined(HAVE_AVX2_KERNEL)
+
+/* unpack* work inside each 128-bit half: same transpose as SSE2 */
+__attribute__((target("avx2")))
+static inline void transpose_avx2( __m256i r[8] )
+{
+    __m256i a[8], b[8];
+
+    for (int i = 0; i < 4; i++) {
+        a[i*2]   = _mm256_unpacklo_epi16(r[i*2], r[i*2+1]);
+        a[i*2+1] = _mm256_unpackhi_epi16(r[i*2], r[i*2+1]);
+    }
+
+    b[0] = _mm256_unpacklo_epi32(a[0], a[2]);
+    b[1] = _mm256_unpackhi_epi32(a[0], a[2]);
+    b[2] = _mm256_unpacklo_epi32(a[1], a[3]);
+    b[3] = _mm256_unpackhi_epi32(a[1], a[3]);
+    b[4] = _mm256_unpacklo_epi32(a[4], a[6]);
+    b[5] = _mm256_unpackhi_epi32(a[4], a[6]);
+    b[6] = _mm256_unpacklo_epi32(a[5], a[7]);
+    b[7] = _mm256_unpackhi_epi32(a[5], a[7]);
+
+    for (int i = 0; i < 4; i++) {
+        r[i*2]   = _mm256_unpacklo_epi64(b[i], b[i+4]);
+        r[i*2+1] = _mm256_unpackhi_epi64(b[i], b[i+4]);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i step_avx2( __m256i c, __m256i w )
+{
+    c = _mm256_xor_si256(c, w);
+    return _mm256_or_si256(_mm256_slli_epi16(c, 1), _mm256_srli_epi16(c, 15));
+}
+
+/* lane k: image k (low half) and image k+8 (high half) */
+__attribute__((target("avx2")))
+static __m256i chain_avx2( __m256i c, const unsigned char *img[LANES_AVX2],
+                           unsigned int from, unsigned int to )
+{
+    __m256i r[8];
+    unsigned int i = from;
+
+    for ( ; i + 8 <= to; i += 8) {
+        for (int k = 0; k < 8; k++) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(img[k]   + i*2));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(img[k+8] + i*2));
+            r[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        }
+        transpose_avx2(r);
+        for (int k = 0; k < 8; k++)
+            c = step_avx2(c, r[k]);
+    }
+
+    for ( ; i < to; i++) {
+        __m256i w = _mm256_set_epi16(
+            get_word(img[15], i), get_word(img[14], i),
+            get_word(img[13], i), get_word(img[12], i),
+            get_word(img[11], i), get_word(img[10], i),
+            get_word(img[9],  i), get_word(img[8],  i),
+            get_word(img[7],  i), get_word(img[6],  i),
+            get_word(img[5],  i), get_word(img[4],  i),
+            get_word(img[3],  i), get_word(img[2],  i),
+            get_word(img[1],  i), get_word(img[0],  i));
+        c = step_avx2(c, w);
+    }
+
+    return c;
+}
+
+__attribute__((target("avx2")))
+static void group_avx2( const unsigned char *img[LANES_AVX2],
+                        const CHECKSUM_LAYOUT_T &l, uint16_t *out )
+{
+    __m256i c = _mm256_set1_epi16((short)CHECKSUM_SEED);
+
+    if (l.skip_to) {
+        c = chain_avx2(c, img, 0, l.skip_from);
+        c = chain_avx2(c, img, l.skip_to, l.words);
+    } else {
+        c = chain_avx2(c, img, 0, l.words);
+    }
+
+    _mm256_storeu_si256((__m256i *)out, c);
+}
+
+static bool have_avx2( void )
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+
+    return avx2;
+}
+
+#endif  /* HAVE_AVX2_KERNEL */
+
+
+/* ------------------------------------------------------------------ */
+
+/* Compute checksums of images [0, count) into sum[], widest kernel first */
+static void compute_bulk( const unsigned char *images, size_t count,
+                          size_t stride, const CHECKSUM_LAYOUT_T &l,
+                          uint16_t *sum )
+{
+    size_t n = 0;
+
+#if defined(HAVE_AVX2_KERNEL)
+    if ( have_avx2() ) {
+        const unsigned char *img[LANES_AVX2];
+
+        for ( ; n + LANES_AVX2 <= count; n += LANES_AVX2) {
+            for (int k = 0; k < LANES_AVX2; k++)
+                img[k] = images + (n + k) * stride;
+            group_avx2(img, l, sum + n);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    {
+        const unsigned char *img[LANES_SSE2];
+
+        for ( ; n + LANES_SSE2 <= count; n += LANES_SSE2) {
+            for (int k = 0; k < LANES_SSE2; k++)
+                img[k] = images + (n + k) * stride;
+            group_sse2(img, l, sum + n);
+        }
+    }
+#endif
+
+    for ( ; n < count; n++)
+        sum[n] = EEPROMChecksum::compute(images + n * stride, l);
+}
+
+/* images per compute_bulk() call: keeps sum[] on the stack */
+#define BULK_BATCH              (256)
+
+size_t EEPROMChecksum::verify_bulk( const unsigned char *images, size_t count,
+                                    size_t stride, const CHECKSUM_LAYOUT_T &l,
+                                    uint8_t *bad )
+{
+    uint16_t sum[BULK_BATCH];
+    size_t nbad = 0;
+
+    for (size_t base = 0; base < count; base += BULK_BATCH) {
+        size_t n = count - base;
+
+        if (n > BULK_BATCH)
+            n = BULK_BATCH;
+
+        compute_bulk(images + base * stride, n, stride, l, sum);
+
+        for (size_t i = 0; i < n; i++) {
+            bool wrong = (sum[i] != get_word(images + (base + i) * stride, l.words));
+
+            if (bad)
+                bad[base + i] = wrong;
+            nbad += wrong;
+        }
+    }
+
+    return nbad;
+}
+
+size_t EEPROMChecksum::repair_bulk( unsigned char *images, size_t count,
+                                    size_t stride, const CHECKSUM_LAYOUT_T &l )
+{
+    uint16_t sum[BULK_BATCH];
+    size_t nbad = 0;
+
+    for (size_t base = 0; base < count; base += BULK_BATCH) {
+        size_t n = count - base;
+
+        if (n > BULK_BATCH)
+            n = BULK_BATCH;
+
+        compute_bulk(images + base * stride, n, stride, l, sum);
+
+        /* only touch wrong words: clean pages of a mapping stay clean */
+        for (size_t i = 0; i < n; i++) {
+            unsigned char *img = images + (base + i) * stride;
+
+            if (sum[i] != get_word(img, l.words)) {
+                put_word(img, l.words, sum[i]);
+                nbad++;
+            }
+        }
+    }
+
+    return nbad;
+}
+
+const char *EEPROMChecksum::kernel( void )
+{
+#if defined(HAVE_AVX2_KERNEL)
+    if ( have_avx2() )
+        return "avx2";
+#endif
+#if defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
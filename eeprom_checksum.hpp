@@ -0,0 +1,79 @@
+/*
+    Header of EEPROMChecksum class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _EEPROM_CHECKSUM_HPP_
+#define _EEPROM_CHECKSUM_HPP_
+
+#include <stdint.h>         /* uint16_t */
+#include <stddef.h>         /* size_t */
+#include <ftdi.h>
+
+
+/* libftdi checksum (ftdi_eeprom_build):
+ *
+ *  checksum = 0xAAAA
+ *  for each word w before the checksum word (skip range excluded)
+ *      checksum = rotate_left_1(checksum ^ w)
+ *
+ *  checksum word   last word of the EEPROM: size / 2 - 1
+ *  skip range      FT230X: words 0x12 - 0x3F (user area, not protected)
+ */
+#define CHECKSUM_SEED           (0xAAAA)
+
+typedef struct CHECKSUM_LAYOUT_S {
+    unsigned int    size;           /* bytes of one image */
+    unsigned int    words;          /* checksum word index */
+    unsigned int    skip_from;      /* excluded words [from, to) */
+    unsigned int    skip_to;
+} CHECKSUM_LAYOUT_T;
+
+
+class EEPROMChecksum {
+
+public:
+    /* placement for chip type & EEPROM size (even, 0x10 - 0x100) */
+    static int      layout( enum ftdi_chip_type type, unsigned int size,
+                            CHECKSUM_LAYOUT_T *l );
+
+    /* one image */
+    static uint16_t compute( const unsigned char *img, const CHECKSUM_LAYOUT_T &l );
+    static bool     check( const unsigned char *img, const CHECKSUM_LAYOUT_T &l );
+    static void     fix( unsigned char *img, const CHECKSUM_LAYOUT_T &l );
+
+    /* 'count' images, 'stride' bytes apart.
+     * verify: bad[i] = 1 if image i is wrong (bad may be NULL)
+     * repair: fix images in place
+     * both return the number of bad images
+     */
+    static size_t   verify_bulk( const unsigned char *images, size_t count,
+                                 size_t stride, const CHECKSUM_LAYOUT_T &l,
+                                 uint8_t *bad );
+    static size_t   repair_bulk( unsigned char *images, size_t count,
+                                 size_t stride, const CHECKSUM_LAYOUT_T &l );
+
+    /* "avx2", "sse2" or "scalar" */
+    static const char *kernel( void );
+
+};  /* class EEPROMChecksum */
+
+#endif  /* _EEPROM_CHECKSUM_HPP_ */
@@ -0,0 +1,138 @@
+/*
+    Implementation of FleetCapture class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include <string.h>         /* strerror */
+#include <cctype>           /* isalnum */
+#include <unistd.h>         /* access */
+#include "fleet_capture.hpp"
+#include "ftdi_server.hpp"  /* escape */
+
+
+/* ------------------------------------------------------------------ */
+
+string FleetCapture::file_name( const string &serial, int bus, int dev, bool port )
+{
+    string name;
+
+    for (size_t i = 0; i < serial.size(); i++) {
+        char c = serial[i];
+
+        name += ( isalnum((unsigned char)c) || (c == '-') || (c == '_')
+                  || ((c == '.') && (i > 0)) ) ? c : '_';
+    }
+    if (name.empty())
+        name = "bus-" + to_string(bus) + "-dev-" + to_string(dev);
+    else if (port)
+        name += "-bus-" + to_string(bus) + "-dev-" + to_string(dev);
+
+    return name + CAPTURE_SUFFIX;
+}
+
+/* read, decode (for the serial), queue the image: the writer does the rest */
+void FleetCapture::capture_one( CAPTURE_DEVICE_T &d )
+{
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    FTDISession     ses;
+    string          m, p, s;
+
+    if ( ((d.rc = ses.open(d.bus, d.dev, d.vid, d.pid)) < 0)
+        || ((d.rc = ses.probe()) < 0)
+        || ((d.rc == 0) && ((d.rc = ses.read()) < 0)) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+
+    d.size = ses.get_size();
+    if ( ses.is_blank() || (d.size <= 0) ) {
+        d.rc  = -ENODATA;
+        d.err = "EEPROM is blank";
+        goto done;
+    }
+
+    if ( ((d.rc = ses.store(buf, d.size)) < 0)
+        || ((d.rc = ses.decode()) < 0) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+    ses.get_strings( m, p, s );
+
+    /* the same serial on two boards: one file each */
+    d.file = file_name( s, d.bus, d.dev );
+    d.replaced = (access( (dir + "/" + d.file).c_str(), F_OK ) == 0);
+    if ((d.rc = writer.put( d.file, buf, d.size, &d.file_rc )) == -EEXIST) {
+        d.file = file_name( s, d.bus, d.dev, true );
+        d.replaced = (access( (dir + "/" + d.file).c_str(), F_OK ) == 0);
+        d.rc = writer.put( d.file, buf, d.size, &d.file_rc );
+    }
+    if (d.rc < 0)
+        d.err = "queue " + d.file + ": " + strerror(-d.rc);
+
+done:
+    ses.close();
+}
+
+int FleetCapture::run( FILE *out )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    const char  *backend;
+    size_t  i;
+    int     nok = 0, nerr = 0, rc;
+
+    if ((rc = writer.open( dir )) < 0)
+        return rc;
+    backend = writer.backend();
+
+    DeviceRunner::run( devs, RUNNER_MAX_THREADS, [this]( CAPTURE_DEVICE_T &d ) {
+        capture_one( d );
+    } );
+
+    /* every file renamed into place (or failed) */
+    writer.close();
+
+    for (i = 0; i < devs.size(); i++) {
+        CAPTURE_DEVICE_T &d = devs[i];
+        ostringstream fields;
+
+        if ( (d.rc == 0) && (d.file_rc < 0) ) {
+            d.rc  = d.file_rc;
+            d.err = "write " + d.file + ": " + strerror(-d.file_rc);
+        }
+
+        if (d.rc == 0)
+            fields << " size=" << d.size << " file=" << FTDIServer::escape(d.file)
+                   << (d.replaced ? " replaced=1" : "");
+
+        (d.rc < 0) ? nerr++ : nok++;
+        DeviceRunner::device_line( out, d, (d.rc < 0) ? "error" : "ok", fields.str() );
+    }
+
+    DeviceRunner::summary( out, devs.size(), " ok=" + to_string(nok)
+        + " error=" + to_string(nerr) + " batches=" + to_string(writer.get_batches())
+        + " writer=" + backend, t0 );
+
+    return nerr;
+}
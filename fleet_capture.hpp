@@ -0,0 +1,89 @@
+/*
+    Header of FleetCapture class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _FLEET_CAPTURE_HPP_
+#define _FLEET_CAPTURE_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include "ftdi_session.hpp"
+#include "archive_writer.hpp"
+#include "device_runner.hpp"
+
+
+using namespace std;
+
+
+/* Dump the EEPROM of many devices into a directory, one file per device
+ * (SERIAL.bin, or bus-B-dev-D.bin without a serial). A serial already
+ * taken in the run gets SERIAL-bus-B-dev-D.bin; a dump of an earlier run
+ * with the same name is replaced, 'replaced=1' on the line. Devices are
+ * read in parallel; the files go through an ArchiveWriter (batched, fsync
+ * per batch), so the reads never wait on the file system.
+ *
+ *  device bus=1 dev=5 status=ok size=256 file=FT0005.bin ms=212
+ *  device bus=1 dev=6 status=ok size=256 file=FT0005-bus-1-dev-6.bin ms=215
+ *  device bus=1 dev=7 status=error ms=3 error=EEPROM%20is%20blank
+ *  summary devices=3 ok=2 error=1 batches=1 writer=io_uring ms=231
+ */
+#define CAPTURE_SUFFIX          ".bin"
+
+/* rc: read, then file */
+typedef struct CAPTURE_DEVICE_S : RUN_DEVICE_S {
+    int             size;
+    string          file;
+    bool            replaced;       /* an earlier dump of that name */
+    int             file_rc;        /* set by the writer */
+} CAPTURE_DEVICE_T;
+
+
+class FleetCapture {
+
+private:
+    string          dir;
+    vector<CAPTURE_DEVICE_T>    devs;
+    ArchiveWriter   writer;
+
+    void    capture_one( CAPTURE_DEVICE_T &d );
+
+public:
+    /* Constructor / Destructor */
+    FleetCapture( string dir ) : dir(dir) {}
+    ~FleetCapture() {}
+
+    void    add( int bus, int dev, int vid, int pid )
+            { DeviceRunner::add( devs, bus, dev, vid, pid ); }
+
+    /* returns number of failed devices, -errno on failure */
+    int     run( FILE *out );
+
+    /* serial -> file name (no '/', no control characters);
+     * port: with -bus-B-dev-D
+     */
+    static string   file_name( const string &serial, int bus, int dev,
+                               bool port = false );
+
+};  /* class FleetCapture */
+
+#endif  /* _FLEET_CAPTURE_HPP_ */
@@ -0,0 +1,297 @@
+/*
+    Implementation of FleetScan class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <fstream>          /* ifstream */
+#include <sstream>          /* ostringstream */
+#include <algorithm>        /* transform, replace */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include "fleet_scan.hpp"
+#include "ftdi_server.hpp"  /* escape */
+#include "patch_plan.hpp"
+#include "eeprom_checksum.hpp"
+#include "log_sink.hpp"     /* DeviceLog */
+
+
+/* not ftdi_eeprom_value: compared as strings / sizes */
+static const char *scan_extra_fields[] = {
+    "manufacturer", "product", "serial", "size",
+};
+
+/* "MAX_POWER" -> "max-power", same as the --set names */
+static string field_label( const char *name )
+{
+    string n( name );
+
+    transform(n.begin(), n.end(), n.begin(), ::tolower);
+    replace(n.begin(), n.end(), '_', '-');
+    return n;
+}
+
+static string hex_value( int v )
+{
+    ostringstream s;
+
+    s << "0x" << hex << v;
+    return s.str();
+}
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+FleetScan::FleetScan( int vid, int pid )
+    : golden_size(0), vid(vid), pid(pid)
+{
+    allowed.insert( SCAN_DEFAULT_ALLOW );
+}
+
+/* ------------------------------------------------------------------ */
+
+int FleetScan::load_golden( string fname )
+{
+    ifstream in( fname, ios::binary | ios::ate );
+    DeviceLog log;
+    long size;
+
+    if ( !in.good() ) {
+        log(LOGL_ERROR) << "Failed to open golden image " << fname << endl;
+        return -ENOENT;
+    }
+
+    size = in.tellg();
+    if ( (size <= 0) || (size > FTDI_MAX_EEPROM_SIZE) || (size & 1) ) {
+        log(LOGL_ERROR) << "Golden image " << fname << ": bad size " << size << endl;
+        return -EINVAL;
+    }
+
+    in.seekg(0, ios::beg);
+    in.read(reinterpret_cast<char *>(golden), size);
+    if ( !in.good() ) {
+        log(LOGL_ERROR) << "Failed to read golden image " << fname << endl;
+        return -EIO;
+    }
+
+    golden_size = size;
+    return 0;
+}
+
+int FleetScan::allow( string list, string &err )
+{
+    istringstream   in( list );
+    string          name;
+
+    allowed.clear();
+
+    while (getline(in, name, ',')) {
+        const PATCH_FIELD_T *f;
+        bool extra = false;
+
+        if (name.empty() || name == "none")
+            continue;
+
+        name = field_label( name.c_str() );
+        for (size_t i = 0; i < sizeof(scan_extra_fields) / sizeof(scan_extra_fields[0]); i++)
+            extra |= (name == scan_extra_fields[i]);
+
+        if (extra) {
+            allowed.insert( name );
+        } else if ((f = PatchPlan::find_field( name )) != NULL) {
+            allowed.insert( field_label(f->name) );
+        } else {
+            err = "unknown field: " + name;
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+int FleetScan::find_devices( int vid, int pid, vector< pair<int, int> > &found )
+{
+    FTDISession s;
+    struct ftdi_device_list *list = NULL, *p;
+    DeviceLog log;
+    int rc;
+
+    if ((rc = s.open(0, 0, 0, 0)) < 0) {
+        log(LOGL_ERROR) << s.error() << endl;
+        return rc;
+    }
+
+    if ((rc = ftdi_usb_find_all(s.context(), &list, vid, pid)) < 0) {
+        log(LOGL_ERROR) << "Failed to enumerate: "
+                        << ftdi_get_error_string(s.context()) << endl;
+        return -ENODEV;
+    }
+
+    for (p = list; p != NULL; p = p->next) {
+        found.push_back( make_pair((int)libusb_get_bus_number( p->dev ),
+                                   (int)libusb_get_device_address( p->dev )) );
+    }
+    ftdi_list_free( &list );
+
+    return 0;
+}
+
+/* Read the device (no write), compare with the golden image decoded as the
+ * same chip type.
+ */
+void FleetScan::scan_one( SCAN_DEVICE_T &d )
+{
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    CHECKSUM_LAYOUT_T layout;
+    FTDISession     ses, ref;
+    string          dm, dp, ds, gm, gp, gs;
+    int             size, gv, dv;
+    size_t          i;
+
+    if ( ((d.rc = ses.open(d.bus, d.dev, d.vid, d.pid)) < 0)
+        || ((d.rc = ses.probe()) < 0)
+        || ((d.rc == 0) && ((d.rc = ses.read()) < 0)) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+
+    size = ses.get_size();
+    if ( ses.is_blank() || (size <= 0) ) {
+        d.rc  = -ENODATA;
+        d.err = "EEPROM is blank";
+        goto done;
+    }
+
+    if ( ((d.rc = ses.store(buf, size)) < 0)
+        || ((d.rc = ses.decode()) < 0) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+
+    d.checksum_ok =
+        (EEPROMChecksum::layout(ses.context()->type, size, &layout) == 0)
+        && EEPROMChecksum::check(buf, layout);
+
+    /* golden image means what the device's chip type makes of it */
+    if ( ((d.rc = ref.load(golden, golden_size)) < 0) ) {
+        d.err = ref.error();
+        goto done;
+    }
+    ref.context()->type = ses.context()->type;
+    if ((d.rc = ref.decode()) < 0) {
+        d.err = ref.error();
+        goto done;
+    }
+
+    if ( !is_allowed("size") && ((unsigned int)size != golden_size) )
+        d.drift.push_back( make_pair(string("size"),
+                to_string(golden_size) + ":" + to_string(size)) );
+
+    for (i = 0; PatchPlan::field_at(i) != NULL; i++) {
+        const PATCH_FIELD_T *f = PatchPlan::field_at(i);
+        string name = field_label( f->name );
+
+        if ( is_allowed(name) )
+            continue;
+        if ( (ref.get_value(f->value_name, &gv) < 0)
+            || (ses.get_value(f->value_name, &dv) < 0) )
+            continue;
+
+        if (gv != dv) {
+            d.drift.push_back( make_pair(name, (f->max > 0xFF)
+                ? hex_value(gv) + ":" + hex_value(dv)
+                : to_string(gv) + ":" + to_string(dv)) );
+        }
+    }
+
+    ses.get_strings( dm, dp, ds );
+    ref.get_strings( gm, gp, gs );
+    d.serial = ds;
+
+    if ( !is_allowed("manufacturer") && (gm != dm) )
+        d.drift.push_back( make_pair(string("manufacturer"), gm + ":" + dm) );
+    if ( !is_allowed("product") && (gp != dp) )
+        d.drift.push_back( make_pair(string("product"), gp + ":" + dp) );
+    if ( !is_allowed("serial") && (gs != ds) )
+        d.drift.push_back( make_pair(string("serial"), gs + ":" + ds) );
+
+    d.rc = 0;
+
+done:
+    ses.close();
+}
+
+int FleetScan::run( FILE *out )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    vector<SCAN_DEVICE_T>   devs;
+    vector< pair<int, int> > found;
+    size_t  i;
+    int     nok = 0, ndrift = 0, nerr = 0, rc;
+
+    if (golden_size == 0)
+        return -EINVAL;
+
+    if ((rc = find_devices( vid, pid, found )) < 0)
+        return rc;
+
+    for (i = 0; i < found.size(); i++)
+        DeviceRunner::add( devs, found[i].first, found[i].second, 0, 0 );
+
+    DeviceRunner::run( devs, RUNNER_MAX_THREADS, [this]( SCAN_DEVICE_T &d ) {
+        scan_one( d );
+    } );
+
+    for (i = 0; i < devs.size(); i++) {
+        SCAN_DEVICE_T &d = devs[i];
+        ostringstream fields, tail;
+        const char *status;
+
+        if (d.rc < 0) {
+            status = "error";
+            nerr++;
+        } else if ( !d.drift.empty() || !d.checksum_ok ) {
+            status = "drift";
+            ndrift++;
+        } else {
+            status = "ok";
+            nok++;
+        }
+
+        if (d.rc == 0) {
+            fields << " serial=" << FTDIServer::escape(d.serial)
+                   << " checksum=" << (d.checksum_ok ? "ok" : "bad");
+        }
+        if ( !d.drift.empty() ) {
+            tail << " drift=" << d.drift.size();
+            for (size_t k = 0; k < d.drift.size(); k++)
+                tail << " " << d.drift[k].first << "="
+                     << FTDIServer::escape(d.drift[k].second);
+        }
+
+        DeviceRunner::device_line( out, d, status, fields.str(), tail.str() );
+    }
+
+    DeviceRunner::summary( out, devs.size(), " ok=" + to_string(nok)
+        + " drift=" + to_string(ndrift) + " error=" + to_string(nerr), t0 );
+
+    return ndrift + nerr;
+}
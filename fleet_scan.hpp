@@ -0,0 +1,90 @@
+/*
+    Header of FleetScan class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _FLEET_SCAN_HPP_
+#define _FLEET_SCAN_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <set>              /* set */
+#include <vector>           /* vector */
+#include <utility>          /* pair */
+#include "ftdi_session.hpp"
+#include "device_runner.hpp"
+
+
+using namespace std;
+
+
+/* Read-only drift check of every connected device against a golden image.
+ * One line per device, then a summary (values %XX escaped, like the daemon):
+ *
+ *  device bus=1 dev=5 status=ok serial=FT0005 checksum=ok ms=212
+ *  device bus=1 dev=6 status=drift serial=FT0006 checksum=ok ms=220 drift=1 max-power=100:90
+ *  device bus=1 dev=9 status=error ms=3 error=read%20EEPROM:%20...
+ *  summary devices=3 ok=1 drift=1 error=1 ms=231
+ *
+ * A drifted field is reported as NAME=GOLDEN:DEVICE. Fields are the --set
+ * names plus manufacturer / product / serial / size.
+ */
+#define SCAN_DEFAULT_ALLOW      "serial"
+
+/* rc 0: compared, <0: failed */
+typedef struct SCAN_DEVICE_S : RUN_DEVICE_S {
+    string          serial;
+    bool            checksum_ok;
+    vector< pair<string, string> >  drift;  /* name, "golden:device" */
+} SCAN_DEVICE_T;
+
+
+class FleetScan {
+
+private:
+    unsigned char   golden[FTDI_MAX_EEPROM_SIZE];
+    unsigned int    golden_size;
+    set<string>     allowed;        /* per-unit fields, not compared */
+    int             vid, pid;       /* 0: libftdi default FTDI ids */
+
+    bool    is_allowed( const string &name ) { return allowed.count(name) > 0; }
+
+    void    scan_one( SCAN_DEVICE_T &d );
+
+public:
+    /* Constructor / Destructor */
+    FleetScan( int vid, int pid );
+    ~FleetScan() {}
+
+    int     load_golden( string fname );
+
+    /* "serial,product,cbus-function-0" (comma separated, replaces default) */
+    int     allow( string list, string &err );
+
+    /* returns number of drifted or failed devices, -errno on failure */
+    int     run( FILE *out );
+
+    /* bus:dev of every connected device with vid:pid (0:0 FTDI ids) */
+    static int  find_devices( int vid, int pid, vector< pair<int, int> > &found );
+
+};  /* class FleetScan */
+
+#endif  /* _FLEET_SCAN_HPP_ */
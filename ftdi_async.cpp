@@ -0,0 +1,291 @@
+/*
+    Implementation of FTDIAsync class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <algorithm>        /* find */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memset */
+#include <poll.h>           /* poll */
+#include "ftdi_async.hpp"
+
+
+/* what failed, by state */
+static const char *async_steps[] = {
+    "probe EEPROM", "read EEPROM", "reset", "poll modem status",
+    "set latency timer", "write EEPROM", "done",
+};
+
+
+/* ------------------------------------------------------------------ */
+
+void FTDIAsync::add( FTDI_ASYNC_JOB_T *job )
+{
+    jobs.push_back( job );
+}
+
+/* next transfer of the job's state */
+void FTDIAsync::submit( FTDI_ASYNC_JOB_T &j )
+{
+    struct ftdi_context *ftdi = j.ses->context();
+    unsigned int timeout = ftdi->usb_write_timeout;
+    unsigned int w;
+    int rc;
+
+    switch (j.state) {
+    case ASYNC_PROBE:
+    case ASYNC_READ:
+        libusb_fill_control_setup(j.setup, FTDI_DEVICE_IN_REQTYPE,
+            SIO_READ_EEPROM_REQUEST, 0, j.word, 2);
+        timeout = ftdi->usb_read_timeout;
+        break;
+    case ASYNC_RESET:
+        libusb_fill_control_setup(j.setup, FTDI_DEVICE_OUT_REQTYPE,
+            SIO_RESET_REQUEST, SIO_RESET_SIO, ftdi->index, 0);
+        break;
+    case ASYNC_POLL_STATUS:
+        libusb_fill_control_setup(j.setup, FTDI_DEVICE_IN_REQTYPE,
+            SIO_POLL_MODEM_STATUS_REQUEST, 0, ftdi->index, 2);
+        timeout = ftdi->usb_read_timeout;
+        break;
+    case ASYNC_LATENCY:
+        libusb_fill_control_setup(j.setup, FTDI_DEVICE_OUT_REQTYPE,
+            SIO_SET_LATENCY_TIMER_REQUEST, FTDI_ASYNC_WRITE_LATENCY, ftdi->index, 0);
+        break;
+    case ASYNC_WRITE:
+        w = j.buf[j.word * 2] | (j.buf[j.word * 2 + 1] << 8);
+        libusb_fill_control_setup(j.setup, FTDI_DEVICE_OUT_REQTYPE,
+            SIO_WRITE_EEPROM_REQUEST, w, j.word, 0);
+        break;
+    default:
+        return;
+    }
+
+    libusb_fill_control_transfer(j.xfer, ftdi->usb_dev, j.setup,
+        complete, &j, timeout);
+
+    if ((rc = libusb_submit_transfer(j.xfer)) < 0)
+        finish(j, -EIO, async_steps[j.state]);
+}
+
+void LIBUSB_CALL FTDIAsync::complete( struct libusb_transfer *t )
+{
+    FTDI_ASYNC_JOB_T &j = *static_cast<FTDI_ASYNC_JOB_T *>(t->user_data);
+    int expect;
+
+    expect = ( (j.state == ASYNC_PROBE) || (j.state == ASYNC_READ)
+            || (j.state == ASYNC_POLL_STATUS) ) ? 2 : 0;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        j.err = string(async_steps[j.state])
+              + ((t->status == LIBUSB_TRANSFER_TIMED_OUT) ? ": timeout" : ": transfer failed");
+        j.loop->finish(j, (t->status == LIBUSB_TRANSFER_TIMED_OUT) ? -ETIMEDOUT : -EIO, NULL);
+        return;
+    }
+    if (t->actual_length < expect) {
+        j.err = string(async_steps[j.state]) + ": short read";
+        j.loop->finish(j, -EIO, NULL);
+        return;
+    }
+
+    j.loop->advance(j, libusb_control_transfer_get_data(t));
+}
+
+void FTDIAsync::advance( FTDI_ASYNC_JOB_T &j, const unsigned char *data )
+{
+    switch (j.state) {
+    case ASYNC_PROBE:
+        j.buf[j.word * 2]     = data[0];
+        j.buf[j.word * 2 + 1] = data[1];
+        j.word++;
+
+        /* programmed: go on reading from here */
+        if ( (data[0] != 0xFF) || (data[1] != 0xFF) ) {
+            j.state = ASYNC_READ;
+        } else if (j.word == FTDI_PROBE_WORDS) {
+            after_read(j, FTDI_PROBE_WORDS * 2);
+            return;
+        }
+        break;
+
+    case ASYNC_READ:
+        j.buf[j.word * 2]     = data[0];
+        j.buf[j.word * 2 + 1] = data[1];
+        if (++j.word == FTDI_MAX_EEPROM_SIZE / 2) {
+            after_read(j, FTDI_MAX_EEPROM_SIZE);
+            return;
+        }
+        break;
+
+    case ASYNC_RESET:
+        j.state = ASYNC_POLL_STATUS;
+        break;
+    case ASYNC_POLL_STATUS:
+        j.state = ASYNC_LATENCY;
+        break;
+    case ASYNC_LATENCY:
+        j.state = ASYNC_WRITE;
+        j.word  = 0;
+        break;
+
+    case ASYNC_WRITE:
+        j.word++;
+        /* do not write the reserved area (as ftdi_write_eeprom) */
+        if ( (j.ses->context()->type == TYPE_230X) && (j.word == 0x40) )
+            j.word = 0x50;
+        if (j.word >= j.nwords) {
+            finish(j, 0, NULL);
+            return;
+        }
+        break;
+
+    default:
+        return;
+    }
+
+    submit(j);
+}
+
+/* read done: the image to write, from the caller */
+void FTDIAsync::after_read( FTDI_ASYNC_JOB_T &j, unsigned int len )
+{
+    int rc, size;
+
+    if ((rc = j.ses->read_done(j.buf, len)) < 0) {
+        finish(j, rc, j.ses->error().c_str());
+        return;
+    }
+
+    if ((rc = j.ready ? j.ready(j) : 0) <= 0) {
+        finish(j, rc, "not written");
+        return;
+    }
+
+    size = j.ses->get_size();
+    if ( (size <= 0) || (size > FTDI_MAX_EEPROM_SIZE) ) {
+        finish(j, -EINVAL, "EEPROM size");
+        return;
+    }
+    if ((rc = j.ses->store(j.buf, size)) < 0) {
+        finish(j, rc, j.ses->error().c_str());
+        return;
+    }
+
+    j.nwords = size / 2;
+    j.state  = ASYNC_RESET;
+    submit(j);
+}
+
+void FTDIAsync::finish( FTDI_ASYNC_JOB_T &j, int rc, const char *what )
+{
+    if (j.state == ASYNC_DONE)
+        return;
+
+    j.rc = rc;
+    if ( (rc < 0) && j.err.empty() && what )
+        j.err = what;
+    j.ms = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - t0).count();
+
+    j.state = ASYNC_DONE;
+    active--;
+}
+
+int FTDIAsync::run( void )
+{
+    vector<libusb_context *>    ctxs;
+    vector<struct pollfd>       fds;
+    size_t  i, k;
+    int     nerr = 0;
+
+    t0 = chrono::steady_clock::now();
+    active = 0;
+
+    for (i = 0; i < jobs.size(); i++) {
+        FTDI_ASYNC_JOB_T &j = *jobs[i];
+
+        j.rc    = 0;
+        j.err.clear();
+        j.ms    = 0;
+        j.loop  = this;
+        j.xfer  = NULL;
+        j.word  = 0;
+        j.state = ASYNC_DONE;
+        memset(j.buf, 0xFF, sizeof(j.buf));
+
+        if ( !j.ses || !j.ses->is_open() ) {
+            j.rc  = -ENODEV;
+            j.err = "device not open";
+            continue;
+        }
+        if ((j.xfer = libusb_alloc_transfer(0)) == NULL) {
+            j.rc  = -ENOMEM;
+            j.err = "alloc transfer";
+            continue;
+        }
+
+        /* a libusb context per ftdi_context (ftdi_new) */
+        if (find(ctxs.begin(), ctxs.end(), j.ses->context()->usb_ctx) == ctxs.end())
+            ctxs.push_back( j.ses->context()->usb_ctx );
+
+        j.state = ASYNC_PROBE;
+        active++;
+    }
+
+    for (i = 0; i < jobs.size(); i++) {
+        if (jobs[i]->state == ASYNC_PROBE)
+            submit( *jobs[i] );
+    }
+
+    /* devices are open: the fd set does not change while running */
+    for (i = 0; i < ctxs.size(); i++) {
+        const struct libusb_pollfd **p = libusb_get_pollfds( ctxs[i] );
+
+        for (k = 0; p && p[k]; k++) {
+            struct pollfd pfd = { p[k]->fd, p[k]->events, 0 };
+
+            fds.push_back( pfd );
+        }
+        libusb_free_pollfds( p );
+    }
+
+    while (active > 0) {
+        /* no fds (backend without poll support): short sleep, then handle */
+        poll(fds.data(), fds.size(), fds.empty() ? 1 : FTDI_ASYNC_POLL_MS);
+
+        for (i = 0; i < ctxs.size(); i++) {
+            struct timeval zero = { 0, 0 };
+
+            libusb_handle_events_timeout_completed( ctxs[i], &zero, NULL );
+        }
+    }
+
+    for (i = 0; i < jobs.size(); i++) {
+        if (jobs[i]->xfer) {
+            libusb_free_transfer( jobs[i]->xfer );
+            jobs[i]->xfer = NULL;
+        }
+        if (jobs[i]->rc < 0)
+            nerr++;
+    }
+
+    return nerr;
+}
@@ -0,0 +1,125 @@
+/*
+    Header of FTDIAsync class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _FTDI_ASYNC_HPP_
+#define _FTDI_ASYNC_HPP_
+
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <functional>       /* function */
+#include <chrono>           /* steady_clock */
+#include <ftdi.h>           /* libusb.h */
+#include "ftdi_session.hpp"
+
+
+/* copied from libftdi::ftdi.h (not in every version) */
+#ifndef SIO_RESET_REQUEST
+#define SIO_RESET_REQUEST               (0x00)
+#define SIO_RESET_SIO                   (0)
+#endif
+#ifndef SIO_POLL_MODEM_STATUS_REQUEST
+#define SIO_POLL_MODEM_STATUS_REQUEST   (0x05)
+#endif
+#ifndef SIO_SET_LATENCY_TIMER_REQUEST
+#define SIO_SET_LATENCY_TIMER_REQUEST   (0x09)
+#endif
+
+/* ftdi_write_eeprom (traced from MProg): reset, poll status, latency 0x77 */
+#define FTDI_ASYNC_WRITE_LATENCY        (0x77)
+#define FTDI_ASYNC_POLL_MS              (10)
+
+
+using namespace std;
+
+
+enum FTDI_ASYNC_STATE {
+    ASYNC_PROBE,                    /* first FTDI_PROBE_WORDS words */
+    ASYNC_READ,                     /* the rest of FTDI_MAX_EEPROM_SIZE */
+    ASYNC_RESET,
+    ASYNC_POLL_STATUS,
+    ASYNC_LATENCY,
+    ASYNC_WRITE,                    /* one word per transfer */
+    ASYNC_DONE
+};
+
+class FTDIAsync;
+
+/* One device: an opened session. After the read (or blank probe), 'ready'
+ * loads the image to write into the session: 1: write it, 0: done, <0:
+ * failed (set err). rc / err / ms are set when the device is done.
+ */
+typedef struct FTDI_ASYNC_JOB_S {
+    FTDISession     *ses;
+    function<int (struct FTDI_ASYNC_JOB_S &)>  ready;
+
+    int             rc;
+    string          err;
+    long            ms;
+
+    /* state machine, owned by FTDIAsync */
+    enum FTDI_ASYNC_STATE   state;
+    int             word;
+    int             nwords;
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    unsigned char   setup[LIBUSB_CONTROL_SETUP_SIZE + 2];
+    struct libusb_transfer  *xfer;
+    FTDIAsync       *loop;
+} FTDI_ASYNC_JOB_T;
+
+
+/* One thread drives the EEPROM read / write of every device: one control
+ * transfer in flight per device (libusb asynchronous API), the next one
+ * submitted from the completion of the previous. The same requests as
+ * ftdi_read_eeprom / ftdi_write_eeprom (SIO_READ_EEPROM / SIO_WRITE_EEPROM,
+ * one word each), so a thread no longer waits on each transfer.
+ *
+ * Jobs are not copied: they must stay in place until run() returns.
+ */
+class FTDIAsync {
+
+private:
+    vector<FTDI_ASYNC_JOB_T *>  jobs;
+    unsigned int    active;
+    chrono::steady_clock::time_point    t0;
+
+    void    submit( FTDI_ASYNC_JOB_T &j );
+    void    advance( FTDI_ASYNC_JOB_T &j, const unsigned char *data );
+    void    after_read( FTDI_ASYNC_JOB_T &j, unsigned int len );
+    void    finish( FTDI_ASYNC_JOB_T &j, int rc, const char *what );
+
+    static void LIBUSB_CALL complete( struct libusb_transfer *t );
+
+public:
+    /* Constructor / Destructor */
+    FTDIAsync() : active(0) {}
+    ~FTDIAsync() {}
+
+    void    add( FTDI_ASYNC_JOB_T *job );
+
+    /* returns number of failed devices */
+    int     run( void );
+
+};  /* class FTDIAsync */
+
+#endif  /* _FTDI_ASYNC_HPP_ */
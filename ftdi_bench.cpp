@@ -0,0 +1,395 @@
+/*
+    Scaling benchmark of the programming flow on simulated devices
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <iostream>         /* cerr */
+#include <fstream>          /* ifstream */
+#include <sstream>          /* istringstream */
+#include <vector>           /* vector */
+#include <map>              /* map */
+#include <thread>           /* thread */
+#include <chrono>           /* steady_clock */
+#include <algorithm>        /* sort */
+#include <cstdio>           /* printf */
+#include <cstdlib>          /* strtoul */
+#include <cerrno>           /* errno */
+#include <getopt.h>         /* getopt_long */
+#include <sys/resource.h>   /* getrusage */
+#include <stdexcept>        /* runtime_error */
+#include "ftdi_session.hpp"
+#include "ftdi_dev.hpp"
+#include "sim_device.hpp"
+#include "ftdi_record.hpp"
+
+
+/* Every device count (1, 2, 4 ... max) programs 'rounds' boards per device,
+ * all devices at once (one thread per device, like the rack programmer):
+ *
+ *  open -> probe -> read -> decode -> update (pid, serial) -> encode -> write
+ *
+ * With --blank every board is a virgin part (erased before each board):
+ *
+ *  open -> probe -> load template -> decode -> update -> encode -> write
+ *
+ * One CSV line per device count:
+ *
+ *  devices,boards,errors,seconds,boards_per_min,speedup,p50_ms,p99_ms,floor_ms,cpu_pct,result
+ *
+ * With --replay every device serves a recording (ftdi_prog --record) at
+ * --speed times its recorded speed: a field session becomes the benchmark.
+ *
+ * speedup is boards/min relative to 1 device, floor_ms the USB time of one
+ * board (replay: p50 of 1 device). Thresholds (CSV: devices,min_speedup,max_p99_floor) are ratios, not
+ * times, so they hold on any machine; result is ok / FAIL / - (no threshold).
+ */
+#define BENCH_MAX_DEVICES       (64)
+#define BENCH_ROUNDS            (5)
+#define BENCH_IMAGE_SIZE        (128)
+#define BENCH_PID               (0x6015)
+
+typedef struct BENCH_THRESHOLD_S {
+    double          min_speedup;
+    double          max_p99_floor;  /* p99 / floor_ms */
+} BENCH_THRESHOLD_T;
+
+typedef struct BENCH_RESULT_S {
+    unsigned int    devices;
+    unsigned int    boards;
+    unsigned int    errors;
+    double          seconds;
+    double          per_min;
+    double          p50_ms, p99_ms;
+    double          cpu_pct;
+} BENCH_RESULT_T;
+
+
+static void usage( const char *name )
+{
+    cerr << "Usage: " << name << " [options]" << endl
+         << "  -n, --max-devices N  Largest device count (1, 2, 4 ... N), default "
+         << BENCH_MAX_DEVICES << endl
+         << "  -r, --rounds N       Boards per device, default " << BENCH_ROUNDS << endl
+         << "  -i, --image FILE     Template image (default: libftdi defaults)" << endl
+         << "  -c, --chip TYPE      Chip type of the devices, default R" << endl
+         << "  -t, --thresholds F   Check results against thresholds CSV" << endl
+         << "  -b, --blank          Blank EEPROMs (new-build line)" << endl
+         << "      --replay FILE    Devices replay a recording (ftdi_prog --record)" << endl
+         << "      --speed X        Replay at X times the recorded speed, default 1" << endl
+         << "      --open-us N      Open latency, default " << SIM_OPEN_US << endl
+         << "      --read-us N      Read latency per word, default " << SIM_READ_US << endl
+         << "      --write-us N     Write latency per word, default " << SIM_WRITE_US << endl;
+}
+
+/* libftdi defaults, the image of a board that was programmed before */
+static int default_image( enum ftdi_chip_type type, vector<unsigned char> &img )
+{
+    FTDISession ses;
+    unsigned char buf[BENCH_IMAGE_SIZE];
+    int rc;
+
+    if ((rc = ses.open(0, 0, 0, 0)) < 0)
+        return rc;
+
+    ses.context()->type = type;
+    if (ftdi_eeprom_initdefaults(ses.context(), (char *)"FTDI",
+            (char *)"FT Bench", (char *)"BENCH0000") < 0)
+        return -EINVAL;
+    ftdi_set_eeprom_value(ses.context(), CHIP_SIZE, BENCH_IMAGE_SIZE);
+
+    if ( ((rc = ses.encode()) < 0)
+        || ((rc = ses.store(buf, sizeof(buf))) < 0) )
+        return rc;
+
+    img.assign(buf, buf + sizeof(buf));
+    return 0;
+}
+
+static int load_image( const char *fname, vector<unsigned char> &img )
+{
+    ifstream in( fname, ios::binary );
+
+    img.assign( (istreambuf_iterator<char>(in)), istreambuf_iterator<char>() );
+    if ( img.empty() || (img.size() > FTDI_MAX_EEPROM_SIZE) || (img.size() & 1) )
+        return -EINVAL;
+
+    return 0;
+}
+
+static int load_thresholds( const char *fname, map<unsigned int, BENCH_THRESHOLD_T> &t )
+{
+    ifstream in( fname );
+    string line;
+
+    if ( !in.good() )
+        return -ENOENT;
+
+    while (getline(in, line)) {
+        istringstream s( line );
+        BENCH_THRESHOLD_T th;
+        unsigned int n;
+        char c1, c2;
+
+        if (line.empty() || (line[0] == '#') || !isdigit((unsigned char)line[0]))
+            continue;
+        if ( !(s >> n >> c1 >> th.min_speedup >> c2 >> th.max_p99_floor)
+            || (c1 != ',') || (c2 != ',') )
+            return -EINVAL;
+
+        t[n] = th;
+    }
+
+    return 0;
+}
+
+/* the single device flow of ftdi_prog: FTDIDEV on the transport */
+static int program_board( FTDITransport &t, const vector<unsigned char> &img,
+                          unsigned int bus_dev, unsigned int n )
+{
+    char serial[16];
+    OPT_UPDATE_T u = { 0, BENCH_PID, NULL, NULL, serial };
+    int rc;
+
+    snprintf(serial, sizeof(serial), "B%02u%05u", bus_dev % 100, n % 100000);
+
+    try {
+        FTDIDEV dev( &t, 1, bus_dev );      /* open, probe, read */
+
+        if ( (dev.is_EEPROM_blank()
+                && ((rc = dev.set_buffer(img.data(), img.size())) < 0))
+            || ((rc = dev.decode(0)) < 0)
+            || ((rc = dev.update(u)) < 0)
+            || ((rc = dev.encode(0)) < 0)
+            || ((rc = dev.write(true, "", false)) < 0) )
+        {
+            return rc;
+        }
+    } catch (const std::runtime_error &e) {
+        return -EIO;                        /* open or read, logged */
+    }
+
+    return 0;
+}
+
+static double cpu_seconds( void )
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+         + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double percentile( vector<double> &v, double p )
+{
+    size_t i;
+
+    if (v.empty())
+        return 0;
+
+    sort(v.begin(), v.end());
+    i = (size_t)(p * v.size() + 0.999999);
+    return v[(i > 0) ? i - 1 : 0];
+}
+
+static void run( unsigned int ndev, unsigned int rounds, enum ftdi_chip_type type,
+                 const vector<unsigned char> &img, const SIM_LATENCY_T &latency,
+                 bool blank, const vector<FTDI_RECORD_T> *replay, double speed,
+                 BENCH_RESULT_T &r )
+{
+    vector<SimDevice>       devs;
+    vector<FTDIReplay>      replays;
+    vector< vector<double> > ms( ndev );
+    vector<unsigned int>    errors( ndev, 0 );
+    vector<thread>          workers;
+    vector<double>          all;
+    chrono::steady_clock::time_point t0;
+    double                  cpu0;
+    unsigned int            i;
+
+    for (i = 0; i < ndev; i++) {
+        devs.push_back( SimDevice(type, img.size(), latency) );
+        devs[i].set_image( img.data(), img.size() );
+        if (replay)
+            /* timing only: every board gets its own serial */
+            replays.push_back( FTDIReplay(*replay, speed, false) );
+    }
+
+    cpu0 = cpu_seconds();
+    t0 = chrono::steady_clock::now();
+
+    for (i = 0; i < ndev; i++) {
+        workers.push_back( thread( [&, i]() {
+            for (unsigned int k = 0; k < rounds; k++) {
+                chrono::steady_clock::time_point b0 = chrono::steady_clock::now();
+
+                FTDITransport &dev = replay ? (FTDITransport &)replays[i]
+                                            : (FTDITransport &)devs[i];
+
+                if (blank)
+                    devs[i].erase();
+                if (program_board( dev, img, i + 1, k ) < 0)
+                    errors[i]++;
+                ms[i].push_back( chrono::duration<double, milli>(
+                        chrono::steady_clock::now() - b0).count() );
+            }
+        } ) );
+    }
+    for (i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    r.devices = ndev;
+    r.boards  = ndev * rounds;
+    r.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    r.cpu_pct = 100.0 * (cpu_seconds() - cpu0) / r.seconds;
+    r.per_min = r.boards * 60.0 / r.seconds;
+
+    r.errors = 0;
+    for (i = 0; i < ndev; i++) {
+        r.errors += errors[i];
+        all.insert( all.end(), ms[i].begin(), ms[i].end() );
+    }
+    r.p50_ms = percentile( all, 0.50 );
+    r.p99_ms = percentile( all, 0.99 );
+}
+
+
+int main(int argc, char* argv[])
+{
+    enum { LOPT_OPEN_US = 0x100, LOPT_READ_US, LOPT_WRITE_US, LOPT_REPLAY, LOPT_SPEED };
+    static const struct option long_opts[] = {
+        {"max-devices", required_argument,  NULL,   'n'},
+        {"rounds",      required_argument,  NULL,   'r'},
+        {"image",       required_argument,  NULL,   'i'},
+        {"chip",        required_argument,  NULL,   'c'},
+        {"thresholds",  required_argument,  NULL,   't'},
+        {"blank",       no_argument,        NULL,   'b'},
+        {"open-us",     required_argument,  NULL,   LOPT_OPEN_US},
+        {"read-us",     required_argument,  NULL,   LOPT_READ_US},
+        {"write-us",    required_argument,  NULL,   LOPT_WRITE_US},
+        {"replay",      required_argument,  NULL,   LOPT_REPLAY},
+        {"speed",       required_argument,  NULL,   LOPT_SPEED},
+        {"help",        no_argument,        NULL,   'h'},
+        {NULL,          0,                  NULL,   0}
+    };
+    SIM_LATENCY_T latency = { SIM_OPEN_US, SIM_READ_US, SIM_WRITE_US };
+    map<unsigned int, BENCH_THRESHOLD_T> thresholds;
+    enum ftdi_chip_type type = TYPE_R;
+    vector<unsigned char> img;
+    vector<FTDI_RECORD_T> recording;
+    const char *image = NULL, *tfile = NULL, *replay = NULL;
+    double speed = 1.0;
+    unsigned int max_dev = BENCH_MAX_DEVICES, rounds = BENCH_ROUNDS, n;
+    double base = 0, floor_ms;
+    bool blank = false;
+    int c, failed = 0;
+
+    while ((c = getopt_long(argc, argv, "n:r:i:c:t:bh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'n':   max_dev = strtoul(optarg, NULL, 0);     break;
+        case 'r':   rounds  = strtoul(optarg, NULL, 0);     break;
+        case 'i':   image   = optarg;                       break;
+        case 't':   tfile   = optarg;                       break;
+        case 'b':   blank   = true;                         break;
+        case 'c':
+                    if (FTDISession::chip_parse( optarg, &type ) < 0) {
+                        cerr << "Unknown chip type: " << optarg << endl;
+                        return EXIT_FAILURE;
+                    }
+                    break;
+        case LOPT_OPEN_US:  latency.open_us  = strtoul(optarg, NULL, 0);    break;
+        case LOPT_READ_US:  latency.read_us  = strtoul(optarg, NULL, 0);    break;
+        case LOPT_WRITE_US: latency.write_us = strtoul(optarg, NULL, 0);    break;
+        case LOPT_REPLAY:   replay = optarg;                                break;
+        case LOPT_SPEED:    speed  = strtod(optarg, NULL);                  break;
+        default:
+                    usage( argv[0] );
+                    return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if ( (max_dev == 0) || (rounds == 0) ) {
+        usage( argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    /* no "Replug device" per board: errors only */
+    DeviceLog::set_min_level( LOGL_WARN );
+
+    if ( (image ? load_image(image, img) : default_image(type, img)) < 0 ) {
+        cerr << "Failed to get the template image" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( replay && (FTDIReplay::load(replay, recording) < 0) ) {
+        cerr << "Failed to load recording " << replay << endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( tfile && (load_thresholds(tfile, thresholds) < 0) ) {
+        cerr << "Failed to read thresholds " << tfile << endl;
+        return EXIT_FAILURE;
+    }
+
+    /* probe: every word of a blank part, the first one of a programmed part */
+    floor_ms = (latency.open_us
+              + (double)latency.read_us * (blank ? FTDI_PROBE_WORDS
+                                                 : 1 + FTDI_MAX_EEPROM_SIZE / 2)
+              + (double)latency.write_us * (img.size() / 2)) / 1000.0;
+
+    printf("devices,boards,errors,seconds,boards_per_min,speedup,"
+           "p50_ms,p99_ms,floor_ms,cpu_pct,result\n");
+
+    for (n = 1; ; n = min(n * 2, max_dev)) {
+        map<unsigned int, BENCH_THRESHOLD_T>::const_iterator t = thresholds.find(n);
+        BENCH_RESULT_T r;
+        const char *result = "-";
+        double speedup;
+
+        run( n, rounds, type, img, latency, blank,
+             replay ? &recording : NULL, speed, r );
+        if (n == 1) {
+            base = r.per_min;
+            if (replay)
+                floor_ms = r.p50_ms;
+        }
+        speedup = base ? r.per_min / base : 0;
+
+        if (r.errors) {
+            result = "FAIL";
+        } else if (t != thresholds.end()) {
+            result = ( (speedup >= t->second.min_speedup)
+                    && (r.p99_ms <= t->second.max_p99_floor * floor_ms) )
+                   ? "ok" : "FAIL";
+        }
+        failed += (result[0] == 'F');
+
+        printf("%u,%u,%u,%.3f,%.1f,%.2f,%.2f,%.2f,%.2f,%.1f,%s\n",
+            r.devices, r.boards, r.errors, r.seconds, r.per_min, speedup,
+            r.p50_ms, r.p99_ms, floor_ms, r.cpu_pct, result);
+        fflush(stdout);
+
+        if (n == max_dev)
+            break;
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,10 +20,14 @@
     MA  02110-1301, USA.
 */
 
-#include <iostream>         /* cout */
+#include <sstream>          /* ostringstream */
 #include <iomanip>          /* setw, setfill, ... */
 #include <assert.h>         /* assert */
 #include "ftdi_dev.hpp"
+#include "image_pack.hpp"
+#include "image_store.hpp"
+#include "snapshot_cache.hpp"
+#include "eeprom_checksum.hpp"
 
 
 /* -------------------- Constructor / Destructor -------------------- */
@@ -39,46 +43,66 @@ FTDIDEV::FTDIDEV( int vid, int pid, enum ftdi_chip_type type )
 #endif
 
 FTDIDEV::FTDIDEV( Options *opt )
+    : transport(NULL), ftdi(NULL), eeprom_blank(false)
 {
-    int     rc;
-    string  err_string;
-
-    /* Already created */
-    if (ftdi != NULL) {
-        return;
-    }
-
-    if ((ftdi = ftdi_new()) == NULL) {
-        err_string = "Failed to new FTDI!";
-        goto err_new;
-    }
-
-
     /* Not really accessing USB device's EEPROM. i.e.: file */
     if (
         (opt == NULL)
         || ( !(opt->isInFTDIDEV() || opt->isOutFTDIDEV()) )
     ) {
+        open_usb(0, 0, 0, 0);
         return;
     }
     assert( opt->isBusDefined() || opt->isIdDefined() );
 
+    snapshot_dir = opt->getSnapshotDir();
+    open_transport( opt );
 
-    /* Open by bus:dev - ftdi_usb_open_bus_addr */
-    if ( opt->isBusDefined() ) {
-        rc = ftdi_usb_open_bus_addr(ftdi,
-            opt->getBus(), opt->getDev());
-        if (rc < 0) {
-            goto err_open;
-        }
+    open_usb(
+        opt->isBusDefined() ? opt->getBus() : 0,
+        opt->isBusDefined() ? opt->getDev() : 0,
+        opt->isIdDefined()  ? opt->getVid() : 0,
+        opt->isIdDefined()  ? opt->getPid() : 0);
+}
+
+FTDIDEV::FTDIDEV( int bus, int dev, int vid, int pid )
+    : transport(NULL), ftdi(NULL), eeprom_blank(false)
+{
+    open_usb(bus, dev, vid, pid);
+}
+
+/* simulated or replayed devices (ftdi_bench) */
+FTDIDEV::FTDIDEV( FTDITransport *t, int bus, int dev )
+    : transport(NULL), ftdi(NULL), eeprom_blank(false)
+{
+    session.set_transport( t );
+    open_usb(bus, dev, 0, 0);
+}
+
+/* bus:dev or vid:pid (0 = not used). All 0: file only operation */
+void FTDIDEV::open_usb( int bus, int dev, int vid, int pid )
+{
+    /* Already created */
+    if (ftdi != NULL) {
+        return;
     }
-    /* Open by pid:vid - ftdi_usb_open */
-    if ( opt->isIdDefined() ) {
-        rc = ftdi_usb_open(ftdi,
-            opt->getVid(), opt->getPid());
-        if (rc < 0) {
-            goto err_open;
-        }
+
+    if (bus && dev) {
+        logger.set_device( to_string(bus) + ":" + to_string(dev) );
+    } else if (vid || pid) {
+        ostringstream id;
+
+        id << hex << setfill('0') << setw(4) << vid << ":" << setw(4) << pid;
+        logger.set_device( id.str() );
+    }
+
+    if (session.open(bus, dev, vid, pid) < 0) {
+        throw std::runtime_error( session.error() );
+    }
+    ftdi = session.context();
+
+    if ( !session.is_open() ) {
+        return;
     }
     /* ToDo: Use ftdi_usb_open_desc() to specify _description_ & _serial_ of
      * the device
@@ -86,37 +110,50 @@ FTDIDEV::FTDIDEV( Options *opt )
 
 
     /* IMPORTANT: Perform a EEPROM read to get eeprom size */
-    if ((rc = read_eeprom()) < 0) {
-        goto err_open;
-    }
-
-    return;
+    if (read_eeprom() < 0) {
+        string err_string = session.error();
 
-err_open:
-    err_string = ftdi_get_error_string(ftdi);
+        session.close();
+        ftdi = NULL;
+        throw std::runtime_error( err_string );
+    }
+}
 
-    ftdi_free( ftdi );
+FTDIDEV::~FTDIDEV()
+{
+    /* device closed, context back to the pool */
+    session.close();
     ftdi = NULL;
-err_new:
-    throw std::runtime_error( err_string );
-//    cerr << err_string << endl;
-//    throw rc;
+
+    delete transport;
 }
 
-FTDIDEV::~FTDIDEV()
+/* recorded (or replayed) USB operations instead of the device */
+void FTDIDEV::open_transport( Options *opt )
 {
-    if (ftdi) {
-        ftdi_usb_close( ftdi );
-        ftdi_free( ftdi );
-        ftdi = NULL;
+    if ( opt->isReplay() ) {
+        if (FTDIReplay::load( opt->getReplayFname(), recording ) < 0)
+            throw std::runtime_error( "Failed to load recording " + opt->getReplayFname() );
+        transport = new FTDIReplay( recording, opt->getReplaySpeed() );
+    } else if ( opt->isRecord() ) {
+        FTDIRecorder *rec = new FTDIRecorder();
+
+        if (rec->open_file( opt->getRecordFname() ) < 0) {
+            delete rec;
+            throw std::runtime_error( "Failed to create recording " + opt->getRecordFname() );
+        }
+        transport = rec;
+    } else {
+        return;
     }
+
+    session.set_transport( transport );
 }
 
 /* ------------------------------------------------------------------ */
 
 int FTDIDEV::read_file(string path)
 {
-    int rc;
     unsigned int buf_size;
     ifstream ifs( path, ios::in | ios::binary);
 
@@ -131,13 +168,7 @@ int FTDIDEV::read_file(string path)
 
     /* Copy data to EEPROM buffer */
     // buffer size had been set by set_buffer_sizes()
-    rc = ftdi_set_eeprom_buf(ftdi, file_buf, buf_size);
-    if ( rc != 0 ) {
-        cerr << "Fail to set EEPROM buffer" << endl;
-    }
-
-    /* CAUTION: Hacking libftdi to enable this feature */
-    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, buf_size);
+    set_buffer(file_buf, buf_size);
 
     return 0;
 }
@@ -150,9 +181,9 @@ int FTDIDEV::write_file(string path)
 
     /* Copy data from EEPROM buffer */
     buf_size = eeprom_buf_size[O];
-    rc = ftdi_get_eeprom_buf(ftdi, file_buf, buf_size);
+    rc = session.store(file_buf, buf_size);
     if (rc < 0) {
-        cerr << "Fail to get EEPROM buffer" << endl;
+        logger(LOGL_ERROR) << "Fail to get EEPROM buffer" << endl;
         return rc;
     }
 
@@ -163,34 +194,183 @@ int FTDIDEV::write_file(string path)
     return 0;
 }
 
+int FTDIDEV::set_buffer(const unsigned char *buf, unsigned int size)
+{
+    int rc;
+
+    if ((rc = session.load(buf, size)) < 0) {
+        logger(LOGL_ERROR) << "Fail to set EEPROM buffer" << endl;
+    }
+
+    return rc;
+}
+
+int FTDIDEV::read_pack(string path, string serial)
+{
+    int rc;
+    unsigned int buf_size, img_size;
+    const unsigned char *img;
+    ImagePack pack;
+
+    if ((rc = pack.open(path)) < 0) {
+        logger(LOGL_ERROR) << "Fail to open pack " << path << ": " << rc << endl;
+        return rc;
+    }
+    if ((img = pack.lookup(serial)) == NULL) {
+        logger(LOGL_ERROR) << "Serial " << serial << " is not in pack " << path << endl;
+        return -ENOENT;
+    }
+
+    /* Same as read_file(): pad (0) or truncate to the buffer size */
+    buf_size = eeprom_buf_size[I];
+    img_size = min(buf_size, pack.get_image_size());
+    memset(file_buf, 0, buf_size);
+    memcpy(file_buf, img, img_size);
+
+    set_buffer(file_buf, buf_size);
+
+    return 0;
+}
+
+int FTDIDEV::read_store(string path, string key)
+{
+    int rc;
+    unsigned int buf_size, img_size;
+    unsigned char img[FTDI_MAX_EEPROM_SIZE];
+    uint64_t k;
+    ImageStore store;
+
+    if (ImageStore::parse_key(key, &k) < 0) {
+        logger(LOGL_ERROR) << "Invalid key " << key << endl;
+        return -EINVAL;
+    }
+    if ((rc = store.open(path, false)) < 0) {
+        logger(LOGL_ERROR) << "Fail to open store " << path << ": " << rc << endl;
+        return rc;
+    }
+    if ((rc = store.get(k, img, &img_size)) < 0) {
+        logger(LOGL_ERROR) << "Key " << key << " is not in store " << path << endl;
+        return rc;
+    }
+
+    /* Same as read_file(): pad (0) or truncate to the buffer size */
+    buf_size = eeprom_buf_size[I];
+    memset(file_buf, 0, buf_size);
+    memcpy(file_buf, img, min(buf_size, img_size));
+
+    set_buffer(file_buf, buf_size);
+
+    return 0;
+}
+
 int FTDIDEV::read_eeprom()
 {
     int rc;
 
     if ( !ftdi )        return -ENODEV;
 
-    if ((rc = ftdi_read_eeprom(ftdi)) < 0) {
-        cerr << "Fail to Read EEPROM: " << rc
-             << "(" << ftdi_get_error_string(ftdi) << ")" << endl;
+    /* Unchanged since the last run: no read but the checksum word */
+    if ( !snapshot_dir.empty() && (read_snapshot() == 0) ) {
+        eeprom_blank = false;
+        return 0;
     }
 
-    /* size will also be set to -1 in the case of Blank EEPROM */
-    eeprom_blank = (get_eeprom_size() == -1);
+    /* Blank EEPROM: a few words tell, no full read (size from chip type) */
+    if ((rc = session.probe()) == 0)
+        rc = session.read();
 
-    return rc;
+    if (rc < 0) {
+        logger(LOGL_ERROR) << "Fail to Read EEPROM: " << session.lib_error()
+             << "(" << session.error() << ")" << endl;
+    }
+
+    eeprom_blank = session.is_blank();
+
+    if ( (rc == 0) && !eeprom_blank && !snapshot_dir.empty() )
+        save_snapshot();
+
+    return (rc < 0) ? rc : 0;
+}
+
+int FTDIDEV::snapshot_device( string &id )
+{
+    int rc;
+
+    if ( snapshot_id.empty()
+        && ((rc = SnapshotCache::device_id( session, snapshot_id )) < 0) )
+        return rc;
+
+    id = snapshot_id;
+    return 0;
+}
+
+int FTDIDEV::read_snapshot()
+{
+    SnapshotCache cache( snapshot_dir );
+    unsigned char img[FTDI_MAX_EEPROM_SIZE];
+    unsigned int size, w;
+    unsigned short word;
+    enum ftdi_chip_type type;
+    CHECKSUM_LAYOUT_T layout;
+    string id;
+    int rc;
+
+    if ( ((rc = snapshot_device(id)) < 0)
+        || ((rc = cache.get(id, &type, img, &size)) < 0) )
+        return rc;
+
+    /* a change of the checksummed words changes the checksum word */
+    if ( (type != ftdi->type) || (size < 2)
+        || (session.read_word(size / 2 - 1, &word) < 0)
+        || (word != (img[size - 2] | (img[size - 1] << 8))) )
+        return -ESTALE;
+
+    /* words the checksum does not cover (FT230X user area): read back */
+    if (EEPROMChecksum::layout( type, size, &layout ) < 0)
+        return -ESTALE;
+    for (w = layout.skip_from; w < layout.skip_to; w++) {
+        if ( (session.read_word(w, &word) < 0)
+            || (word != (img[w * 2] | (img[w * 2 + 1] << 8))) )
+            return -ESTALE;
+    }
+
+    return session.load(img, size);
+}
+
+int FTDIDEV::save_snapshot()
+{
+    SnapshotCache cache( snapshot_dir );
+    unsigned char img[FTDI_MAX_EEPROM_SIZE];
+    int size = session.get_size();
+    string id;
+    int rc;
+
+    if ( (size <= 0) || (size > FTDI_MAX_EEPROM_SIZE) )
+        return -EINVAL;
+
+    if ( ((rc = snapshot_device(id)) < 0)
+        || ((rc = session.store(img, size)) < 0) )
+        return rc;
+
+    return cache.put(id, ftdi->type, img, size);
 }
 
 int FTDIDEV::write_eeprom()
 {
+    string id;
     int rc;
 
     if ( !ftdi )        return -ENODEV;
 
-    if ((rc = ftdi_write_eeprom(ftdi)) == 0) {
-        cout << "Replug device to see the result!" << endl;
+    /* the device changes (or is left unknown): next read is a full read */
+    if ( !snapshot_dir.empty() && (snapshot_device(id) == 0) )
+        SnapshotCache( snapshot_dir ).invalidate( id );
+
+    if ((rc = session.write()) == 0) {
+        logger(LOGL_INFO) << "Replug device to see the result!" << endl;
     } else {
-        cerr << "Fail to Write EEPROM: " << rc
-             << "(" << ftdi_get_error_string(ftdi) << ")" << endl;
+        logger(LOGL_ERROR) << "Fail to Write EEPROM: " << session.lib_error()
+             << "(" << session.error() << ")" << endl;
     }
 
     return rc;
@@ -198,13 +378,18 @@ int FTDIDEV::write_eeprom()
 
 /* ------------------------------------------------------------------ */
 
-int FTDIDEV::read(bool isInFTDIDEV, string fName, bool verboseMode)
+int FTDIDEV::read(bool isInFTDIDEV, string fName, bool verboseMode,
+                   string packKey)
 {
     int rc;
 
     if ( isInFTDIDEV ) {
         rc = read_eeprom();
         /* data had been directly read into FTDI buffer */
+    } else if ( !packKey.empty() ) {
+        /* container#key: pack or store, by magic */
+        rc = ImageStore::is_store(fName)
+            ? read_store(fName, packKey) : read_pack(fName, packKey);
     } else {
         rc = read_file(fName);
     }
@@ -242,36 +427,74 @@ int FTDIDEV::decode(int verbose)
 
     if ( !ftdi )        return -ENODEV;
 
-    if ((rc = ftdi_eeprom_decode(ftdi, verbose)) < 0) {
-        cerr << "Fail to Decode: " << rc << endl;
-        if ( ftdi ) {
-            cerr << "(" << ftdi_get_error_string(ftdi) << ")" << endl;
-        }
+    if ((rc = session.decode(verbose)) < 0) {
+        logger(LOGL_ERROR) << "Fail to Decode: " << session.lib_error() << endl;
+        logger(LOGL_ERROR) << "(" << session.error() << ")" << endl;
     }
 
     return rc;
 }
 
-void FTDIDEV::show_info( void )
+int FTDIDEV::update(Options *opt)
 {
-    char *ChipType[] = {
-        (char *)"AM",
-        (char *)"BM",
-        (char *)"2232C",
-        (char *)"R",
-        (char *)"2232H",
-        (char *)"4232H",
-        (char *)"232H",
-        (char *)"230X",
-    };
+    int rc;
+
+    if ((rc = update( opt->getUpdate() )) < 0)
+        return rc;
+
+    return opt->getPlan().apply( session );
+}
+
+int FTDIDEV::patch_image(PatchPlan &plan)
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    int size = session.get_size();
+    int rc;
+
+    if ( (size <= 0) || (size > FTDI_MAX_EEPROM_SIZE) ) {
+        logger(LOGL_ERROR) << "Unknown image size, can not patch!" << endl;
+        return -EINVAL;
+    }
+
+    if ((rc = session.store(buf, size)) < 0)
+        return rc;
+    if ((rc = plan.apply_image(buf, size, get_chip_type())) < 0) {
+        logger(LOGL_ERROR) << "Fail to patch image: " << rc << endl;
+        return rc;
+    }
 
+    return session.load(buf, size);
+}
+
+int FTDIDEV::update(const OPT_UPDATE_T &u)
+{
+    return session.patch( u.vid, u.pid, u.manufacturer, u.product, u.serial );
+}
+
+int FTDIDEV::verify(const unsigned char *expect, unsigned int size)
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    int rc;
+
+    if ( !ftdi )        return -ENODEV;
+
+    if ((rc = read_eeprom()) < 0)
+        return rc;
+    if ((rc = session.store(buf, size)) < 0)
+        return rc;
+
+    return (memcmp(buf, expect, size) == 0) ? 0 : -EIO;
+}
+
+void FTDIDEV::show_info( void )
+{
     if ( !ftdi ) {
-        cerr << __func__ << ": FTDI device not available!" << endl;
+        logger(LOGL_ERROR) << __func__ << ": FTDI device not available!" << endl;
         return;
     }
 
-    cout << "Chip type: "   << ChipType[ftdi->type] << endl;
-    cout << "EEPROM size: " << get_eeprom_size() << endl;
+    logger(LOGL_INFO) << "Chip type: "   << FTDISession::chip_name(ftdi->type) << endl;
+    logger(LOGL_INFO) << "EEPROM size: " << get_eeprom_size() << endl;
 }
 
 void FTDIDEV::dump(unsigned int buf_size)
@@ -279,10 +502,13 @@ void FTDIDEV::dump(unsigned int buf_size)
     unsigned int    offset, i;
     char            ch;
     unsigned char   *buf = file_buf;
+    ostringstream   out;            /* one record */
 
     if (is_EEPROM_blank()) {
+        logger(LOGL_INFO) << "EEPROM is empty, size of chip type: " << buf_size << endl;
+    }
+    if (buf_size > FTDI_MAX_EEPROM_SIZE) {
         buf_size = FTDI_MAX_EEPROM_SIZE;
-        cout << "EEPROM is empty, use maximum size: " << buf_size << endl;
     }
 
     /* The data might already be in the *file_buf*
@@ -290,29 +516,29 @@ void FTDIDEV::dump(unsigned int buf_size)
      * Just copy it for other cases, don't bother to check
      */
     /* Copy data from EEPROM buffer */
-    if (ftdi_get_eeprom_buf(ftdi, buf, buf_size) < 0) {
-        cerr << "Fail to get EEPROM buffer" << endl;
+    if (session.store(buf, buf_size) < 0) {
+        logger(LOGL_ERROR) << "Fail to get EEPROM buffer" << endl;
         return;
     }
 
-    cout << hex << setfill('0');
+    out << hex << setfill('0');
 
     for(offset = 0; offset < buf_size; offset += 16) {
 
         /* show the offset */
-        cout << setw(8) << offset;
+        out << setw(8) << offset;
 
         /* show the hex codes */
         for (i = 0; i < 16; i++) {
-            if (i % 8 == 0) cout << ' ';
+            if (i % 8 == 0) out << ' ';
             if (offset + i < buf_size)
-                cout << ' ' << setw(2) << (unsigned)(buf[offset + i]);
+                out << ' ' << setw(2) << (unsigned)(buf[offset + i]);
             else
-                cout << "   ";
+                out << "   ";
         }
 
         /* show the ASCII */
-        cout << "  ";
+        out << "  ";
         for (i = 0; i < 16; i++) {
             if (offset + i < buf_size) {
                 ch = buf[offset + i];
@@ -320,12 +546,12 @@ void FTDIDEV::dump(unsigned int buf_size)
             } else {
                 ch = '.';
             }
-            cout << ch;
+            out << ch;
         }
-        cout << endl;
+        out << endl;
 
     }
 
-    cout.unsetf(ios::hex);
-    cout << endl;
+    out << endl;
+    logger(LOGL_INFO) << out.str();
 }
@@ -29,10 +29,9 @@
 #include <string.h>     // memcpy
 #include <ftdi.h>
 #include "Options.hpp"
-
-
-/* copied from libftdi::ftdi_i.h */
-#define FTDI_MAX_EEPROM_SIZE    (256)               /* MUST fit in INT */
+#include "ftdi_session.hpp"     /* FTDI_MAX_EEPROM_SIZE */
+#include "ftdi_record.hpp"
+#include "log_sink.hpp"
 
 
 using namespace std;
@@ -49,31 +48,53 @@ class FTDIDEV {
 
 private:
     /* FTDI */
-    struct ftdi_context *ftdi;
+    FTDITransport       *transport;     /* --record / --replay (owned) */
+    vector<FTDI_RECORD_T>   recording;  /* --replay */
+    FTDISession         session;
+    struct ftdi_context *ftdi;      /* session.context() */
     bool    eeprom_blank;
 
+    string  snapshot_dir;           /* --snapshot-cache, empty: none */
+    string  snapshot_id;            /* device id, once known */
+
+    DeviceLog   logger;             /* "bus:dev" / "vid:pid", "": file */
+
     unsigned char file_buf[FTDI_MAX_EEPROM_SIZE];
     unsigned int  eeprom_buf_size[EEPROM_BUFFER_INDEX_MAX]; /* might be File size or EEPROM size */
 
 protected:
+    void    open_usb(int bus, int dev, int vid, int pid);
+    void    open_transport(Options *opt);
+
     int      read_file(string path);
     int     write_file(string path);
 
+    int      read_pack(string path, string serial);
+    int      read_store(string path, string key);
+
     int      read_eeprom();
     int     write_eeprom();
 
+    int      read_snapshot();
+    int     save_snapshot();
+    int     snapshot_device( string &id );
+
     int     update_string( enum ftdi_eeprom_value value_name, string s );
 
 
 public:
     /* Constructor / Destructor */
     FTDIDEV( Options *opt );    /* set opt to NULL for file only operation */
+    FTDIDEV( int bus, int dev, int vid, int pid );  /* 0: not used */
+    FTDIDEV( FTDITransport *t, int bus, int dev );  /* t: not owned */
     /* TODO: able to set chip type
     FTDIDEV( int vid, int pid, enum ftdi_chip_type type );  // set chip type
     */
     ~FTDIDEV();
 
+    /* probed on open (input or output EEPROM), never read from a file */
     bool    is_EEPROM_blank()   { return eeprom_blank; }
+    DeviceLog   &get_logger()       { return logger; }
 
     int     get_eeprom_size(void) {
         int size = 0;
@@ -84,32 +105,69 @@ public:
         return size;
     }
 
+    int     get_value(enum ftdi_eeprom_value name) {
+        int value = 0;
+
+        if (ftdi) {
+            ftdi_get_eeprom_value(ftdi, name, &value);
+        }
+        return value;
+    }
+    /* decoded strings (after decode) */
+    int     get_strings(string &manufacturer, string &product, string &serial)
+            { return session.get_strings(manufacturer, product, serial); }
+
     void    set_buffer_sizes(unsigned int iSize, unsigned oSize) {
         eeprom_buf_size[I] = iSize;
         eeprom_buf_size[O] = oSize;
     }
 
 
-    int     read(bool isInFTDIDEV, string fName, bool verboseMode);
+    int     read(bool isInFTDIDEV, string fName, bool verboseMode,
+                 string packKey = "");
     int     write(bool isOutFTDIDEV, string fName, bool verboseMode);
 
     int     decode(int verbose);
     int     encode(int verbose __attribute__((unused)))
-            { return ftdi_eeprom_build(ftdi); }
+            { return session.encode(); }
 
     void    show_info(void);
     void    dump(unsigned int buf_size);
 
+    int     get_buffer(unsigned char *buf, unsigned int size)
+            { return session.store(buf, size); }
+    int     set_buffer(const unsigned char *buf, unsigned int size);
+
+    /* apply every --update-xxx and --set option */
+    int     update(Options *opt);
+    int     update(const OPT_UPDATE_T &u);
+
+    /* direct plan: patch the binary, no ENCODE needed */
+    int     patch_image(PatchPlan &plan);
+
+    enum ftdi_chip_type get_chip_type()
+            { return ftdi ? ftdi->type : TYPE_BM; }
+    /* file only operation: no device to tell the chip type */
+    void    set_chip_type(enum ftdi_chip_type type)
+            { if (ftdi) ftdi->type = type; }
+
+    /* read EEPROM back and compare */
+    int     verify(const unsigned char *expect, unsigned int size);
+
+    /* board self-test on the open device, every port */
+    int     self_test(SelfTest &test, vector<SELF_TEST_RESULT_T> &res)
+            { return test.run(session, res); }
+
     int     update_vid( unsigned int vid )
-            { return ftdi_set_eeprom_value(ftdi, VENDOR_ID, vid); }
+            { return session.patch(vid, 0, NULL, NULL, NULL); }
     int     update_pid( unsigned int pid )
-            { return ftdi_set_eeprom_value(ftdi, PRODUCT_ID, pid); }
+            { return session.patch(0, pid, NULL, NULL, NULL); }
 
     int     update_strings(
                 char *m,    /* manufacturer */
                 char *p,    /* product */
                 char *s)    /* serial */
-            { return ftdi_eeprom_set_strings(ftdi, m, p, s); }
+            { return session.patch(0, 0, m, p, s); }
 
     /* string interface not completed ... yet */
     int     update_manufacturer( string s )
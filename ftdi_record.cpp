@@ -0,0 +1,348 @@
+/*
+    Implementation of FTDIRecorder / FTDIReplay classes (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <fstream>          /* ifstream */
+#include <sstream>          /* istringstream */
+#include <thread>           /* sleep_for */
+#include <cerrno>           /* errno */
+#include <cstdlib>          /* strtol */
+#include <string.h>         /* strlen */
+#include "ftdi_record.hpp"
+
+
+static const char *record_ops[] = {
+    "open", "word", "write", "close",
+};
+
+
+/* ---------------------------- FTDIRecorder ---------------------------- */
+
+FTDIRecorder::~FTDIRecorder()
+{
+    if (out)
+        fclose(out);
+}
+
+int FTDIRecorder::open_file( string path )
+{
+    if ((out = fopen(path.c_str(), "w")) == NULL)
+        return -errno;
+
+    fprintf(out, "%s\n", FTDI_RECORD_HEADER);
+    return 0;
+}
+
+long FTDIRecorder::since( chrono::steady_clock::time_point t0 )
+{
+    return chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - t0).count();
+}
+
+int FTDIRecorder::open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int rc;
+
+    rc = (bus && dev) ? ftdi_usb_open_bus_addr(ftdi, bus, dev)
+                      : ftdi_usb_open(ftdi, vid, pid);
+
+    if (out) {
+        fprintf(out, "open bus=%d dev=%d vid=%d pid=%d type=%d rc=%d us=%ld\n",
+            bus, dev, vid, pid, (int)ftdi->type, rc, since(t0));
+    }
+    return rc;
+}
+
+void FTDIRecorder::close( struct ftdi_context *ftdi )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    ftdi_usb_close( ftdi );
+
+    if (out) {
+        fprintf(out, "close us=%ld\n", since(t0));
+        fflush(out);
+    }
+}
+
+int FTDIRecorder::read_location( struct ftdi_context *ftdi, int addr, unsigned short *word )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int rc;
+
+    *word = 0;
+    rc = ftdi_read_eeprom_location(ftdi, addr, word);
+
+    if (out) {
+        fprintf(out, "word addr=%d value=0x%04x rc=%d us=%ld\n",
+            addr, *word, rc, since(t0));
+    }
+    return rc;
+}
+
+/* what ftdi_read_eeprom does, one recorded word at a time */
+int FTDIRecorder::read_eeprom( struct ftdi_context *ftdi )
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    unsigned short word;
+    int i, rc;
+
+    for (i = 0; i < FTDI_MAX_EEPROM_SIZE / 2; i++) {
+        if ((rc = read_location(ftdi, i, &word)) < 0)
+            return rc;
+        buf[i * 2]     = word & 0xFF;
+        buf[i * 2 + 1] = word >> 8;
+    }
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, sizeof(buf))) < 0)
+        return rc;
+
+    /* CAUTION: Hacking libftdi to enable this feature */
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, FTDISession::size_guess(ftdi->type, buf));
+    return 0;
+}
+
+/* the words ftdi_write_eeprom sends: CHIP_SIZE of the buffer, FT230X
+ * without its reserved words 0x40 - 0x4F. 0: no buffer
+ */
+static int write_list( struct ftdi_context *ftdi, unsigned char *buf,
+                       vector<int> &words )
+{
+    int size = 0, i;
+
+    ftdi_get_eeprom_value(ftdi, CHIP_SIZE, &size);
+    if ( (size <= 0) || (size > FTDI_MAX_EEPROM_SIZE)
+        || (ftdi_get_eeprom_buf(ftdi, buf, size) < 0) )
+        return 0;
+
+    for (i = 0; i < size / 2; i++) {
+        if ( (ftdi->type == TYPE_230X) && (i == 0x40) )
+            i = 0x50;
+        words.push_back( i );
+    }
+    return size;
+}
+
+int FTDIRecorder::write_location( struct ftdi_context *ftdi, int addr,
+                                  unsigned short word, long prep_us )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int rc;
+
+    rc = libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+            SIO_WRITE_EEPROM_REQUEST, word, addr,
+            NULL, 0, ftdi->usb_write_timeout);
+
+    if (out) {
+        fprintf(out, "write addr=%d value=0x%04x rc=%d us=%ld\n",
+            addr, word, rc, prep_us + since(t0));
+    }
+    return rc;
+}
+
+/* what ftdi_write_eeprom does, one recorded word at a time (the first word
+ * carries the reset, modem status and latency transfers before it)
+ */
+int FTDIRecorder::write_eeprom( struct ftdi_context *ftdi )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    vector<int> words;
+    unsigned short status;
+    long prep_us;
+    size_t i;
+    int w, rc;
+
+    if ( (ftdi->usb_dev == NULL) || (write_list(ftdi, buf, words) == 0) )
+        return -2;
+
+    if ( ((rc = ftdi_usb_reset(ftdi)) < 0)
+        || ((rc = ftdi_poll_modem_status(ftdi, &status)) < 0)
+        || ((rc = ftdi_set_latency_timer(ftdi, FTDI_WRITE_LATENCY)) < 0) )
+        return rc;
+    prep_us = since(t0);
+
+    for (i = 0; i < words.size(); i++) {
+        w = words[i];
+        if (write_location(ftdi, w, buf[w * 2] | (buf[w * 2 + 1] << 8),
+                           (i == 0) ? prep_us : 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* ----------------------------- FTDIReplay ----------------------------- */
+
+const FTDI_RECORD_T *FTDIReplay::next( enum FTDI_RECORD_OP op, int addr )
+{
+    size_t i, n;
+
+    for (n = 0; n < rec.size(); n++) {
+        i = (cursor + n) % rec.size();
+
+        if ( (rec[i].op == op)
+            && (((op != REC_WORD) && (op != REC_WRITE)) || (rec[i].addr == addr)) ) {
+            cursor = i + 1;
+            return &rec[i];
+        }
+    }
+
+    return NULL;
+}
+
+void FTDIReplay::wait( long us )
+{
+    if ( (speed > 0) && (us > 0) )
+        this_thread::sleep_for( chrono::microseconds((long)(us / speed)) );
+}
+
+int FTDIReplay::open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid )
+{
+    const FTDI_RECORD_T *r = next(REC_OPEN, 0);
+
+    if (r == NULL)
+        return -1;
+
+    wait(r->us);
+    ftdi->type = (enum ftdi_chip_type)r->value;
+    return r->rc;
+}
+
+void FTDIReplay::close( struct ftdi_context *ftdi )
+{
+    const FTDI_RECORD_T *r = next(REC_CLOSE, 0);
+
+    if (r)
+        wait(r->us);
+}
+
+int FTDIReplay::read_location( struct ftdi_context *ftdi, int addr, unsigned short *word )
+{
+    const FTDI_RECORD_T *r = next(REC_WORD, addr);
+
+    if (r == NULL)
+        return -1;
+
+    wait(r->us);
+    *word = r->value;
+    return r->rc;
+}
+
+int FTDIReplay::read_eeprom( struct ftdi_context *ftdi )
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    unsigned short word;
+    int i, rc;
+
+    for (i = 0; i < FTDI_MAX_EEPROM_SIZE / 2; i++) {
+        if ((rc = read_location(ftdi, i, &word)) < 0)
+            return rc;
+        buf[i * 2]     = word & 0xFF;
+        buf[i * 2 + 1] = word >> 8;
+    }
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, sizeof(buf))) < 0)
+        return rc;
+
+    /* CAUTION: Hacking libftdi to enable this feature */
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, FTDISession::size_guess(ftdi->type, buf));
+    return 0;
+}
+
+/* the recorded word at each address, the same value (check) */
+int FTDIReplay::write_eeprom( struct ftdi_context *ftdi )
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    const FTDI_RECORD_T *r;
+    vector<int> words;
+    size_t i;
+    int w;
+
+    if (write_list(ftdi, buf, words) == 0)
+        return -2;
+
+    for (i = 0; i < words.size(); i++) {
+        w = words[i];
+        if ((r = next(REC_WRITE, w)) == NULL)
+            return -1;
+
+        wait(r->us);
+        if (r->rc < 0)
+            return -1;
+        if ( check && (r->value != (buf[w * 2] | (buf[w * 2 + 1] << 8))) )
+            return -1;
+    }
+    return 0;
+}
+
+int FTDIReplay::load( string path, vector<FTDI_RECORD_T> &rec )
+{
+    ifstream in( path );
+    string line;
+
+    if ( !in.good() )
+        return -ENOENT;
+
+    while (getline(in, line)) {
+        istringstream s( line );
+        FTDI_RECORD_T r = FTDI_RECORD_T();
+        string op, kv;
+        size_t i;
+
+        /* an older format: a write was one record, not one per word */
+        if ( (line.compare(0, strlen(FTDI_RECORD_MAGIC), FTDI_RECORD_MAGIC) == 0)
+            && (line != FTDI_RECORD_HEADER) )
+            return -EINVAL;
+        if ( line.empty() || (line[0] == '#') || !(s >> op) )
+            continue;
+
+        for (i = 0; i < sizeof(record_ops) / sizeof(record_ops[0]); i++) {
+            if (op == record_ops[i])
+                break;
+        }
+        if (i == sizeof(record_ops) / sizeof(record_ops[0]))
+            return -EINVAL;
+        r.op = (enum FTDI_RECORD_OP)i;
+
+        while (s >> kv) {
+            size_t eq = kv.find('=');
+            string key = kv.substr(0, eq);
+            long v;
+
+            if (eq == string::npos)
+                return -EINVAL;
+            v = strtol(kv.c_str() + eq + 1, NULL, 0);
+
+            if (key == "addr")          r.addr  = v;
+            else if (key == "value")    r.value = v;
+            else if (key == "type")     r.value = v;
+            else if (key == "rc")       r.rc    = v;
+            else if (key == "us")       r.us    = v;
+        }
+
+        rec.push_back( r );
+    }
+
+    return rec.empty() ? -ENODATA : 0;
+}
@@ -0,0 +1,131 @@
+/*
+    Header of FTDIRecorder / FTDIReplay classes (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _FTDI_RECORD_HPP_
+#define _FTDI_RECORD_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <chrono>           /* steady_clock */
+#include "ftdi_session.hpp"
+
+
+/* Recording: one line per USB operation of a session, with its time (us)
+ *
+ *  # ftdi_prog recording 1
+ *  open bus=1 dev=5 vid=0 pid=0 type=3 rc=0 us=2130
+ *  word addr=0 value=0x4000 rc=0 us=262
+ *  ...
+ *  ...
+ *  write addr=0 value=0x4000 rc=0 us=1840
+ *  ...
+ *  close us=12
+ *
+ * Reads and writes are recorded word by word, one control transfer each, as
+ * ftdi_read_eeprom / ftdi_write_eeprom (and FTDISession::write_words) do.
+ */
+#define FTDI_RECORD_MAGIC       "# ftdi_prog recording "
+#define FTDI_RECORD_HEADER      FTDI_RECORD_MAGIC "2"
+
+enum FTDI_RECORD_OP {
+    REC_OPEN,
+    REC_WORD,
+    REC_WRITE,
+    REC_CLOSE
+};
+
+typedef struct FTDI_RECORD_S {
+    enum FTDI_RECORD_OP op;
+    int             addr;           /* word, write */
+    int             value;          /* word, write: value, open: chip type */
+    int             rc;
+    long            us;
+} FTDI_RECORD_T;
+
+
+using namespace std;
+
+
+/* libftdi transport that records what it does */
+class FTDIRecorder : public FTDITransport {
+
+private:
+    FILE            *out;
+
+    long    since( chrono::steady_clock::time_point t0 );
+    int     write_location( struct ftdi_context *ftdi, int addr,
+                            unsigned short word, long prep_us );
+
+public:
+    /* Constructor / Destructor */
+    FTDIRecorder() : out(NULL) {}
+    ~FTDIRecorder();
+
+    int     open_file( string path );
+
+    /* FTDITransport */
+    int     open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid );
+    void    close( struct ftdi_context *ftdi );
+    int     read_eeprom( struct ftdi_context *ftdi );
+    int     read_location( struct ftdi_context *ftdi, int addr, unsigned short *word );
+    int     write_eeprom( struct ftdi_context *ftdi );
+
+};  /* class FTDIRecorder */
+
+
+/* Serves a recording, no device: each request takes the next recorded
+ * operation of its kind (and word address), waiting its time / speed
+ * (0: no wait). Any number of replays can share one recording.
+ * A written word must be the recorded value, unless check is false.
+ */
+class FTDIReplay : public FTDITransport {
+
+private:
+    const vector<FTDI_RECORD_T> &rec;
+    double          speed;
+    bool            check;
+    size_t          cursor;
+
+    const FTDI_RECORD_T *next( enum FTDI_RECORD_OP op, int addr );
+    void    wait( long us );
+
+public:
+    /* Constructor / Destructor */
+    FTDIReplay( const vector<FTDI_RECORD_T> &rec, double speed, bool check = true )
+        : rec(rec), speed(speed), check(check), cursor(0) {}
+    ~FTDIReplay() {}
+
+    /* FTDITransport */
+    int     open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid );
+    void    close( struct ftdi_context *ftdi );
+    int     read_eeprom( struct ftdi_context *ftdi );
+    int     read_location( struct ftdi_context *ftdi, int addr, unsigned short *word );
+    int     write_eeprom( struct ftdi_context *ftdi );
+
+    static int  load( string path, vector<FTDI_RECORD_T> &rec );
+
+};  /* class FTDIReplay */
+
+#endif  /* _FTDI_RECORD_HPP_ */
@@ -0,0 +1,627 @@
+/*
+    Implementation of FTDIServer class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream, istringstream */
+#include <thread>           /* thread */
+#include <cerrno>           /* errno */
+#include <cctype>           /* isxdigit */
+#include <csignal>          /* sigaction */
+#include <string.h>         /* strerror, memcmp */
+#include <unistd.h>         /* read, write, close, unlink */
+#include <poll.h>           /* poll */
+#include <sys/socket.h>     /* socket, bind, listen, accept */
+#include <sys/un.h>         /* sockaddr_un */
+#include "ftdi_server.hpp"
+#include "fleet_scan.hpp"   /* find_devices */
+#include "log_sink.hpp"     /* DeviceLog */
+
+
+volatile int FTDIServer::stop = 0;
+
+
+/* Read one '\n' terminated line. 1: got one, 0: EOF, <0: error */
+static int read_line( int fd, string &pending, string &line )
+{
+    char    buf[512];
+    size_t  pos;
+    ssize_t n;
+
+    while ((pos = pending.find('\n')) == string::npos) {
+        if (pending.size() > SERVER_LINE_MAX)
+            return -E2BIG;
+
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0) {
+            if (pending.empty())
+                return 0;
+            pending += '\n';        /* last line without '\n' */
+            continue;
+        }
+        pending.append(buf, n);
+    }
+
+    line = pending.substr(0, pos);
+    pending.erase(0, pos + 1);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+        line.erase(line.size() - 1);
+
+    return 1;
+}
+
+static int write_all( int fd, const string &s )
+{
+    size_t  done = 0;
+    ssize_t n;
+
+    while (done < s.size()) {
+        n = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        done += n;
+    }
+    return 0;
+}
+
+/* "A:B" -> a, b (base auto detected, like -s / -d) */
+static bool parse_pair( string s, int &a, int &b )
+{
+    size_t pos = s.find(':');
+
+    if ( (pos == string::npos) || (pos == 0) || (pos == s.size() - 1) )
+        return false;
+
+    try {
+        a = stoi( s.substr(0, pos), nullptr, 0 );
+        b = stoi( s.substr(pos + 1), nullptr, 0 );
+    } catch (std::exception &e) {
+        return false;
+    }
+    return (a > 0) && (b > 0);
+}
+
+/* ----------------------------- ServerConn ----------------------------- */
+
+ServerConn::~ServerConn()
+{
+    close(fd);
+}
+
+int ServerConn::send_line( string line )
+{
+    lock_guard<mutex> guard(wlock);
+
+    return write_all(fd, line + "\n");
+}
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+FTDIServer::FTDIServer( string path )
+    : path(path), listen_fd(-1), busy(0), stopping(false)
+{
+}
+
+FTDIServer::~FTDIServer()
+{
+    map<string, SERVER_DEVICE_T *>::iterator it;
+
+    for (it = devices.begin(); it != devices.end(); it++) {
+        delete it->second->session;
+        delete it->second;
+    }
+    devices.clear();
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+string FTDIServer::escape( string s )
+{
+    static const char hex[] = "0123456789ABCDEF";
+    string out;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char ch = s[i];
+
+        if ( (ch <= 0x20) || (ch >= 0x7F) || (ch == '=') || (ch == '%') ) {
+            out += '%';
+            out += hex[ch >> 4];
+            out += hex[ch & 0xF];
+        } else {
+            out += ch;
+        }
+    }
+    return out;
+}
+
+string FTDIServer::unescape( string s )
+{
+    string out;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        if ( (s[i] == '%') && (i + 2 < s.size()) && isxdigit(s[i + 1])
+            && isxdigit(s[i + 2]) ) {
+            out += static_cast<char>( stoi(s.substr(i + 1, 2), nullptr, 16) );
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+int FTDIServer::parse_job( string line, SERVER_JOB_T &job, string &err )
+{
+    istringstream   iss(line);
+    string          tok, key, val;
+    size_t          pos;
+
+    job.bus = job.dev = job.vid = job.pid = 0;
+    job.set_vid = job.set_pid = 0;
+    job.verify = false;
+
+    while (iss >> tok) {
+        if ((pos = tok.find('=')) == string::npos) {
+            err = "malformed token " + tok;
+            return -EINVAL;
+        }
+        key = tok.substr(0, pos);
+        val = unescape( tok.substr(pos + 1) );
+
+        try {
+            if      (key == "job")          job.id = val;
+            else if (key == "bus") {
+                if (!parse_pair(val, job.bus, job.dev)) {
+                    err = "bad bus " + val;
+                    return -EINVAL;
+                }
+            }
+            else if (key == "id") {
+                if ( !parse_pair(val, job.vid, job.pid)
+                    || (job.vid > 0xFFFF) || (job.pid > 0xFFFF) ) {
+                    err = "bad id " + val;
+                    return -EINVAL;
+                }
+            }
+            else if ( (key == "vid") || (key == "pid") ) {
+                unsigned long v = stoul(val, nullptr, 0);
+
+                if (v > 0xFFFF) {
+                    err = "bad " + key + " " + val;
+                    return -EINVAL;
+                }
+                if (key == "vid")   job.set_vid = v;
+                else                job.set_pid = v;
+            }
+            else if (key == "manufacturer") job.manufacturer = val;
+            else if (key == "product")      job.product = val;
+            else if (key == "serial")       job.serial = val;
+            else if (key == "verify")       job.verify = (stoi(val) != 0);
+            else {
+                err = "unknown key " + key;
+                return -EINVAL;
+            }
+        } catch (std::exception &e) {
+            err = "bad value " + tok;
+            return -EINVAL;
+        }
+    }
+
+    /* same selectors as the command line: bus wins over id */
+    if (job.bus && job.dev) {
+        job.vid = job.pid = 0;
+        job.device = "bus=" + to_string(job.bus) + ":" + to_string(job.dev);
+    } else if (job.vid && job.pid) {
+        job.device = "id=" + to_string(job.vid) + ":" + to_string(job.pid);
+    } else {
+        err = "bus:dev or vid:pid is not provided";
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* id=VID:PID -> bus=B:D of the first match (as ftdi_usb_open picks it) */
+int FTDIServer::resolve_id( SERVER_JOB_T &job, string &err )
+{
+    vector< pair<int, int> > found;
+
+    if (job.bus && job.dev)
+        return 0;
+
+    if ( (FleetScan::find_devices( job.vid, job.pid, found ) < 0)
+        || found.empty() ) {
+        err = "no device " + job.device;
+        return -ENODEV;
+    }
+
+    job.bus = found[0].first;
+    job.dev = found[0].second;
+    job.vid = job.pid = 0;
+    job.device = "bus=" + to_string(job.bus) + ":" + to_string(job.dev);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+void FTDIServer::on_signal( int sig __attribute__((unused)) )
+{
+    stop = 1;
+}
+
+int FTDIServer::run( void )
+{
+    struct sockaddr_un  addr;
+    struct sigaction    sa;
+    struct pollfd       pfd;
+    DeviceLog           log;
+    int                 fd, rc;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        log(LOGL_ERROR) << "Socket path too long: " << path << endl;
+        return -ENAMETOOLONG;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        rc = -errno;
+        log(LOGL_ERROR) << "Fail to create socket: " << strerror(-rc) << endl;
+        return rc;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(path.c_str());       /* stale socket of a previous run */
+    if ( (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        || (listen(listen_fd, SERVER_BACKLOG) < 0) )
+    {
+        rc = -errno;
+        log(LOGL_ERROR) << "Fail to listen on " << path << ": " << strerror(-rc) << endl;
+        close(listen_fd);
+        listen_fd = -1;
+        return rc;
+    }
+    log(LOGL_INFO) << "Listening on " << path << endl;
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    while ( !stop ) {
+        if (poll(&pfd, 1, SERVER_POLL_MS) <= 0)
+            continue;
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+
+        shared_ptr<ServerConn> conn( new ServerConn(fd) );
+        {
+            lock_guard<mutex> guard(lock);
+            conns.insert(fd);
+        }
+        thread(&FTDIServer::serve_conn, this, conn).detach();
+    }
+
+    /* Stop: no new request, let running sessions finish */
+    {
+        unique_lock<mutex> guard(lock);
+        set<int>::iterator it;
+
+        stopping = true;
+        for (it = conns.begin(); it != conns.end(); it++)
+            shutdown(*it, SHUT_RD);
+        idle.wait(guard, [this] { return (busy == 0) && conns.empty(); });
+    }
+    log(LOGL_INFO) << "Server stopped" << endl;
+
+    return 0;
+}
+
+void FTDIServer::serve_conn( shared_ptr<ServerConn> conn )
+{
+    string  pending, line, err;
+    int     rc, jrc;
+
+    while ((rc = read_line(conn->get_fd(), pending, line)) > 0) {
+        SERVER_JOB_T job;
+
+        if (line.find_first_not_of(" \t") == string::npos)
+            continue;
+
+        if ( ((jrc = parse_job(line, job, err)) < 0)
+            || ((jrc = resolve_id(job, err)) < 0) ) {
+            conn->send_line("result job=" + escape(job.id) + " rc="
+                + to_string(jrc) + " error=" + escape(err));
+            continue;
+        }
+
+        job.conn = conn;
+        job.queued = chrono::steady_clock::now();
+        if (submit(job) < 0) {
+            conn->send_line("result job=" + escape(job.id) + " rc="
+                + to_string(-ESHUTDOWN) + " error=stopping");
+        }
+    }
+
+    /* results of queued jobs still go out: they hold the connection */
+    lock_guard<mutex> guard(lock);
+    conns.erase(conn->get_fd());
+    idle.notify_all();
+}
+
+int FTDIServer::submit( SERVER_JOB_T &job )
+{
+    lock_guard<mutex> guard(lock);
+    SERVER_DEVICE_T *d;
+
+    if (stopping)
+        return -ESHUTDOWN;
+
+    if (devices.count(job.device) == 0) {
+        d = new SERVER_DEVICE_T;
+        d->key  = job.device;
+        d->busy = false;
+        d->session = NULL;
+        d->written_size = 0;
+        devices[job.device] = d;
+    }
+    d = devices[job.device];
+    d->pending.push_back(job);
+
+    /* A running session picks it up on its next round: coalesced */
+    if ( !d->busy ) {
+        d->busy = true;
+        busy++;
+        thread(&FTDIServer::device_worker, this, d).detach();
+    }
+
+    return 0;
+}
+
+void FTDIServer::device_worker( SERVER_DEVICE_T *d )
+{
+    for (;;) {
+        vector<SERVER_JOB_T> jobs;
+        {
+            lock_guard<mutex> guard(lock);
+
+            if (d->pending.empty()) {
+                /* no warm handle: the session failed, forget the device */
+                if (d->session == NULL) {
+                    devices.erase(d->key);
+                    delete d;
+                } else {
+                    d->busy = false;
+                }
+                busy--;
+                idle.notify_all();
+                return;
+            }
+            jobs.assign(d->pending.begin(), d->pending.end());
+            d->pending.clear();
+        }
+
+        run_session(d, jobs);
+    }
+}
+
+/* One read-modify-write on the device for every coalesced job */
+void FTDIServer::run_session( SERVER_DEVICE_T *d, vector<SERVER_JOB_T> &jobs )
+{
+    SERVER_JOB_T    &first = jobs[0];
+    FTDISession     *ses;
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    unsigned int    vid = 0, pid = 0;
+    const char      *manufacturer = NULL, *product = NULL, *serial = NULL;
+    bool            do_update = false, do_verify = false;
+    string          err, verify = "skip";
+    string          m, p, s;
+    int             rc = 0, size = 0, cur_vid = 0, cur_pid = 0;
+    size_t          i;
+
+    /* Merge: later request wins */
+    for (i = 0; i < jobs.size(); i++) {
+        SERVER_JOB_T &j = jobs[i];
+
+        if (j.set_vid)                  vid = j.set_vid;
+        if (j.set_pid)                  pid = j.set_pid;
+        if (!j.manufacturer.empty())    manufacturer = j.manufacturer.c_str();
+        if (!j.product.empty())         product = j.product.c_str();
+        if (!j.serial.empty())          serial = j.serial.c_str();
+        do_verify |= j.verify;
+    }
+    do_update = vid || pid || manufacturer || product || serial;
+
+    /* verify only: against the last image this server wrote */
+    if ( do_verify && !do_update && (d->written_size == 0) ) {
+        rc  = -EINVAL;
+        err = "verify: nothing written to this device";
+        goto done;
+    }
+
+    /* Warm handle: opened once, kept across sessions */
+    if (d->session == NULL) {
+        d->session = new FTDISession( &pool );
+        if ((rc = d->session->open(first.bus, first.dev,
+                                   first.vid, first.pid)) < 0) {
+            err = d->session->error();
+            goto done;
+        }
+    }
+    ses = d->session;
+
+    if ((rc = ses->read()) < 0) {
+        err = ses->error();
+        goto done;
+    }
+
+    size = ses->get_size();
+    if ( ses->is_blank() || (size <= 0) ) {
+        rc  = -ENODATA;
+        err = "EEPROM is blank";
+        goto done;
+    }
+
+    if ((rc = ses->decode()) < 0) {
+        err = ses->error();
+        goto done;
+    }
+
+    if ( do_update ) {
+        if ( ((rc = ses->patch(vid, pid, manufacturer, product, serial)) < 0)
+            || ((rc = ses->encode()) < 0)
+            || ((rc = ses->write()) < 0) )
+        {
+            d->written_size = 0;    /* unknown content */
+            err = ses->error();
+            goto done;
+        }
+        if (ses->store(d->written, size) == 0)
+            d->written_size = size;
+        if ( do_verify ) {
+            rc = ses->verify();
+            verify = (rc == 0) ? "pass" : "fail";
+            if (rc < 0) {
+                err = ses->error();
+                goto done;
+            }
+        }
+    } else if ( do_verify ) {
+        if ( (size != d->written_size)
+            || ((rc = ses->store(buf, size)) < 0)
+            || (memcmp(buf, d->written, size) != 0) )
+        {
+            rc  = (rc < 0) ? rc : -EIO;
+            err = "EEPROM differs from the last written image";
+            verify = "fail";
+            goto done;
+        }
+        verify = "pass";
+    }
+    rc = 0;
+    ses->get_value( VENDOR_ID, &cur_vid );
+    ses->get_value( PRODUCT_ID, &cur_pid );
+    ses->get_strings( m, p, s );
+
+done:
+    /* A failing handle is not kept warm */
+    if ( (rc < 0) && d->session ) {
+        delete d->session;
+        d->session = NULL;
+    }
+
+    for (i = 0; i < jobs.size(); i++) {
+        ostringstream res;
+        long ms = chrono::duration_cast<chrono::milliseconds>(
+                    chrono::steady_clock::now() - jobs[i].queued).count();
+
+        res << "result job=" << escape(jobs[i].id)
+            << " rc=" << rc
+            << " coalesced=" << jobs.size();
+        if (rc == 0) {
+            res << hex
+                << " vid=0x" << cur_vid
+                << " pid=0x" << cur_pid
+                << dec
+                << " manufacturer=" << escape(m)
+                << " product=" << escape(p)
+                << " serial=" << escape(s)
+                << " size=" << size;
+        }
+        res << " verify=" << verify
+            << " ms=" << ms;
+        if (rc < 0)
+            res << " error=" << escape(err);
+
+        jobs[i].conn->send_line( res.str() );
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+int FTDIServer::client( string path, FILE *in, FILE *out )
+{
+    struct sockaddr_un addr;
+    string  pending, line;
+    int     fd, rc, failed = 0;
+
+    if (path.size() >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -errno;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        DeviceLog log;
+
+        rc = -errno;
+        log(LOGL_ERROR) << "Fail to connect " << path << ": " << strerror(-rc) << endl;
+        close(fd);
+        return rc;
+    }
+
+    /* Send every request first: the server may coalesce them */
+    thread sender([fd, in] {
+        char buf[SERVER_LINE_MAX];
+
+        while (fgets(buf, sizeof(buf), in) != NULL) {
+            string req(buf);
+
+            if (req.empty() || req[req.size() - 1] != '\n')
+                req += '\n';
+            if (write_all(fd, req) < 0)
+                break;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    while ((rc = read_line(fd, pending, line)) > 0) {
+        fprintf(out, "%s\n", line.c_str());
+        fflush(out);
+        if (line.find(" rc=0 ") == string::npos)
+            failed++;
+    }
+
+    sender.join();
+    close(fd);
+
+    if (rc < 0)
+        return rc;
+    return failed ? -EIO : 0;
+}
@@ -0,0 +1,151 @@
+/*
+    Header of FTDIServer class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _FTDI_SERVER_HPP_
+#define _FTDI_SERVER_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <map>              /* map */
+#include <set>              /* set */
+#include <deque>            /* deque */
+#include <vector>           /* vector */
+#include <memory>           /* shared_ptr */
+#include <mutex>            /* mutex */
+#include <condition_variable>
+#include <chrono>           /* steady_clock */
+#include "ftdi_session.hpp"
+
+
+using namespace std;
+
+
+/* One request per line, one result line per request (any order):
+ *
+ *  job=7 bus=1:5 serial=FT0007 product=Widget%20v2 verify=1
+ *  result job=7 rc=0 coalesced=2 vid=0x403 pid=0x6001 serial=FT0007 verify=pass ms=412
+ *
+ *  selector    bus=BUS:DEV | id=VID:PID
+ *  update      vid= pid= manufacturer= product= serial=
+ *  flags       verify=0|1
+ *
+ * verify=1 reads the EEPROM back after the write; without an update, it
+ * compares the EEPROM with the image last written to the device by this
+ * server (none: the job fails).
+ * Values are %XX escaped (space, '=', '%', control characters).
+ * id=VID:PID is resolved to the bus:dev of the first matching device when the
+ * request arrives: requests are keyed by the physical device, whatever the
+ * selector. A device whose session fails (unplugged, ...) is forgotten, its
+ * warm handle and last written image with it.
+ * Requests for the same device that arrive while a session is running on it
+ * are coalesced into the next session: updates are merged in arrival order
+ * (later wins), every coalesced request receives the session's result.
+ */
+#define SERVER_LINE_MAX         (4096)
+#define SERVER_BACKLOG          (16)
+#define SERVER_POLL_MS          (500)
+
+
+class ServerConn {
+private:
+    int     fd;
+    mutex   wlock;                  /* results come from device threads */
+
+public:
+    ServerConn( int fd ) : fd(fd) {}
+    ~ServerConn();
+
+    int     get_fd()    { return fd; }
+    int     send_line( string line );
+};
+
+typedef struct SERVER_JOB_S {
+    string          id;
+    string          device;         /* selector: coalescing key */
+
+    int             bus, dev;
+    int             vid, pid;
+
+    unsigned int    set_vid;        /* 0: no change */
+    unsigned int    set_pid;
+    string          manufacturer;   /* empty: no change */
+    string          product;
+    string          serial;
+
+    bool            verify;
+
+    shared_ptr<ServerConn>              conn;
+    chrono::steady_clock::time_point    queued;
+} SERVER_JOB_T;
+
+typedef struct SERVER_DEVICE_S {
+    string              key;        /* "bus=B:D", in devices */
+    deque<SERVER_JOB_T> pending;
+    bool                busy;       /* a session thread is running */
+    FTDISession         *session;   /* warm handle, NULL: (re)open */
+    unsigned char       written[FTDI_MAX_EEPROM_SIZE];  /* last write */
+    int                 written_size;   /* 0: none */
+} SERVER_DEVICE_T;
+
+
+class FTDIServer {
+
+private:
+    string      path;
+    int         listen_fd;
+    FTDIPool    pool;               /* contexts outlive closed handles */
+
+    mutex               lock;
+    condition_variable  idle;
+    map<string, SERVER_DEVICE_T *>  devices;
+    set<int>            conns;
+    int                 busy;       /* device threads running */
+    bool                stopping;
+
+    static volatile int stop;
+    static void on_signal( int sig );
+
+    static int  parse_job( string line, SERVER_JOB_T &job, string &err );
+    static int  resolve_id( SERVER_JOB_T &job, string &err );
+
+    void    serve_conn( shared_ptr<ServerConn> conn );
+    int     submit( SERVER_JOB_T &job );
+    void    device_worker( SERVER_DEVICE_T *d );
+    void    run_session( SERVER_DEVICE_T *d, vector<SERVER_JOB_T> &jobs );
+
+public:
+    /* Constructor / Destructor */
+    FTDIServer( string path );
+    ~FTDIServer();
+
+    int     run( void );
+
+    /* send request lines from 'in', print result lines to 'out' */
+    static int  client( string path, FILE *in, FILE *out );
+
+    static string   escape( string s );
+    static string   unescape( string s );
+
+};  /* class FTDIServer */
+
+#endif  /* _FTDI_SERVER_HPP_ */
@@ -0,0 +1,616 @@
+/*
+    Implementation of FTDISession / FTDIPool classes (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy, memcmp, memset */
+#include <algorithm>        /* transform */
+#include "ftdi_session.hpp"
+#include "eeprom_checksum.hpp"
+
+
+/* index: enum ftdi_chip_type */
+static const char *chip_names[] = {
+    "AM", "BM", "2232C", "R", "2232H", "4232H", "232H", "230X",
+};
+
+/* 93C46 on AM / BM / 2232C, 128 bytes internal on R, 93C56 on the H series,
+ * 256 bytes used by libftdi of the X series MTP
+ */
+static const int chip_eeprom_sizes[] = {
+    0x80, 0x80, 0x80, 0x80, 0x100, 0x100, 0x100, 0x100,
+};
+
+
+/* ------------------------------ FTDIPool ------------------------------ */
+
+FTDIPool::FTDIPool( unsigned int max_idle )
+    : max_idle(max_idle)
+{
+}
+
+FTDIPool::~FTDIPool()
+{
+    for (size_t i = 0; i < idle.size(); i++)
+        ftdi_free( idle[i] );
+    idle.clear();
+}
+
+struct ftdi_context *FTDIPool::get( void )
+{
+    struct ftdi_context *ftdi = NULL;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        if (!idle.empty()) {
+            ftdi = idle.back();
+            idle.pop_back();
+        }
+    }
+
+    return ftdi ? ftdi : ftdi_new();
+}
+
+/* What ftdi_init() sets, but the libusb context (the point of the pool).
+ * The strings a decode allocated are released by decoding a string-less
+ * image, before the EEPROM structure is cleared.
+ */
+void FTDIPool::reset( struct ftdi_context *ftdi )
+{
+    unsigned char img[FTDI_MAX_EEPROM_SIZE / 2];
+    CHECKSUM_LAYOUT_T layout;
+
+    ftdi->usb_read_timeout  = 5000;
+    ftdi->usb_write_timeout = 5000;
+    ftdi->type      = TYPE_BM;
+    ftdi->baudrate  = -1;
+    ftdi->bitbang_enabled = 0;
+    ftdi->bitbang_mode    = 1;
+    ftdi->readbuffer_offset    = 0;
+    ftdi->readbuffer_remaining = 0;
+    ftdi->writebuffer_chunksize = 4096;
+    ftdi->max_packet_size = 0;
+    ftdi->error_str = NULL;
+    ftdi->module_detach_mode = AUTO_DETACH_SIO_MODULE;
+    ftdi_set_interface( ftdi, INTERFACE_ANY );
+    ftdi_read_data_set_chunksize( ftdi, 4096 );
+
+    memset(img, 0, sizeof(img));
+    if (EEPROMChecksum::layout( TYPE_BM, sizeof(img), &layout ) == 0) {
+        EEPROMChecksum::fix( img, layout );
+        ftdi_set_eeprom_buf( ftdi, img, sizeof(img) );
+        ftdi_set_eeprom_value( ftdi, CHIP_SIZE, sizeof(img) );
+        ftdi_eeprom_decode( ftdi, 0 );
+    }
+    /* buf, size, initialized_for_connected_device, ... all 0 (no device:
+     * returns -3 once cleared)
+     */
+    ftdi_eeprom_initdefaults( ftdi, NULL, NULL, NULL );
+}
+
+void FTDIPool::put( struct ftdi_context *ftdi )
+{
+    if (ftdi == NULL)
+        return;
+
+    /* device closed by the session; back to ftdi_new() defaults */
+    reset( ftdi );
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        if (idle.size() < max_idle) {
+            idle.push_back( ftdi );
+            return;
+        }
+    }
+
+    ftdi_free( ftdi );
+}
+
+void FTDIPool::drop( void )
+{
+    lock_guard<mutex> guard(lock);
+
+    idle.clear();
+}
+
+FTDIPool &FTDIPool::global( void )
+{
+    static FTDIPool pool;
+
+    return pool;
+}
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+FTDISession::FTDISession( FTDIPool *pool )
+    : pool(pool), transport(NULL), ftdi(NULL), opened(false), blank(false),
+      size(0), lib_rc(0), written_size(0)
+{
+}
+
+FTDISession::~FTDISession()
+{
+    close();
+
+    if (pool) {
+        pool->put( ftdi );
+    } else if (ftdi) {
+        ftdi_free( ftdi );
+    }
+    ftdi = NULL;
+}
+
+/* ------------------------------------------------------------------ */
+
+int FTDISession::acquire( void )
+{
+    if (ftdi)
+        return 0;
+
+    ftdi = pool ? pool->get() : ftdi_new();
+    if (ftdi == NULL)
+        return fail(-ENOMEM, 0, "Failed to new FTDI");
+
+    return 0;
+}
+
+int FTDISession::fail( int rc, int lrc, const char *what )
+{
+    lib_rc = lrc;
+    err = what;
+
+    if ( lrc && ftdi ) {
+        const char *s = ftdi_get_error_string( ftdi );
+
+        if (s && *s) {
+            err += ": ";
+            err += s;
+        }
+    }
+
+    return rc;
+}
+
+int FTDISession::open( int bus, int dev, int vid, int pid )
+{
+    int rc;
+
+    close();
+
+    if ((rc = acquire()) < 0)
+        return rc;
+
+    if ( transport && ((bus && dev) || (vid && pid)) ) {
+        if ((rc = transport->open(ftdi, bus, dev, vid, pid)) < 0)
+            return fail(-ENODEV, rc, "open");
+    } else if ( bus && dev ) {
+        if ((rc = ftdi_usb_open_bus_addr(ftdi, bus, dev)) < 0)
+            return fail(-ENODEV, rc, "open bus:dev");
+    } else if ( vid && pid ) {
+        if ((rc = ftdi_usb_open(ftdi, vid, pid)) < 0)
+            return fail(-ENODEV, rc, "open vid:pid");
+    } else {
+        return 0;               /* buffer only */
+    }
+
+    opened = true;
+    return 0;
+}
+
+void FTDISession::close( void )
+{
+    if (opened && ftdi) {
+        if (transport)
+            transport->close( ftdi );
+        else
+            ftdi_usb_close( ftdi );
+    }
+    opened = false;
+    blank = false;
+    size = 0;
+    written_size = 0;
+}
+
+/* Blank EEPROM: the chip type (known from open) gives the geometry, the
+ * buffer is all 0xFF as a full read would leave it (but CHIP_SIZE is set).
+ */
+int FTDISession::set_blank( void )
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    int rc;
+
+    size = chip_eeprom_size( ftdi->type );
+    memset(buf, 0xFF, size);
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, size)) < 0)
+        return fail(-EINVAL, rc, "set EEPROM buffer");
+
+    /* CAUTION: Hacking libftdi to enable this feature */
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, size);
+
+    blank = true;
+    return 1;
+}
+
+int FTDISession::read_word( int addr, unsigned short *word )
+{
+    int rc;
+
+    if ( !opened )
+        return fail(-ENODEV, 0, "device not open");
+
+    rc = transport ? transport->read_location(ftdi, addr, word)
+                   : ftdi_read_eeprom_location(ftdi, addr, word);
+    if (rc < 0)
+        return fail(-EIO, rc, "read EEPROM word");
+
+    return 0;
+}
+
+int FTDISession::port_path( string &path )
+{
+    libusb_device *dev;
+    uint8_t ports[8];
+    int i, n;
+
+    if ( !opened || !ftdi->usb_dev )
+        return -ENOTSUP;
+
+    dev = libusb_get_device( ftdi->usb_dev );
+    if ((n = libusb_get_port_numbers(dev, ports, sizeof(ports))) < 0)
+        return -EIO;
+
+    path = to_string( (int)libusb_get_bus_number(dev) );
+    for (i = 0; i < n; i++)
+        path += ((i == 0) ? "-" : ".") + to_string( (int)ports[i] );
+
+    return 0;
+}
+
+int FTDISession::probe( void )
+{
+    unsigned short word;
+    int i, rc;
+
+    for (i = 0; i < FTDI_PROBE_WORDS; i++) {
+        if ((rc = read_word(i, &word)) < 0)
+            return rc;
+        if (word != 0xFFFF)
+            return 0;
+    }
+
+    return set_blank();
+}
+
+int FTDISession::read( void )
+{
+    int rc;
+
+    if ( !opened )
+        return fail(-ENODEV, 0, "device not open");
+
+    rc = transport ? transport->read_eeprom(ftdi) : ftdi_read_eeprom(ftdi);
+    if (rc < 0)
+        return fail(-EIO, rc, "read EEPROM");
+
+    /* size will also be set to -1 in the case of Blank EEPROM */
+    ftdi_get_eeprom_value(ftdi, CHIP_SIZE, &size);
+    blank = (size == -1);
+
+    return 0;
+}
+
+/* size guess of ftdi_read_eeprom (libftdi 1.4): halves mirror on 93C46 */
+int FTDISession::size_guess( enum ftdi_chip_type type, const unsigned char *buf )
+{
+    unsigned int i;
+
+    for (i = 0; (i < FTDI_MAX_EEPROM_SIZE) && (buf[i] == 0xFF); i++)
+        ;
+
+    if (i == FTDI_MAX_EEPROM_SIZE)
+        return -1;
+    if (type == TYPE_R)
+        return 0x80;
+    if (memcmp(buf, buf + 0x80, 0x80) == 0)
+        return 0x80;
+    if (memcmp(buf, buf + 0x40, 0x40) == 0)
+        return 0x40;
+
+    return 0x100;
+}
+
+int FTDISession::read_done( const unsigned char *buf, unsigned int len )
+{
+    unsigned int i;
+    int rc;
+
+    if ( !opened )
+        return fail(-ENODEV, 0, "device not open");
+
+    if (len < FTDI_MAX_EEPROM_SIZE) {
+        for (i = 0; i < len; i++) {
+            if (buf[i] != 0xFF)
+                return fail(-EINVAL, 0, "partial read of a programmed EEPROM");
+        }
+        return set_blank();
+    }
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, FTDI_MAX_EEPROM_SIZE)) < 0)
+        return fail(-EINVAL, rc, "set EEPROM buffer");
+
+    size = size_guess( ftdi->type, buf );
+
+    /* CAUTION: Hacking libftdi to enable this feature */
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, size);
+    blank = (size == -1);
+
+    return 0;
+}
+
+int FTDISession::load( const unsigned char *buf, unsigned int len )
+{
+    int rc;
+
+    if ((rc = acquire()) < 0)
+        return rc;
+
+    if ( (len == 0) || (len > FTDI_MAX_EEPROM_SIZE) )
+        return fail(-EINVAL, 0, "image size");
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, len)) < 0)
+        return fail(-EINVAL, rc, "set EEPROM buffer");
+
+    /* CAUTION: Hacking libftdi to enable this feature */
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, len);
+
+    size = len;
+    blank = false;
+    return 0;
+}
+
+int FTDISession::decode( int verbose )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    if ((rc = ftdi_eeprom_decode(ftdi, verbose)) < 0)
+        return fail(-EBADMSG, rc, "decode");
+
+    return 0;
+}
+
+int FTDISession::patch(
+    unsigned int vid, unsigned int pid,
+    const char *manufacturer, const char *product, const char *serial )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    if ( vid && ((rc = ftdi_set_eeprom_value(ftdi, VENDOR_ID, vid)) < 0) )
+        return fail(-EINVAL, rc, "set VID");
+    if ( pid && ((rc = ftdi_set_eeprom_value(ftdi, PRODUCT_ID, pid)) < 0) )
+        return fail(-EINVAL, rc, "set PID");
+
+    if ( manufacturer || product || serial ) {
+        rc = ftdi_eeprom_set_strings(ftdi,
+                const_cast<char *>(manufacturer),
+                const_cast<char *>(product),
+                const_cast<char *>(serial));
+        if (rc < 0)
+            return fail(-EINVAL, rc, "set strings");
+    }
+
+    return 0;
+}
+
+int FTDISession::encode( void )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    /* returns the size used by the strings */
+    if ((rc = ftdi_eeprom_build(ftdi)) < 0)
+        return fail(-EINVAL, rc, "encode");
+
+    return rc;
+}
+
+int FTDISession::store( unsigned char *buf, unsigned int len )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    if ((rc = ftdi_get_eeprom_buf(ftdi, buf, len)) < 0)
+        return fail(-EINVAL, rc, "get EEPROM buffer");
+
+    return 0;
+}
+
+int FTDISession::write( void )
+{
+    int rc, len;
+
+    if ( !opened )
+        return fail(-ENODEV, 0, "device not open");
+
+    len = (size > 0) ? size : FTDI_MAX_EEPROM_SIZE;
+    if ((rc = ftdi_get_eeprom_buf(ftdi, written, len)) < 0)
+        return fail(-EINVAL, rc, "get EEPROM buffer");
+
+    rc = transport ? transport->write_eeprom(ftdi) : ftdi_write_eeprom(ftdi);
+    if (rc < 0)
+        return fail(-EIO, rc, "write EEPROM");
+
+    written_size = len;
+    return 0;
+}
+
+int FTDISession::write_words( const unsigned char *buf, unsigned int len,
+                              const vector<unsigned int> &words )
+{
+    unsigned short status;
+    size_t i;
+    int rc;
+
+    if ( !opened )
+        return fail(-ENODEV, 0, "device not open");
+    if ( transport )
+        return fail(-ENOTSUP, 0, "word write: USB devices only");
+    if ( (len > FTDI_MAX_EEPROM_SIZE) || (len & 1) )
+        return fail(-EINVAL, 0, "bad EEPROM size");
+
+    /* what ftdi_write_eeprom() sends before the words */
+    if ( ((rc = ftdi_usb_reset(ftdi)) < 0)
+        || ((rc = ftdi_poll_modem_status(ftdi, &status)) < 0)
+        || ((rc = ftdi_set_latency_timer(ftdi, FTDI_WRITE_LATENCY)) < 0) )
+        return fail(-EIO, rc, "prepare EEPROM write");
+
+    for (i = 0; i < words.size(); i++) {
+        unsigned int w = words[i];
+
+        if (w * 2 + 1 >= len)
+            return fail(-EINVAL, 0, "word out of EEPROM");
+
+        rc = libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+                SIO_WRITE_EEPROM_REQUEST, buf[w * 2] | (buf[w * 2 + 1] << 8), w,
+                NULL, 0, ftdi->usb_write_timeout);
+        if (rc < 0)
+            return fail(-EIO, rc, "write EEPROM word");
+    }
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, buf, len)) < 0)
+        return fail(-EINVAL, rc, "set EEPROM buffer");
+
+    memcpy(written, buf, len);
+    written_size = len;
+    return 0;
+}
+
+int FTDISession::verify( void )
+{
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    int rc;
+
+    if ( written_size == 0 )
+        return fail(-EINVAL, 0, "nothing written");
+
+    if ((rc = read()) < 0)
+        return rc;
+    if ((rc = ftdi_get_eeprom_buf(ftdi, buf, written_size)) < 0)
+        return fail(-EINVAL, rc, "get EEPROM buffer");
+
+    if (memcmp(buf, written, written_size) != 0)
+        return fail(-EILSEQ, 0, "verify mismatch");
+
+    return 0;
+}
+
+int FTDISession::get_value( enum ftdi_eeprom_value name, int *value )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    if ((rc = ftdi_get_eeprom_value(ftdi, name, value)) < 0)
+        return fail(-EINVAL, rc, "get value");
+
+    return 0;
+}
+
+int FTDISession::set_value( enum ftdi_eeprom_value name, int value )
+{
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    if ((rc = ftdi_set_eeprom_value(ftdi, name, value)) < 0)
+        return fail(-EINVAL, rc, "set value");
+
+    return 0;
+}
+
+int FTDISession::get_strings( string &manufacturer, string &product,
+                              string &serial )
+{
+    char m[FTDI_MAX_EEPROM_SIZE], p[FTDI_MAX_EEPROM_SIZE], s[FTDI_MAX_EEPROM_SIZE];
+    int rc;
+
+    if ( !ftdi )
+        return fail(-ENODEV, 0, "no context");
+
+    m[0] = p[0] = s[0] = '\0';
+    rc = ftdi_eeprom_get_strings(ftdi, m, sizeof(m), p, sizeof(p), s, sizeof(s));
+    if (rc < 0)
+        return fail(-EINVAL, rc, "get strings");
+
+    manufacturer = m;
+    product = p;
+    serial = s;
+
+    return 0;
+}
+
+const char *FTDISession::chip_name( enum ftdi_chip_type type )
+{
+    if ( ((int)type < 0)
+        || ((size_t)type >= sizeof(chip_names) / sizeof(chip_names[0])) )
+        return "unknown";
+
+    return chip_names[type];
+}
+
+int FTDISession::chip_eeprom_size( enum ftdi_chip_type type )
+{
+    if ( ((int)type < 0)
+        || ((size_t)type >= sizeof(chip_eeprom_sizes) / sizeof(chip_eeprom_sizes[0])) )
+        return FTDI_MAX_EEPROM_SIZE;
+
+    return chip_eeprom_sizes[type];
+}
+
+int FTDISession::chip_parse( string name, enum ftdi_chip_type *type )
+{
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name.compare(0, 2, "FT") == 0)
+        name = name.substr(2);
+
+    for (size_t i = 0; i < sizeof(chip_names) / sizeof(chip_names[0]); i++) {
+        if (name == chip_names[i]) {
+            *type = (enum ftdi_chip_type)i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
@@ -0,0 +1,195 @@
+/*
+    Header of FTDISession / FTDIPool classes (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _FTDI_SESSION_HPP_
+#define _FTDI_SESSION_HPP_
+
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <mutex>            /* mutex */
+#include <ftdi.h>
+
+
+/* copied from libftdi::ftdi_i.h */
+#ifndef FTDI_MAX_EEPROM_SIZE
+#define FTDI_MAX_EEPROM_SIZE    (256)               /* MUST fit in INT */
+#endif
+
+#define FTDI_POOL_MAX_IDLE      (64)
+
+/* latency timer ftdi_write_eeprom() sets before writing (traced from MProg) */
+#define FTDI_WRITE_LATENCY      (0x77)
+
+/* words read by probe(): VID / PID are never 0xFFFF in a programmed EEPROM */
+#define FTDI_PROBE_WORDS        (4)
+
+
+using namespace std;
+
+
+/* Pool of ftdi_context: ftdi_new() initialises a libusb context each time,
+ * a pooled context keeps it (closed device, reusable for any other device).
+ */
+class FTDIPool {
+
+private:
+    mutex                           lock;
+    vector<struct ftdi_context *>   idle;
+    unsigned int                    max_idle;
+
+    /* the previous user's chip type, EEPROM, timeouts, bitbang: gone */
+    static void         reset( struct ftdi_context *ftdi );
+
+public:
+    /* Constructor / Destructor */
+    FTDIPool( unsigned int max_idle = FTDI_POOL_MAX_IDLE );
+    ~FTDIPool();
+
+    struct ftdi_context *get( void );
+    void                put( struct ftdi_context *ftdi );
+    /* after fork(): the parent's libusb contexts, forgotten (not freed) */
+    void                drop( void );
+
+    /* process wide pool */
+    static FTDIPool     &global( void );
+
+};  /* class FTDIPool */
+
+
+/* Device side of a session, libftdi (libusb) when none is set.
+ * Works on the session's context the way libftdi does: read_eeprom fills the
+ * EEPROM buffer and CHIP_SIZE (-1: blank), write_eeprom sends the buffer.
+ * Returns libftdi codes (<0: failure). Used for simulated devices.
+ */
+class FTDITransport {
+
+public:
+    virtual ~FTDITransport() {}
+
+    virtual int     open( struct ftdi_context *ftdi,
+                          int bus, int dev, int vid, int pid ) = 0;
+    virtual void    close( struct ftdi_context *ftdi ) = 0;
+
+    virtual int     read_eeprom( struct ftdi_context *ftdi ) = 0;
+    virtual int     read_location( struct ftdi_context *ftdi,
+                                   int addr, unsigned short *word ) = 0;
+    virtual int     write_eeprom( struct ftdi_context *ftdi ) = 0;
+
+};  /* class FTDITransport */
+
+
+/* Reentrant EEPROM session: nothing is printed, every method returns 0 (or
+ * a size) on success, -errno on failure; error() tells what failed.
+ * One session must not be used by two threads at the same time, different
+ * sessions are independent.
+ *
+ *  open -> read -> decode -> patch -> encode -> write -> verify
+ *          load                               store
+ *
+ * probe() before read() tells a blank EEPROM from a few words; a blank one
+ * needs no read, no decode: load an encoded image and write it.
+ */
+class FTDISession {
+
+private:
+    FTDIPool            *pool;
+    FTDITransport       *transport; /* NULL: libftdi */
+    struct ftdi_context *ftdi;
+    bool                opened;
+    bool                blank;
+    int                 size;
+    int                 lib_rc;     /* last libftdi return code */
+    string              err;
+
+    unsigned char       written[FTDI_MAX_EEPROM_SIZE];
+    int                 written_size;
+
+    int     acquire( void );
+    int     fail( int rc, int lrc, const char *what );
+    int     set_blank( void );
+
+public:
+    /* Constructor / Destructor */
+    FTDISession( FTDIPool *pool = &FTDIPool::global() );
+    ~FTDISession();
+
+    /* bus:dev wins over vid:pid, 0 = not used. All 0: no device (buffer) */
+    int     open( int bus, int dev, int vid, int pid );
+    void    close( void );
+
+    int     probe( void );                          /* 1: blank, 0: read() */
+    int     read_word( int addr, unsigned short *word );    /* one word */
+    int     read( void );                           /* EEPROM -> buffer */
+    /* EEPROM read by the caller (asynchronous I/O): the probed words (blank)
+     * or FTDI_MAX_EEPROM_SIZE bytes, same result as probe() / read()
+     */
+    int     read_done( const unsigned char *buf, unsigned int len );
+    int     load( const unsigned char *buf, unsigned int size );
+
+    int     decode( int verbose = 0 );              /* buffer -> structure */
+    int     patch(
+                unsigned int vid, unsigned int pid,     /* 0: no change */
+                const char *manufacturer,               /* NULL: no change */
+                const char *product,
+                const char *serial );
+    int     encode( void );                         /* structure -> buffer */
+
+    int     store( unsigned char *buf, unsigned int size );
+    int     write( void );                          /* buffer -> EEPROM */
+    /* only these words (addresses) of buf, then buf is the buffer.
+     * libftdi (USB) devices only: a transport writes whole EEPROMs
+     */
+    int     write_words( const unsigned char *buf, unsigned int size,
+                         const vector<unsigned int> &words );
+    int     verify( void );                         /* EEPROM == written */
+
+    int     get_value( enum ftdi_eeprom_value name, int *value );
+    int     set_value( enum ftdi_eeprom_value name, int value );
+    int     get_strings( string &manufacturer, string &product, string &serial );
+
+    bool    is_open()       { return opened; }
+    /* USB port path, as sysfs: "1-2.3" (bus 1, hub port 2, port 3) */
+    int     port_path( string &path );
+    bool    is_blank()      { return blank; }
+    int     get_size()      { return size; }
+
+    int     lib_error()     { return lib_rc; }
+    const string &error()   { return err; }
+
+    /* "AM", "BM", ... "230X" (case insensitive, "FT" prefix allowed) */
+    static const char   *chip_name( enum ftdi_chip_type type );
+    static int          chip_parse( string name, enum ftdi_chip_type *type );
+    /* CHIP_SIZE from FTDI_MAX_EEPROM_SIZE bytes read (-1: blank) */
+    static int          size_guess( enum ftdi_chip_type type, const unsigned char *buf );
+    /* EEPROM size of a blank part: internal, or the usual 93Cx6 */
+    static int          chip_eeprom_size( enum ftdi_chip_type type );
+
+    /* not owned, set before open */
+    void    set_transport( FTDITransport *t )   { close(); transport = t; }
+
+    /* escape hatch for libftdi calls not covered here */
+    struct ftdi_context *context()  { return ftdi; }
+
+};  /* class FTDISession */
+
+#endif  /* _FTDI_SESSION_HPP_ */
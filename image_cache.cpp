@@ -0,0 +1,130 @@
+/*
+    Implementation of ImageCache class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy */
+#include "image_cache.hpp"
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+ImageCache::ImageCache( FTDIPool *pool )
+    : pool(pool), update(), hits(0), misses(0)
+{
+}
+
+/* ------------------------------------------------------------------ */
+
+int ImageCache::set_template( enum ftdi_chip_type type,
+                              const unsigned char *buf, unsigned int size )
+{
+    if ( (size == 0) || (size > FTDI_MAX_EEPROM_SIZE) )
+        return -EINVAL;
+
+    lock_guard<mutex> guard(lock);
+
+    templates[type].assign(buf, buf + size);
+
+    /* images of this chip type are stale */
+    for (map<CACHE_KEY_T, vector<unsigned char> >::iterator it = images.begin();
+         it != images.end(); ) {
+        if (it->first.first == type)
+            images.erase(it++);
+        else
+            it++;
+    }
+
+    return 0;
+}
+
+/* template of the chip type, padded (0) or truncated to the EEPROM size,
+ * decoded as that chip type, updated, encoded
+ */
+int ImageCache::build( enum ftdi_chip_type type, unsigned int size,
+                       vector<unsigned char> &img, string &err )
+{
+    map<int, vector<unsigned char> >::const_iterator t = templates.find(type);
+    unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+    FTDISession ses( pool );
+    int rc;
+
+    if (t == templates.end()) {
+        err = string("no image for chip type ") + FTDISession::chip_name(type);
+        return -ENOENT;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, t->second.data(), min((size_t)size, t->second.size()));
+
+    if ((rc = ses.load(buf, size)) < 0) {
+        err = ses.error();
+        return rc;
+    }
+    ses.context()->type = type;
+
+    if ( ((rc = ses.decode()) < 0)
+        || ((rc = ses.patch(update.vid, update.pid,
+                update.manufacturer.empty() ? NULL : update.manufacturer.c_str(),
+                update.product.empty()      ? NULL : update.product.c_str(),
+                update.serial.empty()       ? NULL : update.serial.c_str())) < 0)
+        || ((rc = plan.apply(ses)) < 0)
+        || ((rc = ses.encode()) < 0)
+        || ((rc = ses.store(buf, size)) < 0) )
+    {
+        err = ses.error();
+        return rc;
+    }
+
+    img.assign(buf, buf + size);
+    return 0;
+}
+
+int ImageCache::get( enum ftdi_chip_type type, unsigned int size,
+                     unsigned char *img, string &err )
+{
+    CACHE_KEY_T key( type, size );
+    map<CACHE_KEY_T, vector<unsigned char> >::iterator it;
+    int rc;
+
+    if ( (size == 0) || (size > FTDI_MAX_EEPROM_SIZE) ) {
+        err = "EEPROM size";
+        return -EINVAL;
+    }
+
+    /* built under the lock: devices of the same kind wait for one build */
+    lock_guard<mutex> guard(lock);
+
+    if ((it = images.find(key)) == images.end()) {
+        vector<unsigned char> built;
+
+        if ((rc = build(type, size, built, err)) < 0)
+            return rc;
+
+        it = images.insert( make_pair(key, built) ).first;
+        misses++;
+    } else {
+        hits++;
+    }
+
+    memcpy(img, it->second.data(), size);
+    return 0;
+}
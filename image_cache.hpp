@@ -0,0 +1,95 @@
+/*
+    Header of ImageCache class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _IMAGE_CACHE_HPP_
+#define _IMAGE_CACHE_HPP_
+
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <map>              /* map */
+#include <mutex>            /* mutex */
+#include <ftdi.h>
+#include "ftdi_session.hpp"
+#include "patch_plan.hpp"
+
+
+using namespace std;
+
+
+/* Updates of the job, applied to every template (empty / 0: no change) */
+typedef struct IMAGE_CACHE_UPDATE_S {
+    unsigned int    vid;
+    unsigned int    pid;
+    string          manufacturer;
+    string          product;
+    string          serial;
+} IMAGE_CACHE_UPDATE_T;
+
+
+/* Encoded images of one job, one per (chip type, EEPROM size).
+ * The first device of a kind pays for decode / update / encode of the
+ * template of its chip type; every other one gets a copy. Thread safe.
+ */
+class ImageCache {
+
+private:
+    typedef pair<int, unsigned int> CACHE_KEY_T;    /* chip type, size */
+
+    mutex               lock;
+    FTDIPool            *pool;
+    map<int, vector<unsigned char> >            templates;  /* by chip type */
+    map<CACHE_KEY_T, vector<unsigned char> >    images;
+
+    IMAGE_CACHE_UPDATE_T    update;
+    PatchPlan               plan;
+
+    unsigned long       hits;
+    unsigned long       misses;
+
+    int     build( enum ftdi_chip_type type, unsigned int size,
+                   vector<unsigned char> &img, string &err );
+
+public:
+    /* Constructor / Destructor */
+    ImageCache( FTDIPool *pool = &FTDIPool::global() );
+    ~ImageCache() {}
+
+    /* job definition, before the first get() */
+    int     set_template( enum ftdi_chip_type type,
+                          const unsigned char *buf, unsigned int size );
+    void    set_update( const IMAGE_CACHE_UPDATE_T &u )     { update = u; }
+    void    set_plan( const PatchPlan &p )                  { plan = p; }
+
+    bool    has_template( enum ftdi_chip_type type )
+            { return templates.count(type) > 0; }
+
+    /* encoded image for the device: 'size' bytes copied to img */
+    int     get( enum ftdi_chip_type type, unsigned int size,
+                 unsigned char *img, string &err );
+
+    unsigned long   get_hits()      { return hits; }
+    unsigned long   get_misses()    { return misses; }
+
+};  /* class ImageCache */
+
+#endif  /* _IMAGE_CACHE_HPP_ */
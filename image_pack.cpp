@@ -0,0 +1,341 @@
+/*
+    Implementation of ImagePack class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream */
+#include <iomanip>          /* setw, setfill, ... */
+#include <algorithm>        /* sort, lower_bound */
+#include <thread>           /* thread */
+#include <vector>           /* vector */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy, memcmp, strncpy */
+#include <fcntl.h>          /* open */
+#include <unistd.h>         /* close, ftruncate */
+#include <sys/mman.h>       /* mmap */
+#include <sys/stat.h>       /* fstat */
+#include "ftdi_session.hpp"
+#include "image_pack.hpp"
+
+
+static inline uint64_t pack_align( uint64_t v )
+{
+    return (v + FTPK_ALIGN - 1) & ~((uint64_t)FTPK_ALIGN - 1);
+}
+
+static bool index_less( const FTPK_INDEX_T &a, const FTPK_INDEX_T &b )
+{
+    return memcmp(a.serial, b.serial, FTPK_KEY_SIZE) < 0;
+}
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+ImagePack::ImagePack()
+    : fd(-1), map(NULL), map_size(0),
+      header(NULL), index(NULL), images(NULL)
+{
+}
+
+ImagePack::~ImagePack()
+{
+    close();
+}
+
+/* ------------------------------------------------------------------ */
+
+int ImagePack::open( string path )
+{
+    struct stat st;
+    const FTPK_HEADER_T *h;
+
+    close();
+
+    if ((fd = ::open(path.c_str(), O_RDONLY)) < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0) {
+        close();
+        return -errno;
+    }
+    if ((size_t)st.st_size < sizeof(FTPK_HEADER_T)) {
+        close();
+        return -EINVAL;
+    }
+
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        close();
+        return -errno;
+    }
+
+    /* Validate: every section must lie within the file */
+    h = static_cast<const FTPK_HEADER_T *>(map);
+    if ( (memcmp(h->magic, FTPK_MAGIC, sizeof(h->magic)) != 0)
+        || (h->version != FTPK_VERSION)
+        || (h->header_size != sizeof(FTPK_HEADER_T))
+        || (h->key_size != FTPK_KEY_SIZE)
+        || (h->image_size == 0)
+        || (h->image_size > h->image_stride)
+        || (h->image_offset + (uint64_t)h->count * h->image_stride > map_size)
+        || (h->index_offset + (uint64_t)h->count * sizeof(FTPK_INDEX_T) > map_size) )
+    {
+        close();
+        return -EINVAL;
+    }
+
+    header = h;
+    images = static_cast<const unsigned char *>(map) + h->image_offset;
+    index  = reinterpret_cast<const FTPK_INDEX_T *>(
+                static_cast<const unsigned char *>(map) + h->index_offset);
+
+    return 0;
+}
+
+void ImagePack::close( void )
+{
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    map_size = 0;
+    header = NULL;
+    index = NULL;
+    images = NULL;
+}
+
+const unsigned char *ImagePack::lookup( string serial )
+{
+    FTPK_INDEX_T key;
+    const FTPK_INDEX_T *end, *it;
+
+    if ( !header || (serial.size() > FTPK_KEY_SIZE) )
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.serial, serial.data(), serial.size());
+
+    end = index + header->count;
+    it  = lower_bound(index, end, key, index_less);
+    if ( (it == end) || (memcmp(it->serial, key.serial, FTPK_KEY_SIZE) != 0) )
+        return NULL;
+
+    if (it->image >= header->count)     /* corrupted index */
+        return NULL;
+
+    return images + (size_t)it->image * header->image_stride;
+}
+
+/* ------------------------------------------------------------------ */
+
+/* Encode images [from, to) with its own session: libftdi is not
+ * reentrant on a shared context.
+ */
+static void build_range(
+    enum ftdi_chip_type type, const unsigned char *tmpl, unsigned int size,
+    string prefix, unsigned long first, unsigned int width,
+    unsigned char *images, uint32_t stride, FTPK_INDEX_T *index,
+    unsigned long from, unsigned long to,
+    int *result )
+{
+    FTDISession session;
+    unsigned long i;
+    int rc;
+
+    if ((rc = session.load(tmpl, size)) < 0) {
+        *result = rc;
+        return;
+    }
+    /* a pooled context is TYPE_BM: decode / encode with the template's layout */
+    session.context()->type = type;
+
+    if ((rc = session.decode()) < 0) {
+        *result = rc;
+        return;
+    }
+
+    for (i = from; i < to; i++) {
+        ostringstream serial;
+
+        serial << prefix << setw(width) << setfill('0') << (first + i);
+
+        if ((rc = session.patch(0, 0, NULL, NULL, serial.str().c_str())) < 0)
+            break;
+        if ((rc = session.encode()) < 0)
+            break;
+        if ((rc = session.store(images + i * stride, size)) < 0)
+            break;
+
+        strncpy(index[i].serial, serial.str().c_str(), FTPK_KEY_SIZE);
+        index[i].image = i;
+        rc = 0;
+    }
+
+    *result = rc;
+}
+
+int ImagePack::build(
+    string path, enum ftdi_chip_type type,
+    const unsigned char *tmpl, unsigned int size,
+    string prefix, unsigned long first, unsigned long count,
+    unsigned int width, unsigned int threads, string &err )
+{
+    FTPK_HEADER_T   *h;
+    FTPK_INDEX_T    *idx;
+    unsigned char   *base;
+    uint64_t        total;
+    string          tmp_path = path + ".tmp";
+    vector<thread>  workers;
+    vector<int>     results;
+    unsigned long   chunk, i;
+    int             fd, rc = 0;
+    void            *m;
+
+    if ( (size == 0) || (count == 0) || (count > UINT32_MAX) ) {
+        err = "bad image size or count";
+        return -EINVAL;
+    }
+
+    /* the longest serial has to fit in the key */
+    {
+        ostringstream last;
+        last << prefix << setw(width) << setfill('0') << (first + count - 1);
+        if (last.str().size() > FTPK_KEY_SIZE) {
+            err = "serial " + last.str() + " is longer than "
+                + to_string(FTPK_KEY_SIZE) + " characters";
+            return -ENAMETOOLONG;
+        }
+    }
+
+    if ( threads == 0 )
+        threads = max(1u, thread::hardware_concurrency());
+    if ( threads > count )
+        threads = count;
+
+    /* Layout */
+    uint32_t stride = pack_align(size);
+    uint64_t image_offset = pack_align(sizeof(FTPK_HEADER_T));
+    uint64_t index_offset = pack_align(image_offset + (uint64_t)count * stride);
+    total = index_offset + (uint64_t)count * sizeof(FTPK_INDEX_T);
+
+    if ((fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        rc  = -errno;
+        err = "fail to create " + tmp_path;
+        return rc;
+    }
+    if (ftruncate(fd, total) < 0) {
+        rc  = -errno;
+        err = "fail to size " + tmp_path;
+        goto err_close;
+    }
+    m = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        rc  = -errno;
+        err = "fail to map " + tmp_path;
+        goto err_close;
+    }
+
+    base = static_cast<unsigned char *>(m);
+    h    = reinterpret_cast<FTPK_HEADER_T *>(base);
+    idx  = reinterpret_cast<FTPK_INDEX_T *>(base + index_offset);
+
+    /* Encode images in parallel (file is sparse & zero filled) */
+    chunk = (count + threads - 1) / threads;
+    results.resize(threads, 0);
+    for (i = 0; i < threads; i++) {
+        unsigned long from = i * chunk;
+        unsigned long to   = min(count, from + chunk);
+
+        workers.push_back( thread(build_range,
+            type, tmpl, size, prefix, first, width,
+            base + image_offset, stride, idx,
+            from, to, &results[i]) );
+    }
+    for (i = 0; i < workers.size(); i++) {
+        workers[i].join();
+        if (results[i] < 0)
+            rc = results[i];
+    }
+    if (rc < 0) {
+        err = "fail to encode images for pack: " + to_string(rc);
+        goto err_unmap;
+    }
+
+    sort(idx, idx + count, index_less);
+    for (i = 1; i < count; i++) {
+        if (memcmp(idx[i - 1].serial, idx[i].serial, FTPK_KEY_SIZE) == 0) {
+            err = "duplicated serial in pack: "
+                + string(idx[i].serial, strnlen(idx[i].serial, FTPK_KEY_SIZE));
+            rc = -EEXIST;
+            goto err_unmap;
+        }
+    }
+
+    /* Header goes last: an interrupted build never looks valid */
+    memcpy(h->magic, FTPK_MAGIC, sizeof(h->magic));
+    h->version      = FTPK_VERSION;
+    h->header_size  = sizeof(FTPK_HEADER_T);
+    h->image_size   = size;
+    h->image_stride = stride;
+    h->count        = count;
+    h->key_size     = FTPK_KEY_SIZE;
+    h->image_offset = image_offset;
+    h->index_offset = index_offset;
+
+    if (msync(m, total, MS_SYNC) < 0) {
+        rc  = -errno;
+        err = "fail to sync " + tmp_path;
+    }
+
+err_unmap:
+    munmap(m, total);
+err_close:
+    ::close(fd);
+
+    if (rc < 0) {
+        unlink(tmp_path.c_str());
+        return rc;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        rc  = -errno;
+        err = "fail to rename " + tmp_path;
+        unlink(tmp_path.c_str());
+    }
+
+    return rc;
+}
+
+bool ImagePack::split_spec( string spec, string &path, string &serial )
+{
+    size_t pos = spec.rfind(PACK_KEY_SEPARATOR);
+
+    if ( (pos == string::npos) || (pos == 0) || (pos == spec.size() - 1) )
+        return false;
+
+    path   = spec.substr(0, pos);
+    serial = spec.substr(pos + 1);
+    return true;
+}
@@ -0,0 +1,115 @@
+/*
+    Header of ImagePack class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _IMAGE_PACK_HPP_
+#define _IMAGE_PACK_HPP_
+
+#include <stdint.h>         /* uint32_t, ... */
+#include <string>           /* string */
+#include <ftdi.h>
+
+
+using namespace std;
+
+
+/* Pack file layout (host byte order, every section 64-byte aligned)
+ *
+ *  +----------------------+  0
+ *  | FTPK_HEADER_T        |
+ *  +----------------------+  image_offset
+ *  | image[0]             |  image_stride bytes each
+ *  | ...                  |
+ *  | image[count-1]       |
+ *  +----------------------+  index_offset
+ *  | FTPK_INDEX_T[count]  |  sorted by serial (memcmp)
+ *  +----------------------+
+ */
+#define FTPK_MAGIC              "FTPK"
+#define FTPK_VERSION            (1)
+#define FTPK_ALIGN              (64)
+#define FTPK_KEY_SIZE           (32)        /* serial, zero padded */
+
+#define PACK_KEY_SEPARATOR      '#'         /* --in pack.ftpk#SERIAL */
+
+
+typedef struct FTPK_HEADER_S {
+    char        magic[4];           /* FTPK_MAGIC */
+    uint16_t    version;            /* FTPK_VERSION */
+    uint16_t    header_size;        /* sizeof(FTPK_HEADER_T) */
+    uint32_t    image_size;         /* bytes of one EEPROM image */
+    uint32_t    image_stride;       /* distance between two images */
+    uint32_t    count;              /* number of images */
+    uint32_t    key_size;           /* FTPK_KEY_SIZE */
+    uint64_t    image_offset;       /* image[0] */
+    uint64_t    index_offset;       /* index[0] */
+    uint8_t     reserved[24];
+} FTPK_HEADER_T;
+
+typedef struct FTPK_INDEX_S {
+    char        serial[FTPK_KEY_SIZE];
+    uint32_t    image;              /* index into image array */
+    uint32_t    reserved;
+} FTPK_INDEX_T;
+
+
+class ImagePack {
+
+private:
+    int             fd;
+    void            *map;
+    size_t          map_size;
+
+    const FTPK_HEADER_T *header;
+    const FTPK_INDEX_T  *index;
+    const unsigned char *images;
+
+public:
+    /* Constructor / Destructor */
+    ImagePack();
+    ~ImagePack();
+
+    int     open( string path );
+    void    close( void );
+
+    unsigned int    get_image_size()    { return header ? header->image_size : 0; }
+    unsigned int    get_count()         { return header ? header->count : 0; }
+
+    /* O(log n) look up by serial. NULL if not found */
+    const unsigned char *lookup( string serial );
+
+    /* Build a pack out of a (decoded-able) template image of chip 'type'.
+     * serial of each image: prefix + zero padded (first + i), i < count
+     * Nothing is printed: err tells what failed
+     */
+    static int  build(
+                    string path, enum ftdi_chip_type type,
+                    const unsigned char *tmpl, unsigned int size,
+                    string prefix, unsigned long first, unsigned long count,
+                    unsigned int width, unsigned int threads, string &err );
+
+    /* "pack.ftpk#SERIAL" -> "pack.ftpk", "SERIAL" */
+    static bool split_spec( string spec, string &path, string &serial );
+
+};  /* class ImagePack */
+
+#endif  /* _IMAGE_PACK_HPP_ */
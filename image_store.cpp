@@ -0,0 +1,595 @@
+/*
+    Implementation of ImageStore class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream */
+#include <iomanip>          /* setw, setfill, ... */
+#include <algorithm>        /* sort, lower_bound */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy, memcmp */
+#include <fcntl.h>          /* open */
+#include <unistd.h>         /* close, pread, pwrite */
+#include <sys/mman.h>       /* mmap */
+#include <sys/stat.h>       /* fstat */
+#include <sys/file.h>       /* flock */
+#include "ftdi_session.hpp"
+#include "image_store.hpp"
+
+
+static inline uint64_t store_align( uint64_t v )
+{
+    return (v + FTDS_ALIGN - 1) & ~((uint64_t)FTDS_ALIGN - 1);
+}
+
+static bool entry_less( const FTDX_ENTRY_T &a, const FTDX_ENTRY_T &b )
+{
+    return a.hash < b.hash;
+}
+
+static bool record_valid( const FTDS_RECORD_T &r )
+{
+    if ( (r.size == 0) || (r.size > FTDI_MAX_EEPROM_SIZE) || (r.size & 1) )
+        return false;
+    if (r.type == FTDS_TYPE_BASE)
+        return (r.nwords == 0);
+    if (r.type == FTDS_TYPE_DELTA)
+        return (r.nwords <= r.size / 2);
+    return false;
+}
+
+static size_t record_length( const FTDS_RECORD_T &r )
+{
+    size_t payload = (r.type == FTDS_TYPE_BASE)
+                    ? r.size : r.nwords * sizeof(FTDS_DELTA_T);
+
+    return store_align( sizeof(FTDS_RECORD_T) + payload );
+}
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+ImageStore::ImageStore()
+    : fd(-1), writable(false),
+      map(NULL), map_size(0), idx_map(NULL), idx_size(0),
+      index(NULL), count(0), end(0)
+{
+}
+
+ImageStore::~ImageStore()
+{
+    close();
+}
+
+/* ------------------------------------------------------------------ */
+
+int ImageStore::open( string path, bool writable )
+{
+    FTDS_HEADER_T h;
+    struct stat st;
+    uint64_t covered = sizeof(FTDS_HEADER_T);
+    int rc;
+
+    close();
+
+    this->path = path;
+    this->writable = writable;
+
+    fd = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0)
+        return -errno;
+
+    /* one writer; readers never lock (append only, index renamed) */
+    if ( writable && (flock(fd, LOCK_EX) < 0) ) {
+        rc = -errno;
+        close();
+        return rc;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        close();
+        return rc;
+    }
+
+    if ( writable && (st.st_size == 0) ) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, FTDS_MAGIC, sizeof(h.magic));
+        h.version = FTDS_VERSION;
+        h.header_size = sizeof(FTDS_HEADER_T);
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+            rc = -errno;
+            close();
+            return rc;
+        }
+    } else if ( (pread(fd, &h, sizeof(h), 0) != sizeof(h))
+        || (memcmp(h.magic, FTDS_MAGIC, sizeof(h.magic)) != 0)
+        || (h.version != FTDS_VERSION)
+        || (h.header_size != sizeof(FTDS_HEADER_T)) )
+    {
+        close();
+        return -EINVAL;
+    }
+
+    /* index first: everything it covers is in the store mapped after it */
+    if ( map_index() == 0 )
+        covered = reinterpret_cast<const FTDX_HEADER_T *>(idx_map)->covered;
+
+    if ((rc = map_store()) < 0) {
+        close();
+        return rc;
+    }
+
+    if ( covered > map_size ) {         /* index of another store */
+        munmap(idx_map, idx_size);
+        idx_map = NULL;
+        index = NULL;
+        count = 0;
+        covered = sizeof(FTDS_HEADER_T);
+    }
+
+    /* records appended after the last commit */
+    if ((rc = scan_tail( covered )) < 0) {
+        close();
+        return rc;
+    }
+
+    if ( writable && ((rc = load_bases()) < 0) ) {
+        close();
+        return rc;
+    }
+
+    return 0;
+}
+
+void ImageStore::close( void )
+{
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    if (idx_map) {
+        munmap(idx_map, idx_size);
+        idx_map = NULL;
+    }
+    map_size = idx_size = 0;
+    index = NULL;
+    count = 0;
+    end = 0;
+    pending.clear();
+    bases.clear();
+
+    if (fd >= 0) {
+        ::close(fd);            /* releases the lock */
+        fd = -1;
+    }
+}
+
+int ImageStore::map_index( void )
+{
+    const FTDX_HEADER_T *h;
+    struct stat st;
+    int ifd;
+
+    if ((ifd = ::open((path + FTDS_INDEX_SUFFIX).c_str(), O_RDONLY)) < 0)
+        return -errno;
+
+    if ( (fstat(ifd, &st) < 0) || ((size_t)st.st_size < sizeof(FTDX_HEADER_T)) ) {
+        ::close(ifd);
+        return -EINVAL;
+    }
+
+    idx_size = st.st_size;
+    idx_map = mmap(NULL, idx_size, PROT_READ, MAP_SHARED, ifd, 0);
+    ::close(ifd);
+    if (idx_map == MAP_FAILED) {
+        idx_map = NULL;
+        return -errno;
+    }
+
+    h = static_cast<const FTDX_HEADER_T *>(idx_map);
+    if ( (memcmp(h->magic, FTDX_MAGIC, sizeof(h->magic)) != 0)
+        || (h->version != FTDS_VERSION)
+        || (h->header_size != sizeof(FTDX_HEADER_T))
+        || (sizeof(FTDX_HEADER_T) + h->count * sizeof(FTDX_ENTRY_T) > idx_size) )
+    {
+        munmap(idx_map, idx_size);
+        idx_map = NULL;
+        return -EINVAL;
+    }
+
+    index = reinterpret_cast<const FTDX_ENTRY_T *>(h + 1);
+    count = h->count;
+    return 0;
+}
+
+int ImageStore::map_store( void )
+{
+    struct stat st;
+
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+
+    if (fstat(fd, &st) < 0)
+        return -errno;
+
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* Index records from 'from' to the end. A torn record (crash in append) ends
+ * the store: a writer cuts it off.
+ */
+int ImageStore::scan_tail( uint64_t from )
+{
+    const unsigned char *base = static_cast<const unsigned char *>(map);
+    uint64_t off = from;
+
+    while (off + sizeof(FTDS_RECORD_T) <= map_size) {
+        const FTDS_RECORD_T *r = reinterpret_cast<const FTDS_RECORD_T *>(base + off);
+        FTDX_ENTRY_T e = FTDX_ENTRY_T();
+
+        if ( !record_valid(*r) || (off + record_length(*r) > map_size) )
+            break;
+
+        e.hash = r->hash;
+        e.offset = off;
+        e.size = r->size;
+        e.type = r->type;
+        pending[e.hash] = e;
+
+        off += record_length(*r);
+    }
+
+    end = off;
+
+    if ( writable && (end < map_size) && (ftruncate(fd, end) < 0) )
+        return -errno;
+
+    return 0;
+}
+
+int ImageStore::read_at( uint64_t offset, void *buf, size_t len )
+{
+    ssize_t n;
+
+    if (offset + len <= map_size) {
+        memcpy(buf, static_cast<const unsigned char *>(map) + offset, len);
+        return 0;
+    }
+
+    /* appended by this writer after the store was mapped */
+    n = pread(fd, buf, len, offset);
+    if (n < 0)
+        return -errno;
+    return ((size_t)n == len) ? 0 : -EIO;
+}
+
+const FTDX_ENTRY_T *ImageStore::find( uint64_t hash )
+{
+    FTDX_ENTRY_T key = FTDX_ENTRY_T();
+    const FTDX_ENTRY_T *e;
+    unordered_map<uint64_t, FTDX_ENTRY_T>::const_iterator it;
+
+    key.hash = hash;
+    e = lower_bound(index, index + count, key, entry_less);
+    if ( (e != index + count) && (e->hash == hash) )
+        return e;
+
+    it = pending.find(hash);
+    return (it != pending.end()) ? &it->second : NULL;
+}
+
+/* Most recent bases: candidates for the delta of a new image */
+int ImageStore::load_bases( void )
+{
+    vector<pair<uint64_t, uint16_t> > offs;
+    unordered_map<uint64_t, FTDX_ENTRY_T>::const_iterator it;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < count; i++) {
+        if (index[i].type == FTDS_TYPE_BASE)
+            offs.push_back( make_pair(index[i].offset, index[i].size) );
+    }
+    for (it = pending.begin(); it != pending.end(); it++) {
+        if (it->second.type == FTDS_TYPE_BASE)
+            offs.push_back( make_pair(it->second.offset, it->second.size) );
+    }
+
+    sort(offs.rbegin(), offs.rend());
+    if (offs.size() > FTDS_BASE_CANDIDATES)
+        offs.resize(FTDS_BASE_CANDIDATES);
+
+    for (i = 0; i < offs.size(); i++) {
+        vector<unsigned char> img( offs[i].second );
+
+        if ((rc = read_at(offs[i].first + sizeof(FTDS_RECORD_T),
+                          img.data(), img.size())) < 0)
+            return rc;
+        bases.push_back( make_pair(offs[i].first, img) );
+    }
+
+    return 0;
+}
+
+int ImageStore::append( const FTDS_RECORD_T &rec, const void *payload,
+                        size_t len, uint64_t *offset )
+{
+    unsigned char buf[sizeof(FTDS_RECORD_T) + FTDI_MAX_EEPROM_SIZE * 2];
+    size_t total = record_length(rec);
+    ssize_t n;
+
+    memset(buf, 0, total);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), payload, len);
+
+    /* one write per record: a crash leaves at most one torn record */
+    n = pwrite(fd, buf, total, end);
+    if (n < 0)
+        return -errno;
+    if ((size_t)n != total)
+        return -EIO;
+
+    *offset = end;
+    end += total;
+    return 0;
+}
+
+int ImageStore::put( const unsigned char *img, unsigned int size, uint64_t *key )
+{
+    FTDS_DELTA_T delta[FTDI_MAX_EEPROM_SIZE / 2], best[FTDI_MAX_EEPROM_SIZE / 2];
+    FTDS_RECORD_T rec = FTDS_RECORD_T();
+    FTDX_ENTRY_T e = FTDX_ENTRY_T();
+    const FTDX_ENTRY_T *found;
+    uint64_t best_base = 0, offset;
+    unsigned int nbest = size / FTDS_DELTA_RATIO / 2 + 1;   /* limit + 1 */
+    size_t i;
+    int rc;
+
+    if ( !writable )
+        return -EBADF;
+    if ( (size == 0) || (size > FTDI_MAX_EEPROM_SIZE) || (size & 1) )
+        return -EINVAL;
+
+    *key = hash(img, size);
+
+    /* same content: nothing to store (a different one is a collision) */
+    if ((found = find( *key )) != NULL) {
+        unsigned char old[FTDI_MAX_EEPROM_SIZE];
+        unsigned int old_size;
+
+        if ((rc = get( *key, old, &old_size )) < 0)
+            return rc;
+        return ((old_size == size) && (memcmp(old, img, size) == 0))
+                ? 1 : -EEXIST;
+    }
+
+    /* the base with the fewest different words */
+    for (i = 0; i < bases.size(); i++) {
+        const vector<unsigned char> &b = bases[i].second;
+        unsigned int n = 0, w;
+
+        if (b.size() != size)
+            continue;
+
+        for (w = 0; (w < size / 2) && (n < nbest); w++) {
+            if ( (b[w * 2] != img[w * 2]) || (b[w * 2 + 1] != img[w * 2 + 1]) ) {
+                delta[n].word = w;
+                delta[n].value = img[w * 2] | (img[w * 2 + 1] << 8);
+                n++;
+            }
+        }
+        if (n < nbest) {
+            nbest = n;
+            best_base = bases[i].first;
+            memcpy(best, delta, n * sizeof(FTDS_DELTA_T));
+        }
+    }
+
+    rec.size = size;
+    rec.hash = *key;
+
+    if (best_base) {
+        rec.type = FTDS_TYPE_DELTA;
+        rec.nwords = nbest;
+        rec.base = best_base;
+        rc = append(rec, best, nbest * sizeof(FTDS_DELTA_T), &offset);
+    } else {
+        rec.type = FTDS_TYPE_BASE;
+        rc = append(rec, img, size, &offset);
+        if (rc == 0) {
+            bases.push_front( make_pair(offset, vector<unsigned char>(img, img + size)) );
+            if (bases.size() > FTDS_BASE_CANDIDATES)
+                bases.pop_back();
+        }
+    }
+    if (rc < 0)
+        return rc;
+
+    e.hash = *key;
+    e.offset = offset;
+    e.size = size;
+    e.type = rec.type;
+    pending[e.hash] = e;
+
+    return 0;
+}
+
+int ImageStore::get( uint64_t key, unsigned char *img, unsigned int *size )
+{
+    FTDS_DELTA_T delta[FTDI_MAX_EEPROM_SIZE / 2];
+    FTDS_RECORD_T rec, base;
+    const FTDX_ENTRY_T *e;
+    int rc;
+
+    if ((e = find( key )) == NULL)
+        return -ENOENT;
+
+    if ((rc = read_at(e->offset, &rec, sizeof(rec))) < 0)
+        return rc;
+    if ( !record_valid(rec) || (rec.hash != key) )
+        return -EBADMSG;
+
+    if (rec.type == FTDS_TYPE_BASE) {
+        if ((rc = read_at(e->offset + sizeof(rec), img, rec.size)) < 0)
+            return rc;
+    } else {
+        if ( ((rc = read_at(rec.base, &base, sizeof(base))) < 0)
+            || ((rc = read_at(rec.base + sizeof(base), img, rec.size)) < 0)
+            || ((rc = read_at(e->offset + sizeof(rec), delta,
+                              rec.nwords * sizeof(FTDS_DELTA_T))) < 0) )
+            return (rc < 0) ? rc : -EIO;
+        if ( (base.type != FTDS_TYPE_BASE) || (base.size != rec.size) )
+            return -EBADMSG;
+
+        for (unsigned int i = 0; i < rec.nwords; i++) {
+            if (delta[i].word >= rec.size / 2)
+                return -EBADMSG;
+            img[delta[i].word * 2]     = delta[i].value & 0xFF;
+            img[delta[i].word * 2 + 1] = delta[i].value >> 8;
+        }
+    }
+
+    *size = rec.size;
+    return 0;
+}
+
+/* Records first (fdatasync), then the merged index (tmp + fsync + rename):
+ * the index never points past durable records.
+ */
+int ImageStore::commit( void )
+{
+    vector<FTDX_ENTRY_T> all;
+    unordered_map<uint64_t, FTDX_ENTRY_T>::const_iterator it;
+    FTDX_HEADER_T h;
+    string tmp = path + FTDS_INDEX_SUFFIX + ".tmp";
+    int ifd, rc = 0;
+
+    if ( !writable )
+        return -EBADF;
+    if ( pending.empty() )
+        return 0;
+
+    if (fdatasync(fd) < 0)
+        return -errno;
+
+    all.reserve(count + pending.size());
+    all.assign(index, index + count);
+    for (it = pending.begin(); it != pending.end(); it++)
+        all.push_back( it->second );
+    sort(all.begin(), all.end(), entry_less);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FTDX_MAGIC, sizeof(h.magic));
+    h.version = FTDS_VERSION;
+    h.header_size = sizeof(FTDX_HEADER_T);
+    h.count = all.size();
+    h.covered = end;
+
+    if ((ifd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -errno;
+
+    if ( (::write(ifd, &h, sizeof(h)) != sizeof(h))
+        || (::write(ifd, all.data(), all.size() * sizeof(FTDX_ENTRY_T))
+            != (ssize_t)(all.size() * sizeof(FTDX_ENTRY_T)))
+        || (fsync(ifd) < 0) )
+        rc = errno ? -errno : -EIO;
+
+    ::close(ifd);
+
+    if ( (rc == 0) && (rename(tmp.c_str(), (path + FTDS_INDEX_SUFFIX).c_str()) < 0) )
+        rc = -errno;
+    if (rc < 0) {
+        unlink(tmp.c_str());
+        return rc;
+    }
+
+    /* switch to the new index and the grown store */
+    if (idx_map) {
+        munmap(idx_map, idx_size);
+        idx_map = NULL;
+    }
+    index = NULL;
+    count = 0;
+    pending.clear();
+
+    if ( ((rc = map_index()) < 0) || ((rc = map_store()) < 0) )
+        return rc;
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+/* FNV-1a 64 over size and content */
+uint64_t ImageStore::hash( const unsigned char *img, unsigned int size )
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    h = (h ^ (size & 0xFF)) * 0x100000001b3ULL;
+    h = (h ^ (size >> 8)) * 0x100000001b3ULL;
+    for (i = 0; i < size; i++)
+        h = (h ^ img[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+string ImageStore::key_string( uint64_t key )
+{
+    ostringstream s;
+
+    s << hex << setw(FTDS_KEY_DIGITS) << setfill('0') << key;
+    return s.str();
+}
+
+int ImageStore::parse_key( string s, uint64_t *key )
+{
+    if ( s.empty() || (s.size() > FTDS_KEY_DIGITS)
+        || (s.find_first_not_of("0123456789abcdefABCDEF") != string::npos) )
+        return -EINVAL;
+
+    *key = stoull(s, nullptr, 16);
+    return 0;
+}
+
+bool ImageStore::is_store( string path )
+{
+    char magic[4];
+    int sfd;
+    bool is;
+
+    if ((sfd = ::open(path.c_str(), O_RDONLY)) < 0)
+        return false;
+
+    is = (::read(sfd, magic, sizeof(magic)) == sizeof(magic))
+        && (memcmp(magic, FTDS_MAGIC, sizeof(magic)) == 0);
+
+    ::close(sfd);
+    return is;
+}
@@ -0,0 +1,166 @@
+/*
+    Header of ImageStore class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _IMAGE_STORE_HPP_
+#define _IMAGE_STORE_HPP_
+
+#include <stdint.h>         /* uint64_t, ... */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <deque>            /* deque */
+#include <unordered_map>    /* unordered_map */
+
+
+using namespace std;
+
+
+/* Content addressed, append only store of EEPROM images (host byte order).
+ * The key of an image is the hash of its content: storing the same image
+ * twice costs nothing.
+ *
+ *  store           FTDS_HEADER_T, then records (8-byte aligned)
+ *                  base:   FTDS_RECORD_T + image
+ *                  delta:  FTDS_RECORD_T + FTDS_DELTA_T[nwords]
+ *                          (words that differ from the base record)
+ *
+ *  store.idx       FTDX_HEADER_T + FTDX_ENTRY_T[count], sorted by hash.
+ *                  Rewritten (tmp + rename) by commit(); records after
+ *                  'covered' are re-indexed when the store is opened.
+ *
+ * Reading an image: binary search in the mapped index, then the record (and
+ * its base) in the mapped store.
+ */
+#define FTDS_MAGIC              "FTDS"
+#define FTDX_MAGIC              "FTDX"
+#define FTDS_VERSION            (1)
+#define FTDS_ALIGN              (8)
+#define FTDS_INDEX_SUFFIX       ".idx"
+
+#define FTDS_TYPE_BASE          (1)
+#define FTDS_TYPE_DELTA         (2)
+
+/* a delta with more words than size / FTDS_DELTA_RATIO becomes a base */
+#define FTDS_DELTA_RATIO        (8)
+/* bases tried for a new image (most recent first) */
+#define FTDS_BASE_CANDIDATES    (64)
+
+#define FTDS_KEY_DIGITS         (16)        /* --in store.ftds#KEY (hex) */
+
+
+typedef struct FTDS_HEADER_S {
+    char        magic[4];           /* FTDS_MAGIC */
+    uint16_t    version;            /* FTDS_VERSION */
+    uint16_t    header_size;        /* sizeof(FTDS_HEADER_T) */
+    uint8_t     reserved[56];
+} FTDS_HEADER_T;
+
+typedef struct FTDS_RECORD_S {
+    uint8_t     type;               /* FTDS_TYPE_xxx */
+    uint8_t     reserved;
+    uint16_t    size;               /* bytes of the image */
+    uint16_t    nwords;             /* delta: FTDS_DELTA_T that follow */
+    uint16_t    reserved2;
+    uint64_t    hash;               /* key */
+    uint64_t    base;               /* delta: offset of the base record */
+} FTDS_RECORD_T;
+
+typedef struct FTDS_DELTA_S {
+    uint16_t    word;               /* word index */
+    uint16_t    value;
+} FTDS_DELTA_T;
+
+typedef struct FTDX_HEADER_S {
+    char        magic[4];           /* FTDX_MAGIC */
+    uint16_t    version;
+    uint16_t    header_size;
+    uint64_t    count;
+    uint64_t    covered;            /* store bytes indexed */
+    uint8_t     reserved[40];
+} FTDX_HEADER_T;
+
+typedef struct FTDX_ENTRY_S {
+    uint64_t    hash;
+    uint64_t    offset;             /* record in store */
+    uint16_t    size;
+    uint8_t     type;
+    uint8_t     reserved[5];
+} FTDX_ENTRY_T;
+
+
+class ImageStore {
+
+private:
+    int             fd;
+    bool            writable;
+    string          path;
+
+    /* read side: both mapped */
+    void            *map;
+    size_t          map_size;
+    void            *idx_map;
+    size_t          idx_size;
+    const FTDX_ENTRY_T  *index;
+    size_t          count;
+
+    /* write side */
+    uint64_t        end;            /* append offset */
+    unordered_map<uint64_t, FTDX_ENTRY_T>   pending;    /* not in index */
+    deque< pair<uint64_t, vector<unsigned char> > >  bases;
+
+    int     map_index( void );
+    int     map_store( void );
+    int     scan_tail( uint64_t from );
+    int     read_at( uint64_t offset, void *buf, size_t len );
+    const FTDX_ENTRY_T *find( uint64_t hash );
+    int     load_bases( void );
+    int     append( const FTDS_RECORD_T &rec, const void *payload, size_t len,
+                    uint64_t *offset );
+
+public:
+    /* Constructor / Destructor */
+    ImageStore();
+    ~ImageStore();
+
+    /* writable: create if missing, one writer at a time (flock) */
+    int     open( string path, bool writable );
+    void    close( void );
+
+    /* 0: stored, 1: already in store */
+    int     put( const unsigned char *img, unsigned int size, uint64_t *key );
+    int     get( uint64_t key, unsigned char *img, unsigned int *size );
+
+    /* make put() durable and visible to readers */
+    int     commit( void );
+
+    size_t  get_count()     { return count + pending.size(); }
+
+    static uint64_t hash( const unsigned char *img, unsigned int size );
+    static string   key_string( uint64_t key );
+    static int      parse_key( string s, uint64_t *key );
+
+    /* magic check, to tell a store from a pack */
+    static bool     is_store( string path );
+
+};  /* class ImageStore */
+
+#endif  /* _IMAGE_STORE_HPP_ */
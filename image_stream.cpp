@@ -0,0 +1,193 @@
+/*
+    Implementation of ImageStream class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy */
+#include <unistd.h>         /* read, write */
+#include "image_stream.hpp"
+#include "log_sink.hpp"     /* DeviceLog */
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+ImageStream::ImageStream( FILE *in, FILE *out )
+    : in_fd(fileno(in)), out_fd(fileno(out)), in_pos(0), in_len(0), out_len(0)
+{
+    /* what the FILE holds goes out before the first record */
+    fflush(out);
+}
+
+ImageStream::~ImageStream()
+{
+    flush();
+}
+
+/* ------------------------------------------------------------------ */
+
+/* Bigger buffers: one syscall per many records */
+long ImageStream::get( unsigned char *buf, size_t len )
+{
+    size_t  got = 0, n;
+    ssize_t rc;
+
+    while (got < len) {
+        if (in_pos == in_len) {
+            rc = ::read(in_fd, in_buf, sizeof(in_buf));
+            if (rc < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
+            if (rc == 0)
+                break;
+            in_pos = 0;
+            in_len = rc;
+        }
+
+        n = min(len - got, in_len - in_pos);
+        memcpy(buf + got, in_buf + in_pos, n);
+        in_pos += n;
+        got += n;
+    }
+
+    return got;
+}
+
+int ImageStream::put( const unsigned char *buf, size_t len )
+{
+    int rc;
+
+    if ( (out_len + len > sizeof(out_buf)) && ((rc = flush()) < 0) )
+        return rc;
+
+    memcpy(out_buf + out_len, buf, len);
+    out_len += len;
+    return 0;
+}
+
+int ImageStream::flush( void )
+{
+    size_t  done = 0;
+    ssize_t rc;
+
+    while (done < out_len) {
+        rc = ::write(out_fd, out_buf + done, out_len - done);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (rc == 0)
+            return -EIO;
+        done += rc;
+    }
+
+    out_len = 0;
+    return 0;
+}
+
+/* 0: got one, 1: end of stream, <0: error */
+int ImageStream::read_record( unsigned int *size )
+{
+    unsigned char len[STREAM_LEN_SIZE];
+    long n;
+
+    if ((n = get(len, sizeof(len))) < 0)
+        return n;
+    if (n == 0)
+        return 1;
+    if (n != sizeof(len))
+        return -EIO;
+
+    *size = len[0] | (len[1] << 8);
+    if ((*size == 0) || (*size > FTDI_MAX_EEPROM_SIZE) || (*size & 1))
+        return -EINVAL;
+
+    if ((n = get(image, *size)) < 0)
+        return n;
+    if (n != *size)
+        return -EIO;
+
+    return 0;
+}
+
+int ImageStream::write_record( unsigned int size )
+{
+    unsigned char len[STREAM_LEN_SIZE];
+    int rc;
+
+    len[0] = size & 0xFF;
+    len[1] = (size >> 8) & 0xFF;
+
+    if ( ((rc = put(len, sizeof(len))) < 0)
+        || ((rc = put(image, size)) < 0) )
+        return rc;
+
+    return 0;
+}
+
+long ImageStream::run( FTDIDEV *dev, Options *opt )
+{
+    unsigned int size;
+    long count = 0;
+    int rc, frc;
+
+    while ((rc = read_record( &size )) == 0) {
+
+        /* Fixed offset fields only: patched in place, no decode/encode */
+        if ( opt->isDirectPatch() ) {
+            rc = opt->getPlan().apply_image( image, size, dev->get_chip_type() );
+            if (rc < 0)
+                break;
+        } else if ( opt->isUpdate() ) {
+            if ((rc = dev->set_buffer( image, size )) < 0)
+                break;
+            if ((rc = dev->decode( 0 )) < 0)
+                break;
+            if ((rc = dev->update( opt )) < 0)
+                break;
+            if ((rc = dev->encode( 0 )) < 0)
+                break;
+            if ((rc = dev->get_buffer( image, size )) < 0)
+                break;
+        } else {
+            /* Nothing to update: pass through, no decode/encode */
+        }
+
+        if ((rc = write_record( size )) < 0)
+            break;
+
+        count++;
+    }
+
+    if ( ((frc = flush()) < 0) && (rc >= 0) )
+        rc = frc;
+
+    if (rc < 0) {
+        DeviceLog log;
+
+        log(LOGL_ERROR) << "Stream stopped at image #" << count << ": " << rc << endl;
+        return rc;
+    }
+
+    return count;
+}
@@ -0,0 +1,76 @@
+/*
+    Header of ImageStream class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _IMAGE_STREAM_HPP_
+#define _IMAGE_STREAM_HPP_
+
+#include <cstdio>           /* FILE */
+#include "Options.hpp"
+#include "ftdi_dev.hpp"
+
+
+/* Record: 2 bytes length (little endian) + image of that length
+ *
+ *  +--------+--------+------------------------+
+ *  | len lo | len hi | image[len] (len <= 256) |  ...next record
+ *  +--------+--------+------------------------+
+ *
+ * Only one record is in memory at any time. The FILEs are only flushed:
+ * records go through read(2) / write(2) on their fds, buffered here (no
+ * setvbuf on streams already used).
+ */
+#define STREAM_LEN_SIZE         (2)
+#define STREAM_IO_BUF_SIZE      (64 * 1024)
+
+
+class ImageStream {
+
+private:
+    int     in_fd;
+    int     out_fd;
+
+    unsigned char   in_buf[STREAM_IO_BUF_SIZE];
+    size_t          in_pos, in_len;
+    unsigned char   out_buf[STREAM_IO_BUF_SIZE];
+    size_t          out_len;
+
+    unsigned char   image[FTDI_MAX_EEPROM_SIZE];
+
+    long    get( unsigned char *buf, size_t len );     /* < len: end */
+    int     put( const unsigned char *buf, size_t len );
+    int     flush( void );
+
+    int     read_record( unsigned int *size );
+    int     write_record( unsigned int size );
+
+public:
+    /* Constructor / Destructor */
+    ImageStream( FILE *in, FILE *out );
+    ~ImageStream();
+
+    /* returns number of images processed, or -errno */
+    long    run( FTDIDEV *dev, Options *opt );
+
+};  /* class ImageStream */
+
+#endif  /* _IMAGE_STREAM_HPP_ */
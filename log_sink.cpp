@@ -0,0 +1,265 @@
+/*
+    Implementation of LogSink class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <iostream>         /* cout, cerr */
+#include <iomanip>          /* setw, setfill, ... */
+#include <cerrno>           /* errno */
+#include <time.h>           /* localtime_r */
+#include "log_sink.hpp"
+
+
+static atomic<LogSink *>        global_sink( NULL );
+static atomic<int>              global_level( LOGL_DEBUG );
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+LogSink::LogSink( FILE *out, enum LOG_FORMAT format )
+    : out(out), format(format), head(NULL), posted(0), written(0),
+      stopping(false)
+{
+    writer = thread( &LogSink::run, this );
+}
+
+LogSink::~LogSink()
+{
+    stopping = true;
+    {
+        lock_guard<mutex> l( wait_lock );
+        wake.notify_one();
+    }
+    writer.join();
+
+    /* posted after the writer saw 'stopping' */
+    write_list( head.exchange(NULL) );
+}
+
+/* ------------------------------------------------------------------ */
+
+LogSink *LogSink::global( void )
+{
+    return global_sink.load();
+}
+
+void LogSink::set_global( LogSink *sink )
+{
+    global_sink.store( sink );
+}
+
+const char *LogSink::level_name( enum LOG_LEVEL level )
+{
+    return level_names[level];
+}
+
+int LogSink::parse_level( string name, enum LOG_LEVEL *level )
+{
+    for (int i = LOGL_DEBUG; i <= LOGL_ERROR; i++) {
+        if (name == level_names[i]) {
+            *level = (enum LOG_LEVEL)i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+int LogSink::parse_format( string name, enum LOG_FORMAT *format )
+{
+    if (name == "human")
+        *format = LOG_FORMAT_HUMAN;
+    else if (name == "json")
+        *format = LOG_FORMAT_JSON;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+string LogSink::json_escape( const string &s )
+{
+    ostringstream o;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+
+        switch (c) {
+        case '"':   o << "\\\"";    break;
+        case '\\':  o << "\\\\";    break;
+        case '\n':  o << "\\n";     break;
+        case '\t':  o << "\\t";     break;
+        default:
+            if (c < 0x20)
+                o << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+            else
+                o << c;
+        }
+    }
+    return o.str();
+}
+
+string LogSink::format_record( const LOG_RECORD_T &r )
+{
+    long ms = chrono::duration_cast<chrono::milliseconds>(
+                    r.t.time_since_epoch()).count();
+    ostringstream o;
+
+    if (format == LOG_FORMAT_JSON) {
+        o << "{\"ts\":" << ms / 1000 << "." << setw(3) << setfill('0') << ms % 1000
+          << ",\"level\":\"" << level_name(r.level) << "\""
+          << ",\"device\":\"" << json_escape(r.device) << "\""
+          << ",\"msg\":\"" << json_escape(r.msg) << "\"}";
+    } else {
+        time_t      sec = ms / 1000;
+        struct tm   tm;
+        char        hms[16];
+
+        localtime_r( &sec, &tm );
+        strftime( hms, sizeof(hms), "%H:%M:%S", &tm );
+        o << hms << "." << setw(3) << setfill('0') << ms % 1000 << " "
+          << setw(5) << setfill(' ') << left << level_name(r.level) << " ";
+        if ( !r.device.empty() )
+            o << r.device << " ";
+        o << r.msg;
+    }
+    return o.str();
+}
+
+/* lock-free: push on the list, wake the writer if it was empty */
+void LogSink::post( enum LOG_LEVEL level, const string &device, const string &msg )
+{
+    LOG_RECORD_T *r = new LOG_RECORD_T(), *prev;
+
+    r->level  = level;
+    r->device = device;
+    r->msg    = msg;
+    r->t      = chrono::system_clock::now();
+
+    /* r may be written and freed as soon as it is on the list */
+    prev = head.load( memory_order_relaxed );
+    do {
+        r->next = prev;
+    } while ( !head.compare_exchange_weak( prev, r,
+                memory_order_release, memory_order_relaxed ) );
+    posted++;
+
+    /* not under wait_lock: a missed wakeup costs LOG_WAIT_MS at most */
+    if (prev == NULL)
+        wake.notify_one();
+}
+
+/* newest first -> oldest first, one fflush per list */
+void LogSink::write_list( LOG_RECORD_T *r )
+{
+    LOG_RECORD_T *list = NULL, *next;
+    unsigned long n = 0;
+
+    for ( ; r != NULL; r = next) {
+        next    = r->next;
+        r->next = list;
+        list    = r;
+    }
+
+    for (r = list; r != NULL; r = next) {
+        next = r->next;
+        fprintf(out, "%s\n", format_record( *r ).c_str());
+        delete r;
+        n++;
+    }
+    if (n == 0)
+        return;
+
+    fflush(out);
+    written += n;
+    {
+        lock_guard<mutex> l( wait_lock );
+        drained.notify_all();
+    }
+}
+
+void LogSink::run( void )
+{
+    while ( !stopping ) {
+        {
+            unique_lock<mutex> l( wait_lock );
+
+            wake.wait_for( l, chrono::milliseconds(LOG_WAIT_MS), [this] {
+                return stopping || (head.load() != NULL);
+            } );
+        }
+        write_list( head.exchange(NULL, memory_order_acquire) );
+    }
+}
+
+void LogSink::flush( void )
+{
+    unsigned long target = posted;
+    unique_lock<mutex> l( wait_lock );
+
+    wake.notify_one();
+    drained.wait( l, [this, target] { return written >= target; } );
+}
+
+
+/* ------------------------------------------------------------------ */
+
+LogLine::~LogLine()
+{
+    string msg;
+
+    if ( !on )
+        return;
+
+    /* '<< endl' ends a line here: not part of the message */
+    msg = buf.str();
+    if ( !msg.empty() && (msg[msg.size() - 1] == '\n') )
+        msg.erase( msg.size() - 1 );
+    log.put( level, msg );
+}
+
+enum LOG_LEVEL DeviceLog::min_level( void )
+{
+    return (enum LOG_LEVEL)global_level.load( memory_order_relaxed );
+}
+
+void DeviceLog::set_min_level( enum LOG_LEVEL level )
+{
+    global_level.store( level );
+}
+
+void DeviceLog::put( enum LOG_LEVEL level, const string &msg )
+{
+    LogSink *sink = LogSink::global();
+
+    if (level < min_level())
+        return;
+
+    /* blank lines are terminal layout, not records */
+    if (sink != NULL) {
+        if ( !msg.empty() )
+            sink->post( level, device, msg );
+    }
+    else if (level >= LOGL_WARN)
+        cerr << msg << endl;
+    else
+        cout << msg << endl;
+}
@@ -0,0 +1,171 @@
+/*
+    Header of LogSink class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _LOG_SINK_HPP_
+#define _LOG_SINK_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <sstream>          /* ostringstream */
+#include <atomic>           /* atomic */
+#include <thread>           /* thread */
+#include <mutex>            /* mutex */
+#include <condition_variable>
+#include <chrono>           /* system_clock */
+
+
+using namespace std;
+
+
+/* Log records of many devices at once, written by one thread:
+ *
+ *  device thread --post()--> lock-free queue --> writer thread --> FILE
+ *
+ * post() never takes a lock: a record is pushed on a list (CAS), the writer
+ * takes the whole list at once and writes it oldest first. A device line is
+ * built in its own buffer (DeviceLog / LogLine), so lines never mix.
+ *
+ *  human   12:00:01.234 info  1:5 Chip type: R
+ *  json    {"ts":1508932801.234,"level":"info","device":"1:5","msg":"Chip type: R"}
+ *
+ * Without a sink (no set_global), DeviceLog writes straight to cout (debug,
+ * info) / cerr (warn, error), the message only.
+ */
+#define LOG_WAIT_MS             (50)    /* writer, when a wakeup is missed */
+
+/* not LOG_INFO, ...: <syslog.h> macros */
+enum LOG_LEVEL {
+    LOGL_DEBUG,
+    LOGL_INFO,
+    LOGL_WARN,
+    LOGL_ERROR
+};
+
+enum LOG_FORMAT {
+    LOG_FORMAT_HUMAN,
+    LOG_FORMAT_JSON
+};
+
+typedef struct LOG_RECORD_S {
+    struct LOG_RECORD_S *next;
+    enum LOG_LEVEL      level;
+    string              device;
+    string              msg;
+    chrono::system_clock::time_point    t;
+} LOG_RECORD_T;
+
+
+class LogSink {
+
+private:
+    FILE                *out;
+    enum LOG_FORMAT     format;
+
+    atomic<LOG_RECORD_T *>  head;   /* newest first */
+    atomic<unsigned long>   posted;
+    atomic<unsigned long>   written;
+    atomic<bool>            stopping;
+
+    mutex               wait_lock;  /* writer side only */
+    condition_variable  wake;       /* records posted */
+    condition_variable  drained;    /* records written */
+    thread              writer;
+
+    void    run( void );
+    void    write_list( LOG_RECORD_T *r );
+
+public:
+    /* Constructor / Destructor */
+    LogSink( FILE *out, enum LOG_FORMAT format );
+    ~LogSink();                     /* every posted record written */
+
+    void    post( enum LOG_LEVEL level, const string &device, const string &msg );
+    void    flush( void );          /* wait: records posted so far written */
+
+    string  format_record( const LOG_RECORD_T &r );
+
+    static const char   *level_name( enum LOG_LEVEL level );
+    static int          parse_level( string name, enum LOG_LEVEL *level );
+    static int          parse_format( string name, enum LOG_FORMAT *format );
+    static string       json_escape( const string &s );
+
+    /* sink of every DeviceLog, NULL: cout / cerr. Not owned */
+    static LogSink      *global( void );
+    static void         set_global( LogSink *sink );
+
+};  /* class LogSink */
+
+
+class DeviceLog;
+
+/* One line: built with <<, posted when done (end of the statement) */
+class LogLine {
+
+private:
+    DeviceLog       &log;
+    enum LOG_LEVEL  level;
+    bool            on;             /* level not filtered out */
+    ostringstream   buf;
+
+public:
+    LogLine( DeviceLog &log, enum LOG_LEVEL level, bool on )
+        : log(log), level(level), on(on) {}
+    LogLine( LogLine &&l )
+        : log(l.log), level(l.level), on(l.on), buf(std::move(l.buf))
+        { l.on = false; }
+    ~LogLine();
+
+    template <class T> LogLine &operator<<( const T &v )
+            { if (on) buf << v; return *this; }
+    LogLine &operator<<( ostream &(*m)(ostream &) )    /* endl */
+            { if (on) buf << m; return *this; }
+
+};  /* class LogLine */
+
+/* Log of one device (bus:dev, vid:pid, ...; empty: not a device) */
+class DeviceLog {
+
+private:
+    string      device;
+
+public:
+    /* Constructor / Destructor */
+    DeviceLog( string device = "" ) : device(device) {}
+    ~DeviceLog() {}
+
+    void    set_device( string d )  { device = d; }
+    const string &get_device()      { return device; }
+
+    LogLine operator()( enum LOG_LEVEL level )
+            { return LogLine( *this, level, level >= min_level() ); }
+
+    void    put( enum LOG_LEVEL level, const string &msg );
+
+    /* lower levels are dropped before any formatting */
+    static enum LOG_LEVEL   min_level( void );
+    static void             set_min_level( enum LOG_LEVEL level );
+
+};  /* class DeviceLog */
+
+#endif  /* _LOG_SINK_HPP_ */
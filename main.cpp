@@ -37,9 +37,31 @@
 #include <iomanip>      // setw, setfill, ...
 #include <stdlib.h>		// atoi
 #include <unistd.h>		// getopt()
+#include <fcntl.h>          // open
+#include <sys/mman.h>       // mmap
+#include <thread>           // thread
+#include <vector>           // vector
+#include <functional>       // function
+#include <chrono>           // steady_clock
+#include <string.h>         // strerror
 //#include <ftdi.h>
 #include "Options.hpp"
 #include "ftdi_dev.hpp"
+#include "image_pack.hpp"
+#include "image_stream.hpp"
+#include "image_store.hpp"
+#include "ftdi_server.hpp"
+#include "eeprom_checksum.hpp"
+#include "fleet_scan.hpp"
+#include "image_cache.hpp"
+#include "rack_program.hpp"
+#include "fleet_capture.hpp"
+#include "port_profile.hpp"
+#include "supervisor.hpp"
+#include "dump_index.hpp"
+#include "user_data.hpp"
+#include "self_test.hpp"
+#include "log_sink.hpp"
 //#include "DebugW.hpp"		// Debug
 
 using namespace std;
@@ -48,6 +70,7 @@ using namespace std;
 Options *opt;
 FTDIDEV *ftdi_dev;
 FILE    *file;
+LogSink *log_sink;      /* --log */
 
 //Debug		*dbg;		/* Warning: should be created before List */
 
@@ -62,8 +85,409 @@ static void atexit_delete_ftdidev(void)
 //    cout << __func__ << ":" << __LINE__ << endl;
     delete ftdi_dev;
 }
+static void atexit_delete_log_sink(void)
+{
+    /* every record written */
+    LogSink::set_global( NULL );
+    delete log_sink;
+}
+
+
+/* stdin (records) -> update -> stdout (records) */
+static int stream_main(void)
+{
+    ImageStream *stream;
+    DeviceLog log;
+    long count;
+
+    try {
+        ftdi_dev = new FTDIDEV( NULL );     /* file only operation */
+    } catch (std::runtime_error &e) {
+        log(LOGL_ERROR) << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+    atexit( &atexit_delete_ftdidev );
+    if ( opt->isChipDefined() )
+        ftdi_dev->set_chip_type( opt->getChip() );
+
+    stream = new ImageStream( stdin, stdout );
+    count = stream->run( ftdi_dev, opt );
+    delete stream;
+
+    /* stdout carries the images: never info (cout without a sink) */
+    if ( opt->verboseMode() )
+        log(LOGL_WARN) << "Streamed " << max(count, 0L) << " images" << endl;
+
+    return (count < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* Below this, one thread is faster than starting more */
+#define CHECKSUM_IMAGES_PER_THREAD  (1 << 16)
+
+/* Verify (or repair) the checksum of every image of the input file, in place */
+static int checksum_main(void)
+{
+    CHECKSUM_LAYOUT_T layout;
+    enum ftdi_chip_type type = opt->isChipDefined() ? opt->getChip() : TYPE_BM;
+    unsigned int size = opt->getImageSize();
+    size_t count = opt->getInFileSize() / size;
+    bool fix = opt->isFixSum();
+    unsigned char *map;
+    vector<uint8_t> bad( fix ? 0 : count );
+    vector<size_t> nbad;
+    vector<thread> workers;
+    size_t nthreads, chunk, total = 0;
+    DeviceLog log;
+    int fd;
+
+    if (EEPROMChecksum::layout( type, size, &layout ) < 0) {
+        log(LOGL_ERROR) << "No checksum layout for chip " << FTDISession::chip_name(type)
+                        << ", image size " << size << endl;
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = open( opt->getInFname().c_str(), fix ? O_RDWR : O_RDONLY )) < 0) {
+        log(LOGL_ERROR) << "Failed to open " << opt->getInFname() << endl;
+        return EXIT_FAILURE;
+    }
+    map = (unsigned char *)mmap( NULL, count * size,
+                fix ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (map == MAP_FAILED) {
+        log(LOGL_ERROR) << "Failed to map " << opt->getInFname() << endl;
+        return EXIT_FAILURE;
+    }
+    madvise( map, count * size, MADV_SEQUENTIAL );
+
+    /* split the archive over the cores: memory bound, not CPU bound */
+    nthreads = max(1U, thread::hardware_concurrency());
+    nthreads = min(nthreads, count / CHECKSUM_IMAGES_PER_THREAD + 1);
+    chunk = (count + nthreads - 1) / nthreads;
+    nbad.resize( nthreads, 0 );
+
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t first = t * chunk;
+        size_t n = (first < count) ? min(chunk, count - first) : 0;
+
+        workers.push_back( thread( [&, t, first, n]() {
+            if (fix)
+                nbad[t] = EEPROMChecksum::repair_bulk(
+                            map + first * size, n, size, layout );
+            else
+                nbad[t] = EEPROMChecksum::verify_bulk(
+                            map + first * size, n, size, layout, bad.data() + first );
+        } ) );
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        workers[t].join();
+        total += nbad[t];
+    }
+
+    if (fix && total && (msync( map, count * size, MS_SYNC ) < 0)) {
+        log(LOGL_ERROR) << "Failed to sync " << opt->getInFname() << endl;
+        munmap( map, count * size );
+        return EXIT_FAILURE;
+    }
+    munmap( map, count * size );
+
+    /* bad images, by offset (first few) */
+    for (size_t i = 0, shown = 0; (i < bad.size()) && (shown < 10); i++) {
+        if (bad[i]) {
+            cout << "Bad checksum: image #" << i << " (offset 0x"
+                 << hex << i * size << dec << ")" << endl;
+            shown++;
+        }
+    }
+
+    cout << count << " images (" << FTDISession::chip_name(type) << ", "
+         << size << " bytes, " << EEPROMChecksum::kernel() << "): "
+         << total << (fix ? " repaired" : " bad") << endl;
+
+    return (!fix && total) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* Image by chip type: one encode per (chip type, size), any number of devices */
+/* -s bus:dev, --all (every -d vid:pid, default FTDI ids) or -d vid:pid */
+static int select_devices( function<void (int, int, int, int)> add )
+{
+    if ( opt->isBusDefined() ) {
+        add( opt->getBus(), opt->getDev(), 0, 0 );
+    } else if ( opt->isAll() ) {
+        vector< pair<int, int> > found;
+
+        if (FleetScan::find_devices( opt->getVid(), opt->getPid(), found ) < 0)
+            return -ENODEV;
+        for (size_t i = 0; i < found.size(); i++)
+            add( found[i].first, found[i].second, 0, 0 );
+    } else if ( opt->isIdDefined() ) {
+        add( 0, 0, opt->getVid(), opt->getPid() );
+    } else {
+        DeviceLog log;
+
+        log(LOGL_ERROR) << "bus:dev, vid:pid or --all is required!" << endl;
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int program_main(void)
+{
+    const vector< pair<enum ftdi_chip_type, string> > &images = opt->getImages();
+    const OPT_UPDATE_T &u = opt->getUpdate();
+    IMAGE_CACHE_UPDATE_T update;
+    ImageCache cache;
+    RackProgram rack( cache );
+    DeviceLog log;
+
+    for (size_t i = 0; i < images.size(); i++) {
+        ifstream in( images[i].second, ios::binary );
+        vector<unsigned char> buf( (istreambuf_iterator<char>(in)),
+                                   istreambuf_iterator<char>() );
+
+        if ( buf.empty()
+            || (cache.set_template( images[i].first, buf.data(), buf.size() ) < 0) ) {
+            log(LOGL_ERROR) << "Invalid image " << images[i].second << " for chip "
+                            << FTDISession::chip_name( images[i].first ) << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    update.vid = u.vid;
+    update.pid = u.pid;
+    if (u.manufacturer) update.manufacturer = u.manufacturer;
+    if (u.product)      update.product = u.product;
+    if (u.serial)       update.serial = u.serial;
+    cache.set_update( update );
+    cache.set_plan( opt->getPlan() );
+    rack.set_async( opt->isAsync() );
+    rack.set_adaptive( opt->isAdaptive() );
+    if ( opt->isSelfTest() )
+        rack.set_self_test( opt->getSelfTest() );
+
+    if (select_devices( [&rack]( int bus, int dev, int vid, int pid ) {
+            rack.add( bus, dev, vid, pid );
+        } ) < 0)
+        return EXIT_FAILURE;
+
+    return (rack.run( stdout ) != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* every selected device's EEPROM into a directory */
+static int capture_main(void)
+{
+    FleetCapture capture( opt->getCaptureDir() );
+    enum ftdi_chip_type chip = opt->isChipDefined() ? opt->getChip() : TYPE_BM;
+    DeviceLog log;
+    int rc;
+
+    if (select_devices( [&capture]( int bus, int dev, int vid, int pid ) {
+            capture.add( bus, dev, vid, pid );
+        } ) < 0)
+        return EXIT_FAILURE;
+
+    if ((rc = capture.run( stdout )) < 0) {
+        log(LOGL_ERROR) << "Failed to capture into " << opt->getCaptureDir() << ": "
+                        << strerror(-rc) << endl;
+        return EXIT_FAILURE;
+    }
+
+    /* an index of the directory follows the new dumps (--chip: as --index) */
+    if (access( (opt->getCaptureDir() + "/" + DUMPX_FILE).c_str(), F_OK ) == 0) {
+        DUMPX_STATS_T stats;
+
+        if (DumpIndex::build( opt->getCaptureDir(), chip, &stats ) < 0)
+            log(LOGL_ERROR) << "Failed to update the index of " << opt->getCaptureDir() << endl;
+    }
+    return (rc != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* user area of every selected device, changed words only */
+static int user_data_main(void)
+{
+    UserData user;
+    DeviceLog log;
+    int rc;
+
+    if ((rc = user.load( opt->getUserData() )) < 0) {
+        log(LOGL_ERROR) << "Invalid --user-data " << opt->getUserData() << ": "
+                        << strerror(-rc) << endl;
+        return EXIT_FAILURE;
+    }
+    user.set_snapshot_dir( opt->getSnapshotDir() );
+
+    if (select_devices( [&user]( int bus, int dev, int vid, int pid ) {
+            user.add( bus, dev, vid, pid );
+        } ) < 0)
+        return EXIT_FAILURE;
+
+    return (user.run( stdout ) != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Index of a dump directory: (re)build it, or look up (--find) */
+static int index_main(void)
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    enum ftdi_chip_type chip = opt->isChipDefined() ? opt->getChip() : TYPE_BM;
+    string dir = opt->getIndexDir();
+    DeviceLog log;
+    long ms;
+
+    if ( dir.empty() ) {
+        log(LOGL_ERROR) << "--find looks up the index of --index DIR" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( opt->isFind() ) {
+        DumpIndex index;
+        vector<DUMPX_IMAGE_T> found;
+
+        if ( (index.open( dir ) < 0) || (index.find( opt->getQuery(), found ) < 0) ) {
+            log(LOGL_ERROR) << "No index in " << dir << " (--index DIR builds it)" << endl;
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < found.size(); i++) {
+            const DUMPX_IMAGE_T &img = found[i];
+
+            printf("image file=%s size=%u", FTDIServer::escape(img.file).c_str(), img.size);
+            if (img.decoded)
+                printf(" serial=%s vid=0x%x pid=0x%x chip=%s product=%s",
+                    FTDIServer::escape(img.serial).c_str(), img.vid, img.pid,
+                    FTDISession::chip_name(img.chip),
+                    FTDIServer::escape(img.product).c_str());
+            else
+                printf(" decoded=0");
+            printf(" checksum=%s mtime=%lld\n", img.checksum_ok ? "ok" : "bad",
+                (long long)img.mtime);
+        }
+
+        ms = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - t0).count();
+        printf("summary matches=%zu images=%zu ms=%ld\n",
+            found.size(), index.get_count(), ms);
+        return found.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    DUMPX_STATS_T stats;
+    int rc;
+
+    if ((rc = DumpIndex::build( dir, chip, &stats )) < 0) {
+        log(LOGL_ERROR) << "Failed to index " << dir << ": " << strerror(-rc) << endl;
+        return EXIT_FAILURE;
+    }
+
+    ms = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - t0).count();
+    printf("index files=%zu decoded=%zu kept=%zu removed=%zu failed=%zu ms=%ld\n",
+        stats.files, stats.decoded, stats.kept, stats.removed, stats.failed, ms);
+    return EXIT_SUCCESS;
+}
+
+/* One device, in a worker process: the steps of main() on bus:dev.
+ * Input: EEPROM (in place) or the input image; output: EEPROM.
+ */
+static int shard_device( FTDIDEV &d, string &err )
+{
+    unsigned int size = d.get_eeprom_size();
+    bool in_eeprom = opt->getInFname().empty();
+
+    if (size == 0) {
+        err = "EEPROM size unknown";
+        return -ENODATA;
+    }
+    d.set_buffer_sizes( size, size );
+
+    if (d.read( in_eeprom, opt->getInFname(), false, opt->getInKey() ) < 0) {
+        err = "Failed to Read";
+        return -EIO;
+    }
+
+    if ( d.is_EEPROM_blank() && in_eeprom ) {
+        err = "EEPROM is blank, nothing to update";
+        return -ENODATA;
+    }
+
+    /* fixed offset fields only: no decode / encode round trip */
+    if ( opt->isUpdate() && opt->isDirectPatch() ) {
+        if (d.patch_image( opt->getPlan() ) < 0) {
+            err = "Failed to Patch";
+            return -EINVAL;
+        }
+    } else if ( opt->isUpdate() ) {
+        if (d.decode( 0 ) < 0) {
+            err = "Failed to Decode";
+            return -EINVAL;
+        }
+        if (d.update( opt ) < 0) {
+            err = "Failed to Update";
+            return -EINVAL;
+        }
+        if (d.encode( 0 ) < 0) {
+            err = "Failed to Encode";
+            return -EINVAL;
+        }
+    }
+
+    if (d.write( true, "", false ) < 0) {
+        err = "Failed to Write";
+        return -EIO;
+    }
+
+    if ( opt->isSelfTest() ) {
+        SelfTest test( opt->getSelfTest() );
+        vector<SELF_TEST_RESULT_T> res;
+
+        if ( (d.self_test( test, res ) != 0) || res.empty() ) {
+            err = "self-test: device not open";
+            for (size_t i = 0; i < res.size(); i++) {
+                if (res[i].rc < 0) {
+                    err = string("self-test ") + res[i].port + ": " + res[i].err;
+                    break;
+                }
+            }
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+/* every device (-d vid:pid, default FTDI ids) written by worker processes */
+static int supervise_main(void)
+{
+    Supervisor sup( opt->getShard(), []( int bus, int dev, string &err ) {
+        try {
+            FTDIDEV d( bus, dev, 0, 0 );
+
+            return shard_device( d, err );
+        } catch (std::runtime_error &e) {
+            err = e.what();
+            return -ENODEV;
+        }
+    } );
+    vector< pair<int, int> > found;
+    DeviceLog log;
+    int rc;
+
+    if ( opt->isOutFile() || (!opt->isOutFTDIDEV() && !opt->isUpdate()) ) {
+        log(LOGL_ERROR) << "shard: output is EEPROM (out EEPROM or update-xxx)" << endl;
+        return EXIT_FAILURE;
+    }
 
+    if (FleetScan::find_devices( opt->getVid(), opt->getPid(), found ) < 0)
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < found.size(); i++)
+        sup.add( found[i].first, found[i].second );
 
+    if ((rc = sup.run( stdout )) < 0) {
+        log(LOGL_ERROR) << "Failed to start workers: " << strerror(-rc) << endl;
+        return EXIT_FAILURE;
+    }
+    return (rc != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 
 int main(int argc, char* argv[])
@@ -75,11 +499,87 @@ int main(int argc, char* argv[])
     } catch (int e) {
         if (e != -ECANCELED) {
             cerr << "Unknown error: " << e << endl;
+            exit( EXIT_FAILURE );
         }
         /* 'help' option exit */
         exit( EXIT_SUCCESS );
     }
     atexit( &atexit_free_options );
+
+    DeviceLog::set_min_level( opt->getLogLevel() );
+    if ( opt->isLog() ) {
+        log_sink = new LogSink( stderr, opt->getLogFormat() );
+        LogSink::set_global( log_sink );
+        atexit( &atexit_delete_log_sink );
+    }
+
+    /* Streaming: stdout carries images, nothing else may be printed there */
+    if ( opt->isStream() )
+        return stream_main();
+
+    /* Daemon / client of the daemon */
+    if ( opt->isServe() ) {
+        FTDIServer server( opt->getSockPath() );
+        return (server.run() < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if ( opt->isClient() ) {
+        return (FTDIServer::client( opt->getSockPath(), stdin, stdout ) < 0)
+                ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Drift scan: all matching devices, read only */
+    if ( opt->isScan() ) {
+        FleetScan scan( opt->getVid(), opt->getPid() );
+        DeviceLog log;
+        string err;
+
+        if ( opt->isAllowDefined() && (scan.allow( opt->getAllow(), err ) < 0) ) {
+            log(LOGL_ERROR) << "Invalid --allow: " << err << endl;
+            return EXIT_FAILURE;
+        }
+        if (scan.load_golden( opt->getGolden() ) < 0)
+            return EXIT_FAILURE;
+
+        return (scan.run( stdout ) != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* USB latency of every device, one at a time */
+    if ( opt->isProfile() ) {
+        PortProfile profile( opt->getVid(), opt->getPid(), opt->getProfileReads() );
+
+        return (profile.run( stdout ) != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Dump directory index: build / look up, no device */
+    if ( opt->isIndex() || opt->isFind() )
+        return index_main();
+
+    /* Worker process per bus / per N devices */
+    if ( opt->isShard() )
+        return supervise_main();
+
+    /* User area only: no decode / encode of the configuration */
+    if ( opt->isUserData() )
+        return user_data_main();
+
+    /* Dump every selected device into a directory */
+    if ( opt->isCapture() )
+        return capture_main();
+
+    /* Image selected by the device's chip type */
+    if ( opt->isImageByChip() ) {
+        if (opt->validateOptions( 0 ) != 0)
+            return EXIT_FAILURE;
+        return program_main();
+    }
+
+    /* Checksum only: no decode, archives of any number of images */
+    if ( opt->isCheckSum() || opt->isFixSum() ) {
+        if (opt->validateOptions( 0 ) != 0)
+            return EXIT_FAILURE;
+        return checksum_main();
+    }
+
     opt->applyHiddenRules();
     opt->ShowOpts();
 
@@ -100,6 +600,11 @@ int main(int argc, char* argv[])
     }
 */
     atexit( &atexit_delete_ftdidev );
+    DeviceLog &logger = ftdi_dev->get_logger();
+
+    /* File only: the chip type is not known from the image */
+    if ( opt->isChipDefined() && !opt->isInFTDIDEV() && !opt->isOutFTDIDEV() )
+        ftdi_dev->set_chip_type( opt->getChip() );
 
     if (opt->isInFTDIDEV() || opt->isOutFTDIDEV()) {
         ftdi_dev->show_info();  /* debugging */
@@ -132,7 +637,7 @@ int main(int argc, char* argv[])
         long fSize = min(opt->getInFileSize(), (long)FTDI_MAX_EEPROM_SIZE);
         oSize = iSize = static_cast<unsigned int>(fSize);   /* Safe: value in INT scope */
     }
-    cout << "Size (I,O) = " << iSize << ", " << oSize << endl;
+    logger(LOGL_INFO) << "Size (I,O) = " << iSize << ", " << oSize << endl;
     ftdi_dev->set_buffer_sizes(iSize, oSize);
 
 
@@ -142,9 +647,10 @@ int main(int argc, char* argv[])
     if ( ftdi_dev->read(
         opt->isInFTDIDEV(),
         opt->getInFname(),
-        opt->verboseMode()) < 0 )
+        opt->verboseMode(),
+        opt->getInKey()) < 0 )
     {
-        cerr << "Failed to Read!" << endl;
+        logger(LOGL_ERROR) << "Failed to Read!" << endl;
         return EXIT_FAILURE;
     }
 
@@ -152,6 +658,38 @@ int main(int argc, char* argv[])
     /*
      * 2. DECODE (binary -> structure)
      */
+    /* Blank EEPROM: nothing in it to decode or update */
+    if ( ftdi_dev->is_EEPROM_blank() && opt->isInFTDIDEV() ) {
+        if ( opt->isOutputDefined() && opt->isUpdate() ) {
+            logger(LOGL_ERROR) << "EEPROM is blank, nothing to update. Input an image!" << endl;
+            return EXIT_FAILURE;
+        }
+        goto skip_update;
+    }
+
+    /* Blank target, image written as is: no DECODE either.
+     * FTDIDEV( opt ) probed the target when it opened it (output EEPROM)
+     */
+    if ( opt->isOutFTDIDEV() && ftdi_dev->is_EEPROM_blank()
+        && !opt->isUpdate() && !opt->verboseMode() ) {
+        logger(LOGL_DEBUG) << "EEPROM is blank, image written as is" << endl;
+        goto skip_update;
+    }
+
+    /* Fixed offset fields only: patch binary, no DECODE / ENCODE round trip.
+     * Decoded afterwards for verbose output only (shows the patched values)
+     */
+    if ( opt->isOutputDefined() && opt->isUpdate() && opt->isDirectPatch() ) {
+        if ( ftdi_dev->patch_image( opt->getPlan() ) < 0 ) {
+            logger(LOGL_ERROR) << "Something is wrong in PATCHING. No output!" << endl;
+            opt->setOutNULL();
+            rc = EXIT_FAILURE;
+        } else if ( opt->verboseMode() ) {
+            ftdi_dev->decode( opt->verboseMode() );
+        }
+        goto skip_update;
+    }
+
     ftdi_dev->decode( opt->verboseMode() );
 
 
@@ -164,22 +702,13 @@ int main(int argc, char* argv[])
     if ( !opt->isOutputDefined() || !opt->isUpdate() )
         goto skip_update;
 
-    if ( opt->isUpdate_vid() )  ftdi_dev->update_vid( opt->getUpdate_vid() );
-    if ( opt->isUpdate_pid() )  ftdi_dev->update_pid( opt->getUpdate_pid() );
-#if 0
-    if ( opt->isUpdate_manufacturer() )
-        eeprom->update_manufacturer( opt->getUpdate_manufacturer() );
-    if ( opt->isUpdate_product() )
-        eeprom->update_product( opt->getUpdate_product() );
-    if ( opt->isUpdate_serial() )
-        eeprom->update_serial( opt->getUpdate_serial() );
-#else
-    ftdi_dev->update_strings(
-        opt->getUpdate_manufacturer(),
-        opt->getUpdate_product(),
-        opt->getUpdate_serial()
-    );
-#endif
+    /* a rejected field (--set) leaves a half-applied plan: no output */
+    if ( ftdi_dev->update( opt ) < 0 ) {
+        logger(LOGL_ERROR) << "Something is wrong in UPDATING. No output!" << endl;
+        opt->setOutNULL();
+        rc = EXIT_FAILURE;
+        goto skip_update;
+    }
 
 
     /*
@@ -188,12 +717,12 @@ int main(int argc, char* argv[])
     /* if things go wrong, don't write out. But still like to show information */
     try {
         if ( ftdi_dev->encode( opt->verboseMode() ) < 0 ) {
-            cerr << "Something is wrong in ENCODING. No output!" << endl;
+            logger(LOGL_ERROR) << "Something is wrong in ENCODING. No output!" << endl;
             opt->setOutNULL();
             rc = EXIT_FAILURE;
         }
     } catch (int e) {
-        cout << "Something is wrong (" << e << "). No output!" << endl;
+        logger(LOGL_INFO) << "Something is wrong (" << e << "). No output!" << endl;
         opt->setOutNULL();
         rc = EXIT_FAILURE;
     }
@@ -209,18 +738,83 @@ skip_update:
     /*
      * 5. OUTPUT: Write to EEPROM or File
      */
-    /* Need to check isOutputDefined() here, as the _input only_ case
+    /* Need to check output here, as the _input only_ case
      * also comes here.
      */
-    if ( opt->isOutputDefined() ) {
+    if ( opt->isOutFTDIDEV() || opt->isOutFile() ) {
         if ( ftdi_dev->write(
             opt->isOutFTDIDEV(),
             opt->getOutFname(),
             opt->verboseMode()) < 0 )
         {
-            cerr << "Failed to Write!" << endl;
+            logger(LOGL_ERROR) << "Failed to Write!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    /*
+     * 6. SELF-TEST: the board just written, device still open
+     */
+    if ( opt->isSelfTest() ) {
+        SelfTest test( opt->getSelfTest() );
+        vector<SELF_TEST_RESULT_T> res;
+
+        if ( ftdi_dev->self_test( test, res ) != 0 )
+            rc = EXIT_FAILURE;
+        if ( res.empty() )
+            logger(LOGL_ERROR) << "Failed to self-test!" << endl;
+        for (size_t i = 0; i < res.size(); i++) {
+            LogLine line = logger( (res[i].rc < 0) ? LOGL_ERROR : LOGL_INFO );
+
+            line << "Self-test " << res[i].port << ": "
+                 << ((res[i].rc < 0) ? "FAIL" : "pass")
+                 << " (" << res[i].ms << " ms)";
+            if (res[i].rc < 0)
+                line << " " << res[i].err;
+        }
+    }
+
+    /*
+     * 7. PACK: the output image is the template of every image in pack
+     */
+    if ( opt->isBuildPack() ) {
+        unsigned char tmpl[FTDI_MAX_EEPROM_SIZE];
+        string err = "no template image";
+
+        if ( (ftdi_dev->get_buffer( tmpl, oSize ) < 0)
+            || (ImagePack::build(
+                    opt->getPackFname(), ftdi_dev->get_chip_type(), tmpl, oSize,
+                    opt->getPackPrefix(), opt->getPackFirst(),
+                    opt->getPackCount(), opt->getPackWidth(), 0, err) < 0) )
+        {
+            logger(LOGL_ERROR) << "Failed to build pack: " << err << endl;
+            return EXIT_FAILURE;
+        }
+        logger(LOGL_INFO) << "Pack " << opt->getPackFname() << ": "
+             << opt->getPackCount() << " images" << endl;
+    }
+
+
+    /*
+     * 8. ARCHIVE: the output image, stored by content
+     */
+    if ( opt->isArchive() ) {
+        unsigned char img[FTDI_MAX_EEPROM_SIZE];
+        ImageStore store;
+        uint64_t key;
+        int put;
+
+        if ( (ftdi_dev->get_buffer( img, oSize ) < 0)
+            || (store.open( opt->getStoreFname(), true ) < 0)
+            || ((put = store.put( img, oSize, &key )) < 0)
+            || (store.commit() < 0) )
+        {
+            logger(LOGL_ERROR) << "Failed to archive!" << endl;
             return EXIT_FAILURE;
         }
+        logger(LOGL_INFO) << "Archived " << opt->getStoreFname() << PACK_KEY_SEPARATOR
+             << ImageStore::key_string( key )
+             << (put ? " (already stored)" : "") << endl;
     }
 
 
@@ -0,0 +1,302 @@
+/*
+    Implementation of PatchPlan class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include <algorithm>        /* transform, replace */
+#include <map>              /* map */
+#include <string.h>         /* strcmp */
+#include "ftdi_session.hpp"
+#include "eeprom_checksum.hpp"
+#include "patch_plan.hpp"
+
+
+#define NOT_DIRECT      -1, 0, 0, 1
+#define BOOL            0, 1
+#define BYTE            0, 0xFF
+#define WORD            0, 0xFFFF
+
+
+/* Every ftdi_eeprom_value of libftdi 1.4 (CHIP_SIZE is read only).
+ *
+ * Direct fields, same place on every chip type (see ftdi_eeprom_build):
+ *  0x02    idVendor
+ *  0x04    idProduct
+ *  0x06    bcdDevice (release number)
+ *  0x08    bit 6: self powered, bit 5: remote wakeup
+ *  0x09    max power, 2 mA units
+ */
+static const PATCH_FIELD_T patch_fields[] = {
+    { "VENDOR_ID",          VENDOR_ID,          WORD,   0x02, 0xFFFF, 0, 1 },
+    { "PRODUCT_ID",         PRODUCT_ID,         WORD,   0x04, 0xFFFF, 0, 1 },
+    { "SELF_POWERED",       SELF_POWERED,       BOOL,   0x08, 0x0040, 6, 1 },
+    { "REMOTE_WAKEUP",      REMOTE_WAKEUP,      BOOL,   0x08, 0x0020, 5, 1 },
+    { "IS_NOT_PNP",         IS_NOT_PNP,         BOOL,   NOT_DIRECT },
+    { "SUSPEND_DBUS7",      SUSPEND_DBUS7,      BOOL,   NOT_DIRECT },
+    { "IN_IS_ISOCHRONOUS",  IN_IS_ISOCHRONOUS,  BOOL,   NOT_DIRECT },
+    { "OUT_IS_ISOCHRONOUS", OUT_IS_ISOCHRONOUS, BOOL,   NOT_DIRECT },
+    { "SUSPEND_PULL_DOWNS", SUSPEND_PULL_DOWNS, BOOL,   NOT_DIRECT },
+    { "USE_SERIAL",         USE_SERIAL,         BOOL,   NOT_DIRECT },
+    { "USB_VERSION",        USB_VERSION,        WORD,   NOT_DIRECT },
+    { "USE_USB_VERSION",    USE_USB_VERSION,    BOOL,   NOT_DIRECT },
+    { "MAX_POWER",          MAX_POWER,          0, 500, 0x08, 0xFF00, 8, 2 },
+    { "CHANNEL_A_TYPE",     CHANNEL_A_TYPE,     BYTE,   NOT_DIRECT },
+    { "CHANNEL_B_TYPE",     CHANNEL_B_TYPE,     BYTE,   NOT_DIRECT },
+    { "CHANNEL_A_DRIVER",   CHANNEL_A_DRIVER,   BYTE,   NOT_DIRECT },
+    { "CHANNEL_B_DRIVER",   CHANNEL_B_DRIVER,   BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_0",    CBUS_FUNCTION_0,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_1",    CBUS_FUNCTION_1,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_2",    CBUS_FUNCTION_2,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_3",    CBUS_FUNCTION_3,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_4",    CBUS_FUNCTION_4,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_5",    CBUS_FUNCTION_5,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_6",    CBUS_FUNCTION_6,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_7",    CBUS_FUNCTION_7,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_8",    CBUS_FUNCTION_8,    BYTE,   NOT_DIRECT },
+    { "CBUS_FUNCTION_9",    CBUS_FUNCTION_9,    BYTE,   NOT_DIRECT },
+    { "HIGH_CURRENT",       HIGH_CURRENT,       BYTE,   NOT_DIRECT },
+    { "HIGH_CURRENT_A",     HIGH_CURRENT_A,     BYTE,   NOT_DIRECT },
+    { "HIGH_CURRENT_B",     HIGH_CURRENT_B,     BYTE,   NOT_DIRECT },
+    { "INVERT",             INVERT,             BYTE,   NOT_DIRECT },
+    { "GROUP0_DRIVE",       GROUP0_DRIVE,       0, 3,   NOT_DIRECT },
+    { "GROUP0_SCHMITT",     GROUP0_SCHMITT,     BYTE,   NOT_DIRECT },
+    { "GROUP0_SLEW",        GROUP0_SLEW,        BYTE,   NOT_DIRECT },
+    { "GROUP1_DRIVE",       GROUP1_DRIVE,       0, 3,   NOT_DIRECT },
+    { "GROUP1_SCHMITT",     GROUP1_SCHMITT,     BYTE,   NOT_DIRECT },
+    { "GROUP1_SLEW",        GROUP1_SLEW,        BYTE,   NOT_DIRECT },
+    { "GROUP2_DRIVE",       GROUP2_DRIVE,       0, 3,   NOT_DIRECT },
+    { "GROUP2_SCHMITT",     GROUP2_SCHMITT,     BYTE,   NOT_DIRECT },
+    { "GROUP2_SLEW",        GROUP2_SLEW,        BYTE,   NOT_DIRECT },
+    { "GROUP3_DRIVE",       GROUP3_DRIVE,       0, 3,   NOT_DIRECT },
+    { "GROUP3_SCHMITT",     GROUP3_SCHMITT,     BYTE,   NOT_DIRECT },
+    { "GROUP3_SLEW",        GROUP3_SLEW,        BYTE,   NOT_DIRECT },
+    { "CHIP_TYPE",          CHIP_TYPE,          BYTE,   NOT_DIRECT },
+    { "POWER_SAVE",         POWER_SAVE,         BOOL,   NOT_DIRECT },
+    { "CLOCK_POLARITY",     CLOCK_POLARITY,     BOOL,   NOT_DIRECT },
+    { "DATA_ORDER",         DATA_ORDER,         BOOL,   NOT_DIRECT },
+    { "FLOW_CONTROL",       FLOW_CONTROL,       BOOL,   NOT_DIRECT },
+    { "CHANNEL_C_DRIVER",   CHANNEL_C_DRIVER,   BYTE,   NOT_DIRECT },
+    { "CHANNEL_D_DRIVER",   CHANNEL_D_DRIVER,   BYTE,   NOT_DIRECT },
+    { "CHANNEL_A_RS485",    CHANNEL_A_RS485,    BOOL,   NOT_DIRECT },
+    { "CHANNEL_B_RS485",    CHANNEL_B_RS485,    BOOL,   NOT_DIRECT },
+    { "CHANNEL_C_RS485",    CHANNEL_C_RS485,    BOOL,   NOT_DIRECT },
+    { "CHANNEL_D_RS485",    CHANNEL_D_RS485,    BOOL,   NOT_DIRECT },
+    { "RELEASE_NUMBER",     RELEASE_NUMBER,     WORD,   0x06, 0xFFFF, 0, 1 },
+    { "EXTERNAL_OSCILLATOR",EXTERNAL_OSCILLATOR,BOOL,   NOT_DIRECT },
+    { "USER_DATA_ADDR",     USER_DATA_ADDR,     BYTE,   NOT_DIRECT },
+};
+
+/* the commented out long options of Options.hpp, and the short ones */
+static const struct {
+    const char  *alias;
+    const char  *name;
+} patch_aliases[] = {
+    { "VID",            "VENDOR_ID" },
+    { "PID",            "PRODUCT_ID" },
+    { "MAX_BUS_POWER",  "MAX_POWER" },
+    { "BCD_DEVICE",     "RELEASE_NUMBER" },
+};
+
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+PatchPlan::PatchPlan()
+    : direct(true)
+{
+}
+
+/* ------------------------------------------------------------------ */
+
+/* "max-bus-power", "Max_Power" -> "MAX_POWER" */
+const PATCH_FIELD_T *PatchPlan::find_field( string name )
+{
+    size_t i;
+
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+    replace(name.begin(), name.end(), '-', '_');
+
+    for (i = 0; i < ARRAY_SIZE(patch_aliases); i++) {
+        if (name == patch_aliases[i].alias) {
+            name = patch_aliases[i].name;
+            break;
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(patch_fields); i++) {
+        if (name == patch_fields[i].name)
+            return &patch_fields[i];
+    }
+
+    return NULL;
+}
+
+const PATCH_FIELD_T *PatchPlan::field_at( size_t i )
+{
+    return (i < ARRAY_SIZE(patch_fields)) ? &patch_fields[i] : NULL;
+}
+
+string PatchPlan::field_names( void )
+{
+    string names;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(patch_fields); i++) {
+        string n( patch_fields[i].name );
+
+        transform(n.begin(), n.end(), n.begin(), ::tolower);
+        replace(n.begin(), n.end(), '_', '-');
+        names += (i ? " " : "") + n;
+    }
+
+    return names;
+}
+
+int PatchPlan::add( string spec, string &err )
+{
+    const PATCH_FIELD_T *field;
+    string  name, val;
+    size_t  pos, i;
+    int     value;
+
+    if ( ((pos = spec.find('=')) == string::npos) || (pos == 0) ) {
+        err = "expect FIELD=VALUE: " + spec;
+        return -EINVAL;
+    }
+    name = spec.substr(0, pos);
+    val  = spec.substr(pos + 1);
+
+    if ((field = find_field( name )) == NULL) {
+        err = "unknown field: " + name;
+        return -EINVAL;
+    }
+
+    /* numbers in any base, or on/off for flags */
+    if (val == "on" || val == "yes" || val == "true") {
+        value = 1;
+    } else if (val == "off" || val == "no" || val == "false") {
+        value = 0;
+    } else {
+        try {
+            size_t used;
+
+            value = stoi( val, &used, 0 );
+            if (used != val.size())
+                throw invalid_argument( val );
+        } catch (std::exception &e) {
+            err = "bad value for " + name + ": " + val;
+            return -EINVAL;
+        }
+    }
+
+    if ( (value < field->min) || (value > field->max) ) {
+        err = "value of " + name + " out of range: " + val;
+        return -ERANGE;
+    }
+
+    /* later setting of a field wins */
+    for (i = 0; i < entries.size(); i++) {
+        if (entries[i].field == field) {
+            entries[i].value = value;
+            break;
+        }
+    }
+    if (i == entries.size()) {
+        PATCH_ENTRY_T e = { field, value };
+        entries.push_back( e );
+    }
+
+    compile();
+    return 0;
+}
+
+/* Merge direct entries into one (keep, bits) pair per word */
+void PatchPlan::compile( void )
+{
+    map<unsigned int, PATCH_WORD_T> merged;
+    map<unsigned int, PATCH_WORD_T>::iterator it;
+    size_t i;
+
+    direct = true;
+    words.clear();
+
+    for (i = 0; i < entries.size(); i++) {
+        const PATCH_FIELD_T *f = entries[i].field;
+        uint16_t bits;
+
+        if (f->offset < 0) {
+            direct = false;
+            continue;
+        }
+
+        if (merged.count(f->offset / 2) == 0) {
+            PATCH_WORD_T w = { (unsigned int)f->offset / 2, 0xFFFF, 0 };
+            merged[f->offset / 2] = w;
+        }
+
+        bits = ((entries[i].value / f->scale) << f->shift) & f->mask;
+        merged[f->offset / 2].keep &= ~f->mask;
+        merged[f->offset / 2].bits = (merged[f->offset / 2].bits & ~f->mask) | bits;
+    }
+
+    for (it = merged.begin(); it != merged.end(); it++)
+        words.push_back( it->second );
+}
+
+int PatchPlan::apply( FTDISession &session )
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < entries.size(); i++) {
+        rc = session.set_value( entries[i].field->value_name, entries[i].value );
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+int PatchPlan::apply_image( unsigned char *buf, unsigned int size,
+                            enum ftdi_chip_type type )
+{
+    CHECKSUM_LAYOUT_T layout;
+    size_t i;
+
+    if ( !is_direct() )
+        return -EOPNOTSUPP;
+    if ( EEPROMChecksum::layout( type, size, &layout ) < 0 )
+        return -EINVAL;
+
+    for (i = 0; i < words.size(); i++) {
+        unsigned char *p = buf + words[i].word * 2;
+        uint16_t w = p[0] | (p[1] << 8);
+
+        w = (w & words[i].keep) | words[i].bits;
+        p[0] = w & 0xFF;
+        p[1] = w >> 8;
+    }
+
+    EEPROMChecksum::fix( buf, layout );
+
+    return 0;
+}
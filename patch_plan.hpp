@@ -0,0 +1,102 @@
+/*
+    Header of PatchPlan class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _PATCH_PLAN_HPP_
+#define _PATCH_PLAN_HPP_
+
+#include <stdint.h>         /* uint16_t */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <ftdi.h>
+
+
+using namespace std;
+
+
+class FTDISession;
+
+
+/* One settable ftdi_eeprom_value.
+ * Fields at the same word offset on every chip type are 'direct': they are
+ * patched into the binary image, no decode/build round trip.
+ */
+typedef struct PATCH_FIELD_S {
+    const char              *name;      /* enum name, e.g. "MAX_POWER" */
+    enum ftdi_eeprom_value  value_name;
+    int                     min, max;   /* accepted values */
+
+    int                     offset;     /* byte offset of the word, -1: not direct */
+    uint16_t                mask;       /* bits of the word (little endian) */
+    int                     shift;
+    int                     scale;      /* stored = value / scale */
+} PATCH_FIELD_T;
+
+typedef struct PATCH_ENTRY_S {
+    const PATCH_FIELD_T     *field;
+    int                     value;
+} PATCH_ENTRY_T;
+
+/* compiled direct patch: word = (word & keep) | bits */
+typedef struct PATCH_WORD_S {
+    unsigned int            word;       /* word index */
+    uint16_t                keep;
+    uint16_t                bits;
+} PATCH_WORD_T;
+
+
+class PatchPlan {
+
+private:
+    vector<PATCH_ENTRY_T>   entries;    /* in order, one per field */
+    vector<PATCH_WORD_T>    words;      /* merged direct patches */
+    bool                    direct;     /* every entry is direct */
+
+    void    compile( void );
+
+public:
+    /* Constructor / Destructor */
+    PatchPlan();
+    ~PatchPlan() {}
+
+    /* "FIELD=VALUE": parse & validate, later setting of a field wins */
+    int     add( string spec, string &err );
+
+    bool    empty()         { return entries.empty(); }
+    bool    is_direct()     { return direct && !entries.empty(); }
+    size_t  size()          { return entries.size(); }
+    const PATCH_ENTRY_T &entry( size_t i )  { return entries[i]; }
+
+    /* decoded structure (any field), caller encodes afterwards */
+    int     apply( FTDISession &session );
+
+    /* binary image (direct plans only), checksum is updated */
+    int     apply_image( unsigned char *buf, unsigned int size,
+                         enum ftdi_chip_type type );
+
+    static const PATCH_FIELD_T  *find_field( string name );
+    static const PATCH_FIELD_T  *field_at( size_t i );     /* NULL: end */
+    static string               field_names( void );
+
+};  /* class PatchPlan */
+
+#endif  /* _PATCH_PLAN_HPP_ */
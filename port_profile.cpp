@@ -0,0 +1,200 @@
+/*
+    Implementation of PortProfile class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream */
+#include <algorithm>        /* sort */
+#include <map>              /* map */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include "port_profile.hpp"
+#include "fleet_scan.hpp"   /* find_devices */
+#include "ftdi_server.hpp"  /* escape */
+
+
+typedef struct PROFILE_HUB_S {
+    string          path;
+    int             ports;
+    vector<long>    us;             /* every read of every port */
+    string          slowest;
+    long            slowest_p50;
+    long            p50, p99;
+} PROFILE_HUB_T;
+
+
+/* ------------------------------------------------------------------ */
+
+long PortProfile::percentile( vector<long> &v, double p )
+{
+    size_t i;
+
+    if (v.empty())
+        return 0;
+
+    sort(v.begin(), v.end());
+    i = (size_t)(p * (v.size() - 1) + 0.5);
+    return v[min(i, v.size() - 1)];
+}
+
+/* open as FTDIDEV does, then 'reads' single word reads, each timed */
+void PortProfile::profile_one( PROFILE_PORT_T &p )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    FTDISession     ses;
+    unsigned short  word;
+    size_t          pos;
+    int             i;
+
+    if ((p.rc = ses.open(p.bus, p.dev, 0, 0)) < 0) {
+        p.err = ses.error();
+        return;
+    }
+    p.open_ms = chrono::duration_cast<chrono::milliseconds>(
+                    chrono::steady_clock::now() - t0).count();
+
+    if (ses.port_path( p.path ) < 0)
+        p.path = to_string(p.bus) + "-?";
+    pos = p.path.find_last_of(".-");
+    p.hub = (pos == string::npos) ? p.path : p.path.substr(0, pos);
+
+    for (i = 0; i < reads; i++) {
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+
+        if (ses.read_word( i % PROFILE_WORDS, &word ) < 0) {
+            p.errors++;
+            continue;
+        }
+        p.us.push_back( chrono::duration_cast<chrono::microseconds>(
+                            chrono::steady_clock::now() - t).count() );
+    }
+    ses.close();
+
+    if (p.us.empty()) {
+        p.rc  = -EIO;
+        p.err = "every read failed";
+        return;
+    }
+
+    p.p50 = percentile( p.us, 0.50 );
+    p.p90 = percentile( p.us, 0.90 );
+    p.p99 = percentile( p.us, 0.99 );
+    p.max = p.us.back();
+}
+
+int PortProfile::run( FILE *out )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    vector<PROFILE_PORT_T>  ports;
+    vector< pair<int, int> > found;
+    map<string, PROFILE_HUB_T>  hubs;
+    vector<PROFILE_HUB_T *>     hub_rank;
+    vector<long>    all;
+    long            fleet_p50;
+    size_t          i;
+    int             nslow = 0, nerr = 0, rank, rc;
+
+    if ((rc = FleetScan::find_devices( vid, pid, found )) < 0)
+        return rc;
+
+    /* one port at a time: nothing else on the bus */
+    for (i = 0; i < found.size(); i++) {
+        PROFILE_PORT_T p = PROFILE_PORT_T();
+
+        p.bus = found[i].first;
+        p.dev = found[i].second;
+        profile_one( p );
+        ports.push_back( p );
+    }
+
+    for (i = 0; i < ports.size(); i++) {
+        PROFILE_PORT_T &p = ports[i];
+
+        if (p.rc < 0)
+            continue;
+
+        PROFILE_HUB_T &h = hubs[p.hub];
+        all.insert( all.end(), p.us.begin(), p.us.end() );
+
+        h.path = p.hub;
+        h.ports++;
+        h.us.insert( h.us.end(), p.us.begin(), p.us.end() );
+        if ( h.slowest.empty() || (p.p50 > h.slowest_p50) ) {
+            h.slowest     = p.path;
+            h.slowest_p50 = p.p50;
+        }
+    }
+    fleet_p50 = percentile( all, 0.50 );
+
+    /* slowest first, failed ports last */
+    sort(ports.begin(), ports.end(),
+        []( const PROFILE_PORT_T &a, const PROFILE_PORT_T &b ) {
+            if ((a.rc < 0) != (b.rc < 0))
+                return b.rc < 0;
+            return a.p50 > b.p50;
+        });
+
+    for (i = 0, rank = 1; i < ports.size(); i++) {
+        PROFILE_PORT_T &p = ports[i];
+        ostringstream line;
+
+        line << "port path=" << (p.path.empty() ? "?" : p.path)
+             << " bus=" << p.bus << " dev=" << p.dev;
+        if (p.rc < 0) {
+            line << " status=error error=" << FTDIServer::escape(p.err);
+            nerr++;
+        } else {
+            p.slow = (p.p50 >= PROFILE_SLOW_FACTOR * fleet_p50) && (ports.size() > 1);
+            nslow += p.slow;
+            line << " status=" << (p.slow ? "slow" : "ok")
+                 << " rank=" << rank++
+                 << " reads=" << p.us.size() + p.errors
+                 << " open_ms=" << p.open_ms
+                 << " p50_us=" << p.p50 << " p90_us=" << p.p90
+                 << " p99_us=" << p.p99 << " max_us=" << p.max
+                 << " errors=" << p.errors;
+        }
+        fprintf(out, "%s\n", line.str().c_str());
+    }
+
+    for (map<string, PROFILE_HUB_T>::iterator h = hubs.begin(); h != hubs.end(); ++h) {
+        h->second.p50 = percentile( h->second.us, 0.50 );
+        h->second.p99 = percentile( h->second.us, 0.99 );
+        hub_rank.push_back( &h->second );
+    }
+    sort(hub_rank.begin(), hub_rank.end(),
+        []( const PROFILE_HUB_T *a, const PROFILE_HUB_T *b ) {
+            return a->p50 > b->p50;
+        });
+
+    for (i = 0; i < hub_rank.size(); i++) {
+        fprintf(out, "hub path=%s ports=%d rank=%zu p50_us=%ld p99_us=%ld slowest=%s\n",
+            hub_rank[i]->path.c_str(), hub_rank[i]->ports, i + 1,
+            hub_rank[i]->p50, hub_rank[i]->p99, hub_rank[i]->slowest.c_str());
+    }
+
+    fprintf(out, "summary ports=%zu hubs=%zu slow=%d error=%d p50_us=%ld ms=%ld\n",
+        ports.size(), hub_rank.size(), nslow, nerr, fleet_p50,
+        (long)chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - t0).count());
+    fflush(out);
+
+    return nslow + nerr;
+}
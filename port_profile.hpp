@@ -0,0 +1,92 @@
+/*
+    Header of PortProfile class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _PORT_PROFILE_HPP_
+#define _PORT_PROFILE_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include "ftdi_session.hpp"
+
+
+using namespace std;
+
+
+/* USB latency of every fixture port: each device matching vid:pid is opened
+ * (as for programming) and read word by word, one device at a time so that
+ * ports do not share the bus while measured. Ports, then hubs (port path
+ * less its last port), slowest first:
+ *
+ *  port path=1-2.3 bus=1 dev=5 status=slow rank=1 reads=64 open_ms=14 p50_us=1010 p90_us=1100 p99_us=1300 max_us=1400 errors=0
+ *  port path=1-1.1 bus=1 dev=2 status=ok rank=2 reads=64 open_ms=3 p50_us=250 p90_us=262 p99_us=290 max_us=301 errors=0
+ *  hub path=1-2 ports=1 rank=1 p50_us=1010 p99_us=1300 slowest=1-2.3
+ *  hub path=1-1 ports=1 rank=2 p50_us=250 p99_us=290 slowest=1-1.1
+ *  summary ports=2 hubs=2 slow=1 error=0 p50_us=630 ms=120
+ *
+ * A port is slow when its p50 is PROFILE_SLOW_FACTOR times the p50 of all
+ * ports (the summary p50) or more.
+ */
+#define PROFILE_DEFAULT_READS   (64)
+#define PROFILE_MAX_READS       (100000)
+#define PROFILE_WORDS           (64)    /* addresses read: 0 .. 63, again */
+#define PROFILE_SLOW_FACTOR     (2)
+
+typedef struct PROFILE_PORT_S {
+    int             bus, dev;
+    string          path;           /* "1-2.3" */
+    string          hub;            /* "1-2" */
+
+    int             rc;
+    string          err;
+    long            open_ms;
+    vector<long>    us;             /* one per word read */
+    int             errors;         /* failed reads */
+    long            p50, p90, p99, max;
+    bool            slow;
+} PROFILE_PORT_T;
+
+
+class PortProfile {
+
+private:
+    int             vid, pid;       /* 0: libftdi default FTDI ids */
+    int             reads;          /* per port */
+
+    void    profile_one( PROFILE_PORT_T &p );
+
+public:
+    /* Constructor / Destructor */
+    PortProfile( int vid, int pid, int reads )
+        : vid(vid), pid(pid), reads(reads) {}
+    ~PortProfile() {}
+
+    /* returns number of slow or failed ports, -errno on failure */
+    int     run( FILE *out );
+
+    /* sorted in place; p in [0, 1] */
+    static long percentile( vector<long> &v, double p );
+
+};  /* class PortProfile */
+
+#endif  /* _PORT_PROFILE_HPP_ */
@@ -0,0 +1,247 @@
+/*
+    Implementation of RackProgram class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <sstream>          /* ostringstream */
+#include <iomanip>          /* setprecision */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include "rack_program.hpp"
+#include "ftdi_server.hpp"  /* escape */
+#include "log_sink.hpp"     /* DeviceLog */
+
+
+/* ------------------------------------------------------------------ */
+
+/* No decode / encode here: the chip type and size pick an encoded image,
+ * loaded into the session (read or probed) to be written.
+ * A blank EEPROM is not read at all: its size comes from the chip type.
+ */
+int RackProgram::prepare( RACK_DEVICE_T &d, FTDISession &ses )
+{
+    unsigned char   img[FTDI_MAX_EEPROM_SIZE];
+    int rc;
+
+    d.type  = ses.context()->type;
+    d.size  = ses.get_size();
+    d.blank = ses.is_blank();
+    if (d.size <= 0) {
+        d.err = "EEPROM size unknown";
+        return -ENODATA;
+    }
+
+    if ((rc = cache.get(d.type, d.size, img, d.err)) < 0)
+        return rc;
+
+    if ((rc = ses.load(img, d.size)) < 0) {
+        d.err = ses.error();
+        return rc;
+    }
+
+    return 0;
+}
+
+/* on the written device, before close: no reopen */
+void RackProgram::self_test( RACK_DEVICE_T &d, FTDISession &ses )
+{
+    SelfTest    t( test );
+    vector<SELF_TEST_RESULT_T>  res;
+    int rc;
+
+    rc = t.run( ses, res );
+    d.tested = true;
+    if (rc < 0) {
+        d.rc  = rc;
+        d.err = "self-test: device not open";
+        return;
+    }
+
+    for (size_t i = 0; i < res.size(); i++) {
+        d.test_ms += res[i].ms;
+        if ( (res[i].rc < 0) && (d.rc >= 0) ) {
+            d.rc  = res[i].rc;
+            d.err = string("self-test ") + res[i].port + ": " + res[i].err;
+        }
+    }
+}
+
+/* microseconds since t */
+static long elapsed_us( chrono::steady_clock::time_point t )
+{
+    return chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - t).count();
+}
+
+/* epoch: of the adaptive slot the device runs in */
+void RackProgram::program_one( RACK_DEVICE_T &d, unsigned long epoch )
+{
+    chrono::steady_clock::time_point t;
+    FTDISession     ses;
+
+    if ( ((d.rc = ses.open(d.bus, d.dev, d.vid, d.pid)) < 0)
+        || ((d.rc = ses.probe()) < 0) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+
+    if (d.rc == 0) {
+        /* read() asks for FTDI_MAX_EEPROM_SIZE bytes, whatever the size */
+        t = chrono::steady_clock::now();
+        d.rc = ses.read();
+        if (cc)
+            cc->sample( epoch, CONCURRENCY_READ, elapsed_us(t),
+                        FTDI_MAX_EEPROM_SIZE / 2, d.rc < 0 );
+        if (d.rc < 0) {
+            d.err = ses.error();
+            goto done;
+        }
+    }
+
+    if ((d.rc = prepare(d, ses)) < 0)
+        goto done;
+
+    t = chrono::steady_clock::now();
+    d.rc = ses.write();
+    if (cc)
+        cc->sample( epoch, CONCURRENCY_WRITE, elapsed_us(t), d.size / 2, d.rc < 0 );
+    if (d.rc < 0) {
+        d.err = ses.error();
+        goto done;
+    }
+
+    if (test.mode != SELF_TEST_NONE)
+        self_test( d, ses );
+
+done:
+    ses.close();
+}
+
+/* one thread: open every device, then one event loop reads and writes all */
+void RackProgram::program_async( void )
+{
+    vector<FTDISession>         ses( devs.size() );
+    vector<FTDI_ASYNC_JOB_T>    jobs( devs.size() );
+    FTDIAsync   loop;
+    size_t      i;
+
+    for (i = 0; i < devs.size(); i++) {
+        RACK_DEVICE_T &d = devs[i];
+
+        if ((d.rc = ses[i].open(d.bus, d.dev, d.vid, d.pid)) < 0) {
+            d.err = ses[i].error();
+            continue;
+        }
+
+        jobs[i].ses   = &ses[i];
+        jobs[i].ready = [this, &d]( FTDI_ASYNC_JOB_T &j ) {
+            int rc = prepare( d, *j.ses );
+
+            j.err = d.err;
+            return (rc < 0) ? rc : 1;
+        };
+        loop.add( &jobs[i] );
+    }
+
+    loop.run();
+
+    for (i = 0; i < devs.size(); i++) {
+        if ( !ses[i].is_open() )
+            continue;
+
+        devs[i].rc  = jobs[i].rc;
+        devs[i].err = jobs[i].err;
+        devs[i].ms  = jobs[i].ms;
+        if ( (devs[i].rc >= 0) && (test.mode != SELF_TEST_NONE) )
+            self_test( devs[i], ses[i] );
+        ses[i].close();
+    }
+}
+
+int RackProgram::run( FILE *out )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    CONCURRENCY_STATS_T cs = CONCURRENCY_STATS_T();
+    ostringstream sum;
+    size_t  i, nthreads;
+    int     nok = 0, nerr = 0;
+
+    nthreads = async ? 0 : min(devs.size(), (size_t)RUNNER_MAX_THREADS);
+    if ( adaptive && (nthreads > 0) )
+        cc = new ConcurrencyControl( nthreads );
+
+    /* adaptive: a slot per device, the threads beyond the limit wait */
+    DeviceRunner::run( devs, nthreads, [this]( RACK_DEVICE_T &d ) {
+        unsigned long epoch;
+
+        if (cc == NULL) {
+            program_one( d );
+            return;
+        }
+        epoch = cc->acquire();
+        program_one( d, epoch );
+        cc->release();
+    } );
+
+    if (cc) {
+        DeviceLog log;
+
+        cs = cc->get_stats();
+        delete cc;
+        cc = NULL;
+
+        log(LOGL_INFO) << "Concurrency settled at " << cs.settled
+                       << " (peak " << cs.peak << ", " << cs.decreases
+                       << " decreases, " << cs.errors << " failed transfers, "
+                       << fixed << setprecision(1)
+                       << "baseline read " << cs.baseline_us[CONCURRENCY_READ]
+                       << " us/word, write " << cs.baseline_us[CONCURRENCY_WRITE]
+                       << " us/word)" << endl;
+    }
+
+    if (async)
+        program_async();
+
+    for (i = 0; i < devs.size(); i++) {
+        RACK_DEVICE_T &d = devs[i];
+        ostringstream fields;
+
+        if (d.size > 0) {
+            fields << " chip=" << FTDISession::chip_name(d.type)
+                   << " size=" << d.size;
+            if (d.blank)
+                fields << " blank=1";
+        }
+        if (d.tested)
+            fields << " selftest=" << ((d.rc < 0) ? "fail" : "pass")
+                   << " selftest_ms=" << d.test_ms;
+
+        (d.rc < 0) ? nerr++ : nok++;
+        DeviceRunner::device_line( out, d, (d.rc < 0) ? "error" : "ok", fields.str() );
+    }
+
+    sum << " ok=" << nok << " error=" << nerr << " images=" << cache.get_misses();
+    if (cs.limit > 0)
+        sum << " concurrency=" << cs.settled;
+    DeviceRunner::summary( out, devs.size(), sum.str(), t0 );
+
+    return nerr;
+}
@@ -0,0 +1,107 @@
+/*
+    Header of RackProgram class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _RACK_PROGRAM_HPP_
+#define _RACK_PROGRAM_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include "image_cache.hpp"
+#include "ftdi_async.hpp"
+#include "self_test.hpp"
+#include "concurrency_control.hpp"
+#include "device_runner.hpp"
+
+
+using namespace std;
+
+
+/* Program devices of any chip type with the image of their chip type:
+ *
+ *  open -> read (chip type, EEPROM size) -> cached encoded image -> write
+ *  open -> probe: blank (size of the chip type) -> cached encoded image -> write
+ *
+ * One line per device, then a summary (same format as the drift scan):
+ *
+ *  device bus=1 dev=5 status=ok chip=230X size=256 ms=301
+ *  device bus=1 dev=7 status=ok chip=R size=128 blank=1 ms=70
+ *  device bus=1 dev=6 status=error chip=232H size=256 ms=2 error=no%20image%20for%20chip%20type%20232H
+ *  summary devices=3 ok=2 error=1 images=2 ms=305
+ *
+ * 'images' is the number of encodes (one per chip type and size).
+ * Devices run on up to RUNNER_MAX_THREADS threads, or all of them on one
+ * thread with set_async() (ms then counts from the first transfer).
+ *
+ * set_self_test(): every written device is tested before it is closed,
+ * 'selftest=pass selftest_ms=12' on its line; a failed port makes the
+ * device an error ('error=self-test%20B:%20...'). With set_async() the
+ * tests run one device after another once the loop is done.
+ *
+ * set_adaptive(): how many devices run at once follows the per-word latency
+ * of their reads and writes (ConcurrencyControl), up to RUNNER_MAX_THREADS;
+ * 'concurrency=N' on the summary is the level it settled on.
+ */
+typedef struct RACK_DEVICE_S : RUN_DEVICE_S {
+    enum ftdi_chip_type type;
+    int             size;
+    bool            blank;
+
+    bool            tested;         /* self-test run */
+    long            test_ms;        /* every port */
+} RACK_DEVICE_T;
+
+
+class RackProgram {
+
+private:
+    ImageCache      &cache;
+    vector<RACK_DEVICE_T>   devs;
+    bool            async;
+    SELF_TEST_SPEC_T    test;       /* mode NONE: no self-test */
+    bool            adaptive;
+    ConcurrencyControl  *cc;        /* adaptive run only */
+
+    int     prepare( RACK_DEVICE_T &d, FTDISession &ses );
+    void    self_test( RACK_DEVICE_T &d, FTDISession &ses );
+    void    program_one( RACK_DEVICE_T &d, unsigned long epoch = 0 );
+    void    program_async( void );
+
+public:
+    /* Constructor / Destructor */
+    RackProgram( ImageCache &cache ) : cache(cache), async(false), test(),
+                                      adaptive(false), cc(NULL) {}
+    ~RackProgram() {}
+
+    void    add( int bus, int dev, int vid, int pid )
+            { DeviceRunner::add( devs, bus, dev, vid, pid ); }
+    void    set_async( bool on )    { async = on; }
+    void    set_adaptive( bool on ) { adaptive = on; }
+    void    set_self_test( const SELF_TEST_SPEC_T &spec )   { test = spec; }
+
+    /* returns number of failed devices */
+    int     run( FILE *out );
+
+};  /* class RackProgram */
+
+#endif  /* _RACK_PROGRAM_HPP_ */
@@ -0,0 +1,286 @@
+/*
+    Implementation of SelfTest class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <sstream>          /* ostringstream, istringstream */
+#include <iomanip>          /* setw, setfill */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include <stdlib.h>         /* strtoul */
+#include <string.h>         /* memcmp */
+#include <unistd.h>         /* usleep */
+#include "self_test.hpp"
+
+
+static string hex_byte( unsigned int v )
+{
+    ostringstream s;
+
+    s << "0x" << hex << setw(2) << setfill('0') << (v & 0xFF);
+    return s.str();
+}
+
+static int parse_byte( const string &s, unsigned char *v )
+{
+    char *end;
+    unsigned long n = strtoul( s.c_str(), &end, 0 );
+
+    if ( s.empty() || (*end != '\0') || (n > 0xFF) )
+        return -EINVAL;
+    *v = (unsigned char)n;
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------ */
+
+int SelfTest::ports( enum ftdi_chip_type type )
+{
+    switch (type) {
+    case TYPE_2232C:
+    case TYPE_2232H:    return 2;
+    case TYPE_4232H:    return 4;
+    default:            return 1;
+    }
+}
+
+int SelfTest::parse( string s, SELF_TEST_SPEC_T *spec )
+{
+    istringstream   in( s );
+    vector<string>  f;
+    string          item;
+    unsigned char   v;
+
+    while (getline(in, item, ':'))
+        f.push_back( item );
+    if ( f.empty() )
+        return -EINVAL;
+
+    *spec = SELF_TEST_SPEC_T();
+
+    if ( (f[0] == "bitbang") || (f[0] == "loop") ) {
+        if (f.size() > 3)
+            return -EINVAL;
+
+        spec->mode = (f[0] == "loop") ? SELF_TEST_LOOP : SELF_TEST_BITBANG;
+        spec->mask = (spec->mode == SELF_TEST_LOOP) ? 0x0F : 0xFF;
+        if ( (f.size() > 1) && (parse_byte( f[1], &spec->mask ) < 0) )
+            return -EINVAL;
+        /* loop: the driven pins are read 4 pins above */
+        if ( (spec->mask == 0)
+            || ((spec->mode == SELF_TEST_LOOP) && (spec->mask & 0xF0)) )
+            return -EINVAL;
+
+        if (f.size() > 2) {
+            istringstream list( f[2] );
+
+            while (getline(list, item, ',')) {
+                if (parse_byte( item, &v ) < 0)
+                    return -EINVAL;
+                spec->patterns.push_back( v );
+            }
+        } else if (spec->mode == SELF_TEST_LOOP) {
+            for (v = 1; v & 0x0F; v <<= 1)
+                if (v & spec->mask)
+                    spec->patterns.push_back( v );
+            spec->patterns.push_back( 0x00 );
+        } else {
+            spec->patterns = { 0x55, 0xAA, 0x00, 0xFF };
+        }
+        return spec->patterns.empty() ? -EINVAL : 0;
+    }
+
+    if (f[0] == "uart") {
+        char *end = NULL;
+
+        if (f.size() > 2)
+            return -EINVAL;
+
+        spec->mode = SELF_TEST_UART;
+        spec->baud = SELF_TEST_UART_BAUD;
+        if (f.size() > 1) {
+            spec->baud = (int)strtol( f[1].c_str(), &end, 10 );
+            if ( f[1].empty() || (*end != '\0') || (spec->baud <= 0) )
+                return -EINVAL;
+        }
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* Bitbang: every pattern on the MASK pins, read all pins back */
+int SelfTest::pins( struct ftdi_context *ftdi, string &err )
+{
+    unsigned char m = spec.mask, got;
+    size_t i;
+
+    if (ftdi_set_bitmode(ftdi, m, BITMODE_BITBANG) < 0) {
+        err = string("set bitbang: ") + ftdi_get_error_string(ftdi);
+        return -EIO;
+    }
+
+    for (i = 0; i < spec.patterns.size(); i++) {
+        unsigned char p = spec.patterns[i];
+        bool ok;
+
+        if (ftdi_write_data(ftdi, &p, 1) != 1) {
+            err = string("write pins: ") + ftdi_get_error_string(ftdi);
+            return -EIO;
+        }
+        usleep( SELF_TEST_SETTLE_US );
+        if (ftdi_read_pins(ftdi, &got) < 0) {
+            err = string("read pins: ") + ftdi_get_error_string(ftdi);
+            return -EIO;
+        }
+
+        ok = ((got & m) == (p & m));
+        if (spec.mode == SELF_TEST_LOOP)
+            ok = ok && (((got >> 4) & m) == (p & m));
+        if ( !ok ) {
+            err = "pins " + hex_byte(p & m) + " mask " + hex_byte(m)
+                + ": read " + hex_byte(got);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+/* UART: TXD -> RXD, what is sent comes back */
+int SelfTest::uart( struct ftdi_context *ftdi, string &err )
+{
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now()
+        + chrono::milliseconds( SELF_TEST_UART_TIMEOUT_MS );
+    unsigned char out[SELF_TEST_UART_BYTES], in[SELF_TEST_UART_BYTES];
+    int i, n = 0, rc;
+
+    for (i = 0; i < SELF_TEST_UART_BYTES; i++)
+        out[i] = (unsigned char)(0x55 ^ (i * 7));
+
+    if ( (ftdi_set_bitmode(ftdi, 0, BITMODE_RESET) < 0)
+        || (ftdi_set_baudrate(ftdi, spec.baud) < 0)
+        || (ftdi_set_line_property(ftdi, BITS_8, STOP_BIT_1, NONE) < 0)
+        || (ftdi_usb_purge_buffers(ftdi) < 0) )
+    {
+        err = string("set uart: ") + ftdi_get_error_string(ftdi);
+        return -EIO;
+    }
+
+    if (ftdi_write_data(ftdi, out, sizeof(out)) != (int)sizeof(out)) {
+        err = string("write uart: ") + ftdi_get_error_string(ftdi);
+        return -EIO;
+    }
+
+    while ( (n < (int)sizeof(in)) && (chrono::steady_clock::now() < deadline) ) {
+        if ((rc = ftdi_read_data(ftdi, in + n, sizeof(in) - n)) < 0) {
+            err = string("read uart: ") + ftdi_get_error_string(ftdi);
+            return -EIO;
+        }
+        n += rc;
+    }
+
+    if (n < (int)sizeof(in)) {
+        err = "uart: " + to_string(n) + "/" + to_string(sizeof(in))
+            + " bytes echoed";
+        return -ETIMEDOUT;
+    }
+    for (i = 0; i < n; i++) {
+        if (in[i] != out[i]) {
+            err = "uart: byte " + to_string(i) + " sent " + hex_byte(out[i])
+                + " read " + hex_byte(in[i]);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+int SelfTest::run_port( struct ftdi_context *ftdi, string &err )
+{
+    int rc;
+
+    rc = (spec.mode == SELF_TEST_UART) ? uart( ftdi, err ) : pins( ftdi, err );
+    ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+
+    return rc;
+}
+
+/* Port A is the session's own interface. B .. D: a context of their own on
+ * the session's USB handle (no open, no enumeration), the interface claimed
+ * from the kernel serial driver for the test and given back after.
+ */
+int SelfTest::run( FTDISession &ses, vector<SELF_TEST_RESULT_T> &res )
+{
+    struct ftdi_context *ftdi = ses.context();
+    int n, i, nfail = 0;
+
+    if ( !ses.is_open() || (ftdi == NULL) || (ftdi->usb_dev == NULL) )
+        return -ENODEV;
+    if (spec.mode == SELF_TEST_NONE)
+        return -EINVAL;
+
+    n = ports( ftdi->type );
+    for (i = 0; i < n; i++) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        SELF_TEST_RESULT_T r = SELF_TEST_RESULT_T();
+        struct ftdi_context *port;
+        bool detached;
+
+        r.port = 'A' + i;
+
+        if (i == 0) {
+            r.rc = run_port( ftdi, r.err );
+        } else if ((port = ftdi_new()) == NULL) {
+            r.rc  = -ENOMEM;
+            r.err = "out of memory";
+        } else {
+            ftdi_set_interface(port, (enum ftdi_interface)(INTERFACE_A + i));
+            port->type            = ftdi->type;
+            port->max_packet_size = ftdi->max_packet_size;
+            ftdi_set_usbdev(port, ftdi->usb_dev);
+
+            detached = (libusb_detach_kernel_driver(ftdi->usb_dev, port->interface) == 0);
+            if (libusb_claim_interface(ftdi->usb_dev, port->interface) < 0) {
+                r.rc  = -EBUSY;
+                r.err = "claim interface failed";
+            } else {
+                r.rc = run_port( port, r.err );
+                libusb_release_interface(ftdi->usb_dev, port->interface);
+            }
+            if (detached)
+                libusb_attach_kernel_driver(ftdi->usb_dev, port->interface);
+
+            /* the handle is the session's: not closed by ftdi_free */
+            ftdi_set_usbdev(port, NULL);
+            ftdi_free(port);
+        }
+
+        r.ms = chrono::duration_cast<chrono::milliseconds>(
+                    chrono::steady_clock::now() - t0).count();
+        if (r.rc < 0)
+            nfail++;
+        res.push_back( r );
+    }
+
+    return nfail;
+}
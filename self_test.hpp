@@ -0,0 +1,104 @@
+/*
+    Header of SelfTest class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _SELF_TEST_HPP_
+#define _SELF_TEST_HPP_
+
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include "ftdi_session.hpp"
+
+
+using namespace std;
+
+
+/* Board self-test on an opened session, right after the write: no second
+ * open / enumeration. Every port of the chip is tested (A, B for 2232C /
+ * 2232H, A - D for 4232H), port A on the session's handle, the others on
+ * the same USB handle with their interface claimed for the test.
+ *
+ *  bitbang[:MASK[:P,P..]]  drive MASK pins with each pattern, every driven
+ *                          pin reads back its level (shorts, opens)
+ *  loop[:MASK[:P,P..]]     loopback fixture: pins MASK (low nibble) drive
+ *                          the pins 4 above (D0->D4, ..., D3->D7)
+ *  uart[:BAUD]             TXD wired to RXD: SELF_TEST_UART_BYTES echoed
+ *
+ * Defaults: bitbang 0xFF 0x55,0xAA,0x00,0xFF; loop 0x0F walking one;
+ * uart 115200. A test leaves the port in reset mode (UART).
+ */
+#define SELF_TEST_MAX_PORTS     (4)
+#define SELF_TEST_SETTLE_US     (1000)      /* pins after a bitbang write */
+#define SELF_TEST_UART_BAUD     (115200)
+#define SELF_TEST_UART_BYTES    (32)
+#define SELF_TEST_UART_TIMEOUT_MS   (100)
+
+enum SELF_TEST_MODE {
+    SELF_TEST_NONE,
+    SELF_TEST_BITBANG,
+    SELF_TEST_LOOP,
+    SELF_TEST_UART
+};
+
+typedef struct SELF_TEST_SPEC_S {
+    enum SELF_TEST_MODE     mode;
+    unsigned char           mask;       /* bitbang / loop: driven pins */
+    vector<unsigned char>   patterns;
+    int                     baud;       /* uart */
+} SELF_TEST_SPEC_T;
+
+typedef struct SELF_TEST_RESULT_S {
+    char            port;           /* 'A' .. 'D' */
+    int             rc;             /* 0: pass */
+    string          err;
+    long            ms;
+} SELF_TEST_RESULT_T;
+
+
+class SelfTest {
+
+private:
+    SELF_TEST_SPEC_T    spec;
+
+    int     run_port( struct ftdi_context *ftdi, string &err );
+    int     pins( struct ftdi_context *ftdi, string &err );
+    int     uart( struct ftdi_context *ftdi, string &err );
+
+public:
+    /* Constructor / Destructor */
+    SelfTest( const SELF_TEST_SPEC_T &spec ) : spec(spec) {}
+    ~SelfTest() {}
+
+    /* one result per port; returns number of failed ports, -errno if the
+     * test could not run at all
+     */
+    int     run( FTDISession &ses, vector<SELF_TEST_RESULT_T> &res );
+
+    /* "loop:0x0f:1,2,4,8" -> spec (defaults filled in) */
+    static int  parse( string s, SELF_TEST_SPEC_T *spec );
+    /* number of ports (interfaces) of a chip type */
+    static int  ports( enum ftdi_chip_type type );
+
+};  /* class SelfTest */
+
+#endif  /* _SELF_TEST_HPP_ */
@@ -0,0 +1,126 @@
+/*
+    Implementation of SimDevice class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <thread>           /* sleep_for */
+#include <chrono>           /* microseconds */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memset, memcpy */
+#include "sim_device.hpp"
+
+
+/* -------------------- Constructor / Destructor -------------------- */
+
+SimDevice::SimDevice( enum ftdi_chip_type type, unsigned int size,
+                      const SIM_LATENCY_T &latency )
+    : type(type), size(size), latency(latency), transfers(0)
+{
+    if ( (this->size == 0) || (this->size > FTDI_MAX_EEPROM_SIZE) )
+        this->size = FTDI_MAX_EEPROM_SIZE;
+
+    erase();
+}
+
+/* ------------------------------------------------------------------ */
+
+void SimDevice::delay( unsigned int us, unsigned int count )
+{
+    if (us && count)
+        this_thread::sleep_for( chrono::microseconds((unsigned long)us * count) );
+}
+
+void SimDevice::erase( void )
+{
+    memset(eeprom, 0xFF, sizeof(eeprom));
+}
+
+int SimDevice::set_image( const unsigned char *buf, unsigned int len )
+{
+    if ( (len == 0) || (len > size) )
+        return -EINVAL;
+
+    erase();
+    memcpy(eeprom, buf, len);
+    return 0;
+}
+
+int SimDevice::open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid )
+{
+    delay(latency.open_us, 1);
+    transfers++;
+
+    /* ftdi_usb_open: the chip type from bcdDevice */
+    ftdi->type = type;
+    return 0;
+}
+
+void SimDevice::close( struct ftdi_context *ftdi )
+{
+}
+
+/* what ftdi_read_eeprom leaves in the context */
+int SimDevice::read_eeprom( struct ftdi_context *ftdi )
+{
+    unsigned int i;
+    bool blank = true;
+    int rc;
+
+    delay(latency.read_us, FTDI_MAX_EEPROM_SIZE / 2);
+    transfers += FTDI_MAX_EEPROM_SIZE / 2;
+
+    for (i = 0; (i < size) && blank; i++)
+        blank = (eeprom[i] == 0xFF);
+
+    if ((rc = ftdi_set_eeprom_buf(ftdi, eeprom, size)) < 0)
+        return rc;
+
+    ftdi->type = type;
+    ftdi_set_eeprom_value(ftdi, CHIP_SIZE, blank ? -1 : (int)size);
+
+    return 0;
+}
+
+int SimDevice::read_location( struct ftdi_context *ftdi, int addr, unsigned short *word )
+{
+    if ( (addr < 0) || ((unsigned int)addr >= FTDI_MAX_EEPROM_SIZE / 2) )
+        return -1;
+
+    delay(latency.read_us, 1);
+    transfers++;
+
+    *word = ((unsigned int)addr * 2 < size)
+          ? (eeprom[addr * 2] | (eeprom[addr * 2 + 1] << 8)) : 0xFFFF;
+    return 0;
+}
+
+int SimDevice::write_eeprom( struct ftdi_context *ftdi )
+{
+    int rc;
+
+    if ((rc = ftdi_get_eeprom_buf(ftdi, eeprom, size)) < 0)
+        return rc;
+
+    delay(latency.write_us, size / 2);
+    transfers += size / 2;
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+    Header of SimDevice class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _SIM_DEVICE_HPP_
+#define _SIM_DEVICE_HPP_
+
+#include "ftdi_session.hpp"
+
+
+using namespace std;
+
+
+/* USB cost of a simulated device. libftdi reads the whole EEPROM space
+ * (FTDI_MAX_EEPROM_SIZE) and writes the EEPROM size, one control transfer
+ * per word; a written word also waits for the EEPROM write cycle.
+ */
+typedef struct SIM_LATENCY_S {
+    unsigned int    open_us;
+    unsigned int    read_us;        /* per word read */
+    unsigned int    write_us;       /* per word written */
+} SIM_LATENCY_T;
+
+#define SIM_OPEN_US             (2000)
+#define SIM_READ_US             (250)
+#define SIM_WRITE_US            (1000)
+
+
+/* In-process FTDI device for FTDISession::set_transport(): no hardware, the
+ * EEPROM lives in memory and every transfer sleeps its latency.
+ * One session at a time per device.
+ */
+class SimDevice : public FTDITransport {
+
+private:
+    enum ftdi_chip_type type;
+    unsigned char   eeprom[FTDI_MAX_EEPROM_SIZE];
+    unsigned int    size;
+    SIM_LATENCY_T   latency;
+    unsigned long   transfers;
+
+    static void     delay( unsigned int us, unsigned int count );
+
+public:
+    /* Constructor / Destructor */
+    SimDevice( enum ftdi_chip_type type, unsigned int size,
+               const SIM_LATENCY_T &latency );
+    ~SimDevice() {}
+
+    void    erase( void );                          /* blank: all 0xFF */
+    int     set_image( const unsigned char *buf, unsigned int len );
+
+    const unsigned char *image()        { return eeprom; }
+    unsigned int    get_size()          { return size; }
+    unsigned long   get_transfers()     { return transfers; }
+
+    /* FTDITransport */
+    int     open( struct ftdi_context *ftdi, int bus, int dev, int vid, int pid );
+    void    close( struct ftdi_context *ftdi );
+    int     read_eeprom( struct ftdi_context *ftdi );
+    int     read_location( struct ftdi_context *ftdi, int addr, unsigned short *word );
+    int     write_eeprom( struct ftdi_context *ftdi );
+
+};  /* class SimDevice */
+
+#endif  /* _SIM_DEVICE_HPP_ */
@@ -0,0 +1,152 @@
+/*
+    Implementation of SnapshotCache class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#include <sstream>          /* ostringstream */
+#include <iomanip>          /* setw, setfill, ... */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy, memcmp */
+#include <fcntl.h>          /* open */
+#include <unistd.h>         /* close, read, write */
+#include <sys/stat.h>       /* mkdir */
+#include "snapshot_cache.hpp"
+#include "image_store.hpp"  /* hash, key_string */
+
+
+/* ------------------------------------------------------------------ */
+
+string SnapshotCache::entry_path( const string &id )
+{
+    uint64_t h = ImageStore::hash(
+        reinterpret_cast<const unsigned char *>(id.data()), id.size() );
+
+    return dir + "/" + ImageStore::key_string(h) + FTDC_SUFFIX;
+}
+
+int SnapshotCache::get( const string &id, enum ftdi_chip_type *type,
+                        unsigned char *img, unsigned int *size )
+{
+    unsigned char buf[sizeof(FTDC_HEADER_T) + FTDI_MAX_EEPROM_SIZE * 4];
+    FTDC_HEADER_T h;
+    ssize_t len;
+    int fd;
+
+    if ((fd = ::open(entry_path(id).c_str(), O_RDONLY)) < 0)
+        return -ENOENT;
+    len = ::read(fd, buf, sizeof(buf));
+    ::close(fd);
+
+    if (len < (ssize_t)sizeof(h))
+        return -ENOENT;
+    memcpy(&h, buf, sizeof(h));
+
+    /* another device with the same hash, or stale format */
+    if ( (memcmp(h.magic, FTDC_MAGIC, sizeof(h.magic)) != 0)
+        || (h.version != FTDC_VERSION)
+        || (h.size == 0) || (h.size > FTDI_MAX_EEPROM_SIZE)
+        || (len != (ssize_t)(sizeof(h) + h.id_len + h.size))
+        || (id.compare(0, string::npos, (const char *)buf + sizeof(h), h.id_len) != 0) )
+        return -ENOENT;
+
+    memcpy(img, buf + sizeof(h) + h.id_len, h.size);
+    *size = h.size;
+    *type = (enum ftdi_chip_type)h.type;
+
+    return 0;
+}
+
+int SnapshotCache::put( const string &id, enum ftdi_chip_type type,
+                        const unsigned char *img, unsigned int size )
+{
+    string path = entry_path(id), tmp = path + ".tmp";
+    string rec;
+    FTDC_HEADER_T h;
+    int fd, rc = 0;
+
+    if ( (size == 0) || (size > FTDI_MAX_EEPROM_SIZE)
+        || (id.size() > FTDI_MAX_EEPROM_SIZE * 2) )
+        return -EINVAL;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FTDC_MAGIC, sizeof(h.magic));
+    h.version = FTDC_VERSION;
+    h.size    = size;
+    h.id_len  = id.size();
+    h.type    = type;
+
+    rec.assign( reinterpret_cast<const char *>(&h), sizeof(h) );
+    rec += id;
+    rec.append( reinterpret_cast<const char *>(img), size );
+
+    mkdir(dir.c_str(), 0755);       /* EEXIST is fine */
+
+    if ((fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -errno;
+    if (::write(fd, rec.data(), rec.size()) != (ssize_t)rec.size())
+        rc = -EIO;
+    ::close(fd);
+
+    if ( (rc == 0) && (rename(tmp.c_str(), path.c_str()) < 0) )
+        rc = -errno;
+    if (rc < 0)
+        unlink(tmp.c_str());
+
+    return rc;
+}
+
+int SnapshotCache::invalidate( const string &id )
+{
+    if ( (unlink(entry_path(id).c_str()) < 0) && (errno != ENOENT) )
+        return -errno;
+
+    return 0;
+}
+
+int SnapshotCache::device_id( FTDISession &ses, string &id )
+{
+    struct ftdi_context *ftdi = ses.context();
+    struct libusb_device_descriptor desc;
+    unsigned char serial[FTDI_MAX_EEPROM_SIZE];
+    string path;
+    ostringstream s;
+    int rc;
+
+    if ( !ses.is_open() || !ftdi || !ftdi->usb_dev )
+        return -ENOTSUP;
+
+    if ((rc = ses.port_path( path )) < 0)
+        return rc;
+    if (libusb_get_device_descriptor(libusb_get_device(ftdi->usb_dev), &desc) < 0)
+        return -EIO;
+
+    serial[0] = '\0';
+    if ( desc.iSerialNumber
+        && (libusb_get_string_descriptor_ascii(ftdi->usb_dev, desc.iSerialNumber,
+                serial, sizeof(serial)) < 0) )
+        serial[0] = '\0';
+
+    s << path << ":" << serial << ":"
+      << hex << setw(4) << setfill('0') << desc.bcdDevice;
+
+    id = s.str();
+    return 0;
+}
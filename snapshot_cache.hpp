@@ -0,0 +1,89 @@
+/*
+    Header of SnapshotCache class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _SNAPSHOT_CACHE_HPP_
+#define _SNAPSHOT_CACHE_HPP_
+
+#include <stdint.h>         /* uint16_t, ... */
+#include <string>           /* string */
+#include "ftdi_session.hpp"
+
+
+using namespace std;
+
+
+/* Last EEPROM image read from a device, one file per device in a directory:
+ *
+ *  <dir>/<hash of device id>.snap
+ *  +--------------+-----------------+-----------------+
+ *  | FTDC_HEADER  | device id       | image[size]     |
+ *  +--------------+-----------------+-----------------+
+ *
+ * Device id: "port path:descriptor serial:bcdDevice" (e.g. "1-2.3:FT1X0:0600"),
+ * the same board on the same port. The caller checks an entry is current
+ * before using it: FTDIDEV reads the checksum word, and the words the
+ * checksum does not cover (FT230X: 0x12 - 0x3F). Only FTDIDEV writes and
+ * UserData invalidate entries; the other write paths (rack, daemon, async,
+ * shard) leave them to that check. Files are replaced by rename: readers never
+ * see a partial entry.
+ */
+#define FTDC_MAGIC              "FTDC"
+#define FTDC_VERSION            (1)
+#define FTDC_SUFFIX             ".snap"
+
+typedef struct FTDC_HEADER_S {
+    char        magic[4];           /* FTDC_MAGIC */
+    uint16_t    version;
+    uint16_t    size;               /* image */
+    uint16_t    id_len;             /* device id, after header */
+    uint8_t     type;               /* enum ftdi_chip_type */
+    uint8_t     reserved[5];
+} FTDC_HEADER_T;
+
+
+class SnapshotCache {
+
+private:
+    string          dir;
+
+    string  entry_path( const string &id );
+
+public:
+    /* Constructor / Destructor */
+    SnapshotCache( string dir ) : dir(dir) {}
+    ~SnapshotCache() {}
+
+    /* 0: found, -ENOENT: no entry (or not this device) */
+    int     get( const string &id, enum ftdi_chip_type *type,
+                 unsigned char *img, unsigned int *size );
+    int     put( const string &id, enum ftdi_chip_type type,
+                 const unsigned char *img, unsigned int size );
+    int     invalidate( const string &id );
+
+    /* id of the device opened in the session: -ENOTSUP if not USB */
+    static int  device_id( FTDISession &ses, string &id );
+
+};  /* class SnapshotCache */
+
+#endif  /* _SNAPSHOT_CACHE_HPP_ */
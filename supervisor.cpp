@@ -0,0 +1,342 @@
+/*
+    Implementation of Supervisor class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <iostream>         /* cout */
+#include <sstream>          /* ostringstream */
+#include <algorithm>        /* sort */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include <cstring>          /* strerror */
+#include <csignal>          /* kill, SIGKILL */
+#include <unistd.h>         /* fork, _exit, usleep */
+#include <sys/mman.h>       /* mmap */
+#include <sys/wait.h>       /* waitpid */
+#include "supervisor.hpp"
+#include "ftdi_server.hpp"  /* escape */
+#include "ftdi_session.hpp" /* FTDIPool */
+#include "log_sink.hpp"
+
+
+/* shared between processes: only if no lock is hidden in them */
+static_assert( ATOMIC_INT_LOCK_FREE == 2, "atomic int must be lock free" );
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "atomic int64 must be lock free" );
+static_assert( (SUPERVISOR_RING & (SUPERVISOR_RING - 1)) == 0,
+               "SUPERVISOR_RING must be a power of 2" );
+
+
+/* ------------------------------------------------------------------ */
+
+int64_t Supervisor::now_ms( void )
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Supervisor::add( int bus, int dev )
+{
+    SUPERVISOR_DEVICE_T d = SUPERVISOR_DEVICE_T();
+
+    d.bus = bus;
+    d.dev = dev;
+    devs.push_back( d );
+}
+
+/* by bus then address: N devices per worker mostly share a bus too */
+void Supervisor::split( void )
+{
+    size_t i;
+
+    sort( devs.begin(), devs.end(),
+        []( const SUPERVISOR_DEVICE_T &a, const SUPERVISOR_DEVICE_T &b ) {
+            return (a.bus != b.bus) ? (a.bus < b.bus) : (a.dev < b.dev);
+        } );
+
+    if ( (per != SUPERVISOR_PER_BUS) && (devs.size() > (size_t)per * SUPERVISOR_MAX_WORKERS) )
+        per = (devs.size() + SUPERVISOR_MAX_WORKERS - 1) / SUPERVISOR_MAX_WORKERS;
+
+    for (i = 0; i < devs.size(); i++) {
+        if ( shards.empty()
+            || ((per == SUPERVISOR_PER_BUS) && (devs[i].bus != devs[i - 1].bus))
+            || ((per != SUPERVISOR_PER_BUS) && (shards.back().devs.size() >= (size_t)per)) )
+        {
+            shards.push_back( SUPERVISOR_SHARD_T() );
+        }
+
+        devs[i].worker = shards.size() - 1;
+        shards.back().devs.push_back( i );
+    }
+}
+
+/* the worker process: never returns */
+void Supervisor::worker( SUPERVISOR_SHM_T *shm, const vector<size_t> &list )
+{
+    /* the parent's log thread and libusb contexts are not in this process */
+    LogSink::set_global( NULL );
+    FTDIPool::global().drop();
+
+    /* stdout carries the supervisor's lines */
+    if (DeviceLog::min_level() < LOGL_WARN)
+        DeviceLog::set_min_level( LOGL_WARN );
+
+    for (;;) {
+        int32_t n = shm->next.load();
+        int64_t t0 = now_ms();
+        uint32_t head;
+        string  err;
+        int     rc;
+
+        if ((size_t)n >= list.size())
+            break;
+
+        /* next first: busy_since set means device next - 1 is running */
+        shm->next.store( n + 1 );
+        shm->busy_since.store( t0 );
+
+        rc = job( devs[list[n]].bus, devs[list[n]].dev, err );
+
+        /* full: the supervisor empties the ring every poll */
+        head = shm->head.load( memory_order_relaxed );
+        while (head - shm->tail.load( memory_order_acquire ) >= SUPERVISOR_RING)
+            usleep( SUPERVISOR_POLL_US );
+
+        SUPERVISOR_RESULT_T &r = shm->ring[head & (SUPERVISOR_RING - 1)];
+        r.index = n;
+        r.rc    = rc;
+        r.ms    = now_ms() - t0;
+        snprintf( r.err, sizeof(r.err), "%s", err.c_str() );
+        shm->head.store( head + 1, memory_order_release );
+
+        shm->busy_since.store( 0 );
+    }
+
+    /* no atexit(): the parent's objects are not this process' to delete */
+    _exit( 0 );
+}
+
+int Supervisor::start( size_t s )
+{
+    pid_t pid;
+
+    if ((pid = fork()) < 0)
+        return -errno;
+
+    if (pid == 0)
+        worker( shards[s].shm, shards[s].devs );
+
+    shards[s].pid = pid;
+    return 0;
+}
+
+void Supervisor::drain( size_t s )
+{
+    SUPERVISOR_SHM_T *shm = shards[s].shm;
+    uint32_t tail = shm->tail.load( memory_order_relaxed );
+
+    while (tail != shm->head.load( memory_order_acquire )) {
+        const SUPERVISOR_RESULT_T &r = shm->ring[tail & (SUPERVISOR_RING - 1)];
+        SUPERVISOR_DEVICE_T &d = devs[ shards[s].devs[r.index] ];
+
+        if ( !d.done ) {
+            d.done = true;
+            d.rc   = r.rc;
+            d.err  = r.err;
+            d.ms   = r.ms;
+        }
+        shm->tail.store( ++tail, memory_order_release );
+    }
+}
+
+/* The worker is gone (killed, died): its device fails, a new worker goes
+ * on with the rest. Gone between devices, it would go again: the rest fails.
+ */
+void Supervisor::fail( size_t s, const string &err )
+{
+    SUPERVISOR_SHARD_T &sh = shards[s];
+    string  why( err );
+    int64_t busy;
+    size_t  i, n;
+    int     rc;
+
+    sh.pid = 0;
+    drain( s );
+
+    n = sh.shm->next.load();
+    busy = sh.shm->busy_since.exchange( 0 );
+
+    if (busy != 0) {
+        SUPERVISOR_DEVICE_T &d = devs[ sh.devs[n - 1] ];
+
+        if ( !d.done ) {
+            d.done = true;
+            d.rc   = -ECHILD;
+            d.err  = err;
+            d.ms   = now_ms() - busy;
+        }
+
+        if (n >= sh.devs.size())
+            return;
+
+        restarts++;
+        if ((rc = start( s )) == 0)
+            return;
+        why = string("fork: ") + strerror(-rc);
+    }
+
+    for (i = n; i < sh.devs.size(); i++) {
+        SUPERVISOR_DEVICE_T &d = devs[ sh.devs[i] ];
+
+        if ( !d.done ) {
+            d.done = true;
+            d.rc   = -ECHILD;
+            d.err  = why;
+        }
+    }
+    sh.shm->next.store( sh.devs.size() );
+}
+
+/* exited workers; a killed one is not a shard's worker any more */
+void Supervisor::reap( void )
+{
+    pid_t   pid;
+    int     status;
+    size_t  s;
+
+    while ((pid = waitpid( -1, &status, WNOHANG )) > 0) {
+        for (s = 0; s < shards.size(); s++) {
+            if (shards[s].pid != pid)
+                continue;
+
+            drain( s );
+            if ( WIFEXITED(status) && (WEXITSTATUS(status) == 0)
+                && ((size_t)shards[s].shm->next.load() >= shards[s].devs.size())
+                && (shards[s].shm->busy_since.load() == 0) )
+            {
+                shards[s].pid = 0;
+            } else if ( WIFSIGNALED(status) ) {
+                fail( s, "worker died: signal " + to_string(WTERMSIG(status)) );
+            } else {
+                fail( s, "worker died: exit " + to_string(WEXITSTATUS(status)) );
+            }
+            break;
+        }
+    }
+}
+
+/* results in, exits reaped, hung workers replaced: until none runs */
+void Supervisor::watch( void )
+{
+    size_t  s;
+    bool    running;
+
+    do {
+        int64_t now;
+
+        for (s = 0; s < shards.size(); s++)
+            drain( s );
+        reap();
+
+        now = now_ms();
+        running = false;
+        for (s = 0; s < shards.size(); s++) {
+            int64_t busy;
+
+            if (shards[s].pid == 0)
+                continue;
+
+            busy = shards[s].shm->busy_since.load();
+            if ( (busy != 0) && (now - busy > hang_ms) ) {
+                /* SIGKILL: never back in user space, even if the USB call
+                 * it is stuck in returns later. Reaped before the new worker
+                 * starts: the ring, next and busy_since have one writer
+                 */
+                kill( shards[s].pid, SIGKILL );
+                while ( (waitpid( shards[s].pid, NULL, 0 ) < 0) && (errno == EINTR) )
+                    ;
+                fail( s, "worker hung, killed" );
+            }
+            running |= (shards[s].pid != 0);
+        }
+
+        if (running)
+            usleep( SUPERVISOR_POLL_US );
+    } while (running);
+}
+
+int Supervisor::run( FILE *out )
+{
+    int64_t t0 = now_ms();
+    SUPERVISOR_SHM_T *shm;
+    size_t  i, s, len;
+    int     nok = 0, nerr = 0, rc;
+
+    split();
+
+    len = max( shards.size(), (size_t)1 ) * sizeof(SUPERVISOR_SHM_T);
+    shm = (SUPERVISOR_SHM_T *)mmap( NULL, len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if (shm == MAP_FAILED)
+        return -errno;
+
+    /* a worker starts with what is buffered here: nothing */
+    if (LogSink::global())
+        LogSink::global()->flush();
+    cout.flush();
+    fflush( NULL );
+
+    for (s = 0; s < shards.size(); s++) {
+        shards[s].shm = &shm[s];
+        if ((rc = start( s )) < 0) {
+            shards[s].shm->busy_since.store( 0 );
+            fail( s, string("fork: ") + strerror(-rc) );
+        }
+    }
+
+    watch();
+    munmap( shm, len );
+
+    for (i = 0; i < devs.size(); i++) {
+        SUPERVISOR_DEVICE_T &d = devs[i];
+        ostringstream line;
+
+        if ( !d.done ) {
+            d.rc  = -ECHILD;
+            d.err = "no result";
+        }
+
+        line << "device bus=" << d.bus << " dev=" << d.dev
+             << " worker=" << d.worker
+             << " status=" << ((d.rc < 0) ? "error" : "ok")
+             << " ms=" << d.ms;
+        if (d.rc < 0)
+            line << " error=" << FTDIServer::escape(d.err);
+
+        (d.rc < 0) ? nerr++ : nok++;
+        fprintf(out, "%s\n", line.str().c_str());
+    }
+
+    fprintf(out, "summary devices=%zu ok=%d error=%d workers=%zu restarts=%u ms=%ld\n",
+        devs.size(), nok, nerr, shards.size(), restarts,
+        (long)(now_ms() - t0));
+    fflush(out);
+
+    return nerr;
+}
@@ -0,0 +1,131 @@
+/*
+    Header of Supervisor class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _SUPERVISOR_HPP_
+#define _SUPERVISOR_HPP_
+
+#include <cstdio>           /* FILE */
+#include <cstdint>          /* uint32_t */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include <atomic>           /* atomic */
+#include <functional>       /* function */
+#include <sys/types.h>      /* pid_t */
+
+
+using namespace std;
+
+
+/* Devices split into shards, one worker process per shard: every device of
+ * a USB bus (per bus), or N devices. A worker runs the job of its devices
+ * one after another; libusb, and a wedged device, stay in that process.
+ *
+ * Workers report through a ring in shared memory (one producer: the
+ * worker, one consumer: the supervisor, no lock). A worker busy on one
+ * device for more than the hang time is killed, the device is an error,
+ * and a new worker goes on with the rest of the shard; so is a worker
+ * that dies on a device.
+ *
+ *  device bus=1 dev=5 worker=0 status=ok ms=301
+ *  device bus=2 dev=3 worker=1 status=error ms=30000 error=worker%20hung,%20killed
+ *  summary devices=2 ok=1 error=1 workers=2 restarts=1 ms=30410
+ */
+#define SUPERVISOR_PER_BUS      (0)     /* shard size: every device of a bus */
+#define SUPERVISOR_MAX_WORKERS  (256)
+#define SUPERVISOR_HANG_MS      (30000) /* one device, read to self-test */
+#define SUPERVISOR_POLL_US      (10000)
+#define SUPERVISOR_RING         (64)    /* results, power of 2 */
+#define SUPERVISOR_ERR_MAX      (160)   /* error text, truncated */
+
+/* 0: ok, -errno; err: what failed. Runs in the worker process */
+typedef function<int (int bus, int dev, string &err)>  SUPERVISOR_JOB_T;
+
+/* one device done, written by the worker */
+typedef struct SUPERVISOR_RESULT_S {
+    int32_t         index;          /* device in the shard */
+    int32_t         rc;
+    int64_t         ms;
+    char            err[SUPERVISOR_ERR_MAX];
+} SUPERVISOR_RESULT_T;
+
+/* shared memory of one shard: zero filled (mmap) is the initial state */
+typedef struct SUPERVISOR_SHM_S {
+    atomic<uint32_t>    head;       /* written by the worker */
+    atomic<uint32_t>    tail;       /* written by the supervisor */
+    atomic<int32_t>     next;       /* device to run next, by the worker */
+    atomic<int64_t>     busy_since; /* device started (ms), 0: between */
+    SUPERVISOR_RESULT_T ring[SUPERVISOR_RING];
+} SUPERVISOR_SHM_T;
+
+typedef struct SUPERVISOR_DEVICE_S {
+    int             bus, dev;
+    int             worker;         /* shard */
+
+    bool            done;
+    int             rc;
+    string          err;
+    long            ms;
+} SUPERVISOR_DEVICE_T;
+
+typedef struct SUPERVISOR_SHARD_S {
+    vector<size_t>  devs;           /* index in Supervisor::devs */
+    SUPERVISOR_SHM_T    *shm;
+    pid_t           pid;            /* 0: no worker running */
+} SUPERVISOR_SHARD_T;
+
+
+class Supervisor {
+
+private:
+    int             per;            /* devices per worker, 0: per bus */
+    long            hang_ms;
+    SUPERVISOR_JOB_T    job;
+    vector<SUPERVISOR_DEVICE_T> devs;
+    vector<SUPERVISOR_SHARD_T>  shards;
+    unsigned int    restarts;
+
+    void    split( void );
+    int     start( size_t s );
+    void    worker( SUPERVISOR_SHM_T *shm, const vector<size_t> &list );
+    void    drain( size_t s );
+    void    fail( size_t s, const string &err );
+    void    reap( void );
+    void    watch( void );
+
+public:
+    /* Constructor / Destructor */
+    Supervisor( int per, SUPERVISOR_JOB_T job, long hang_ms = SUPERVISOR_HANG_MS )
+        : per(per), hang_ms(hang_ms), job(job), restarts(0) {}
+    ~Supervisor() {}
+
+    void    add( int bus, int dev );
+
+    /* returns number of failed devices, -errno on failure */
+    int     run( FILE *out );
+
+    /* monotonic clock, shared by the processes */
+    static int64_t  now_ms( void );
+
+};  /* class Supervisor */
+
+#endif  /* _SUPERVISOR_HPP_ */
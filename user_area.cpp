@@ -0,0 +1,92 @@
+/*
+    Implementation of UserArea class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcpy */
+#include "user_area.hpp"
+#include "ftdi_session.hpp" /* FTDI_MAX_EEPROM_SIZE */
+
+
+/* string descriptor pointers: manufacturer, product, serial (byte, length) */
+static const unsigned int user_string_ptr[] = { 0x0E, 0x10, 0x12 };
+
+
+/* ------------------------------------------------------------------ */
+
+int UserArea::bounds( enum ftdi_chip_type type, const unsigned char *img,
+                      unsigned int size, USER_AREA_T *a )
+{
+    unsigned int i, start, end = 0;
+
+    if (EEPROMChecksum::layout( type, size, &a->layout ) < 0)
+        return -EINVAL;
+
+    if (a->layout.skip_to) {
+        a->from = a->layout.skip_from * 2;
+        a->to   = a->layout.skip_to * 2;
+        a->checksum = false;
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(user_string_ptr) / sizeof(user_string_ptr[0]); i++) {
+        start = img[ user_string_ptr[i] ] & (size - 1);
+
+        if ( img[ user_string_ptr[i] + 1 ] && (start + img[ user_string_ptr[i] + 1 ] > end) )
+            end = start + img[ user_string_ptr[i] + 1 ];
+    }
+
+    /* no string: where the configuration ends is not known */
+    if (end == 0)
+        return -ENODATA;
+
+    a->from = (end + 1) & ~1U;
+    a->to   = a->layout.words * 2;
+    a->checksum = true;
+
+    return (a->from < a->to) ? 0 : -ENOSPC;
+}
+
+int UserArea::apply( const USER_AREA_T &a, unsigned char *img,
+                     const unsigned char *data, unsigned int len,
+                     vector<unsigned int> &words )
+{
+    unsigned char before[FTDI_MAX_EEPROM_SIZE];
+    unsigned int w;
+
+    if ( (a.layout.size > FTDI_MAX_EEPROM_SIZE) || (a.to > a.layout.size) )
+        return -EINVAL;
+    if (len > a.to - a.from)
+        return -ENOSPC;
+
+    memcpy(before, img, a.layout.size);
+    memcpy(img + a.from, data, len);
+    if (a.checksum)
+        EEPROMChecksum::fix( img, a.layout );
+
+    words.clear();
+    for (w = 0; w < a.layout.size / 2; w++) {
+        if ( (img[w * 2] != before[w * 2]) || (img[w * 2 + 1] != before[w * 2 + 1]) )
+            words.push_back( w );
+    }
+
+    return 0;
+}
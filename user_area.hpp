@@ -0,0 +1,66 @@
+/*
+    Header of UserArea class (libftdiprog)
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _USER_AREA_HPP_
+#define _USER_AREA_HPP_
+
+#include <vector>           /* vector */
+#include <ftdi.h>
+#include "eeprom_checksum.hpp"
+
+
+using namespace std;
+
+
+/* User area of an encoded image: EEPROM words libftdi leaves free.
+ *
+ *  FT230X          words 0x12 - 0x3F, not covered by the checksum
+ *  others          after the last string descriptor, up to the checksum
+ *                  word (covered: the checksum word changes with it)
+ *
+ * String descriptors are found as libftdi decodes them (pointer & size - 1,
+ * length), so the bounds follow the strings of each unit.
+ */
+typedef struct USER_AREA_S {
+    unsigned int    from, to;       /* bytes [from, to) */
+    bool            checksum;       /* covered by the checksum */
+    CHECKSUM_LAYOUT_T layout;
+} USER_AREA_T;
+
+
+class UserArea {
+
+public:
+    static int  bounds( enum ftdi_chip_type type, const unsigned char *img,
+                        unsigned int size, USER_AREA_T *a );
+
+    /* data (len <= to - from) at the start of the area, checksum fixed.
+     * words: word addresses that differ from the image before, ascending
+     */
+    static int  apply( const USER_AREA_T &a, unsigned char *img,
+                       const unsigned char *data, unsigned int len,
+                       vector<unsigned int> &words );
+
+};  /* class UserArea */
+
+#endif  /* _USER_AREA_HPP_ */
@@ -0,0 +1,178 @@
+/*
+    Implementation of UserData class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+#include <fstream>          /* ifstream */
+#include <sstream>          /* ostringstream */
+#include <iterator>         /* istreambuf_iterator */
+#include <chrono>           /* steady_clock */
+#include <cerrno>           /* errno */
+#include <string.h>         /* memcmp */
+#include "user_data.hpp"
+#include "ftdi_server.hpp"  /* escape */
+#include "snapshot_cache.hpp"
+
+
+/* ------------------------------------------------------------------ */
+
+int UserData::load( string fname )
+{
+    ifstream in( fname, ios::binary );
+    char magic[sizeof(FTPK_MAGIC) - 1];
+
+    if ( !in.good() )
+        return -ENOENT;
+
+    if ( in.read(magic, sizeof(magic)) && (memcmp(magic, FTPK_MAGIC, sizeof(magic)) == 0) ) {
+        per_unit = true;
+        return pack.open( fname );
+    }
+
+    in.clear();
+    in.seekg(0, ios::beg);
+    blob.assign( (istreambuf_iterator<char>(in)), istreambuf_iterator<char>() );
+
+    if ( blob.empty() )
+        return -ENODATA;
+    if (blob.size() > FTDI_MAX_EEPROM_SIZE)
+        return -EFBIG;
+    return 0;
+}
+
+/* read, area bounds, new area (and checksum), changed words only */
+void UserData::write_one( USER_DATA_DEVICE_T &d )
+{
+    unsigned char   buf[FTDI_MAX_EEPROM_SIZE];
+    const unsigned char *data;
+    vector<unsigned int> words;
+    USER_AREA_T     unit;
+    FTDISession     ses;
+    string          m, p, id;
+    unsigned int    len;
+    int             size;
+
+    if ( ((d.rc = ses.open(d.bus, d.dev, d.vid, d.pid)) < 0)
+        || ((d.rc = ses.probe()) < 0)
+        || ((d.rc == 0) && ((d.rc = ses.read()) < 0)) )
+    {
+        d.err = ses.error();
+        goto done;
+    }
+
+    size = ses.get_size();
+    if ( ses.is_blank() || (size <= 0) ) {
+        d.rc  = -ENODATA;
+        d.err = "EEPROM is blank";
+        goto done;
+    }
+
+    if ((d.rc = ses.store(buf, size)) < 0) {
+        d.err = ses.error();
+        goto done;
+    }
+    if (ses.decode() == 0)
+        ses.get_strings( m, p, d.serial );
+
+    if ((d.rc = UserArea::bounds(ses.context()->type, buf, size, &d.area)) < 0) {
+        d.err = (d.rc == -ENODATA) ? "no string descriptor: user area unknown"
+              : (d.rc == -ENOSPC)  ? "no user area left"
+              : "EEPROM size / chip type has no user area";
+        goto done;
+    }
+
+    if (per_unit) {
+        if ((data = pack.lookup( d.serial )) == NULL) {
+            d.rc  = -ENOENT;
+            d.err = "no image for serial in pack";
+            goto done;
+        }
+        /* the unit's image, laid out as the device: same area */
+        if ( (pack.get_image_size() != (unsigned int)size)
+            || (UserArea::bounds(ses.context()->type, data, size, &unit) < 0)
+            || (unit.from != d.area.from) || (unit.to != d.area.to) )
+        {
+            d.rc  = -EINVAL;
+            d.err = "user area of the pack image is not the device's";
+            goto done;
+        }
+        data += d.area.from;
+        len = d.area.to - d.area.from;
+    } else {
+        data = blob.data();
+        len = blob.size();
+    }
+
+    if ((d.rc = UserArea::apply(d.area, buf, data, len, words)) < 0) {
+        d.err = "user data larger than the user area ("
+              + to_string(d.area.to - d.area.from) + " bytes)";
+        goto done;
+    }
+
+    if ( !words.empty() ) {
+        d.rc = ses.write_words(buf, size, words);
+
+        /* changed (or left unknown): the cached image is stale, and on
+         * FT230X the checksum word would not tell
+         */
+        if ( !snapshot_dir.empty() && (SnapshotCache::device_id( ses, id ) == 0) )
+            SnapshotCache( snapshot_dir ).invalidate( id );
+
+        if (d.rc < 0) {
+            d.err = ses.error();
+            goto done;
+        }
+    }
+    d.words = words.size();
+
+done:
+    ses.close();
+}
+
+int UserData::run( FILE *out )
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    size_t  i, total = 0;
+    int     nok = 0, nerr = 0;
+
+    DeviceRunner::run( devs, RUNNER_MAX_THREADS, [this]( USER_DATA_DEVICE_T &d ) {
+        write_one( d );
+    } );
+
+    for (i = 0; i < devs.size(); i++) {
+        USER_DATA_DEVICE_T &d = devs[i];
+        ostringstream fields;
+
+        if ( !d.serial.empty() )
+            fields << " serial=" << FTDIServer::escape(d.serial);
+        if (d.rc >= 0)
+            fields << hex << " area=0x" << d.area.from << "-0x" << d.area.to << dec
+                   << " words=" << d.words;
+
+        (d.rc < 0) ? nerr++ : nok++;
+        total += d.words;
+        DeviceRunner::device_line( out, d, (d.rc < 0) ? "error" : "ok", fields.str() );
+    }
+
+    DeviceRunner::summary( out, devs.size(), " ok=" + to_string(nok)
+        + " error=" + to_string(nerr) + " words=" + to_string(total), t0 );
+
+    return nerr;
+}
@@ -0,0 +1,92 @@
+/*
+    Header of UserData class
+
+    Copyright (C) 2017  Alamy Liu <alamy.liu@gmail.com>
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, USA.
+*/
+
+
+#ifndef _USER_DATA_HPP_
+#define _USER_DATA_HPP_
+
+#include <cstdio>           /* FILE */
+#include <string>           /* string */
+#include <vector>           /* vector */
+#include "ftdi_session.hpp"
+#include "image_pack.hpp"
+#include "user_area.hpp"
+#include "device_runner.hpp"
+
+
+using namespace std;
+
+
+/* Write the user area of many devices, only the words that change (and the
+ * checksum word when the area is covered); configuration and strings are
+ * left as they are. The data:
+ *
+ *  FILE        the same bytes for every device, at the start of the area
+ *  PACK        per unit: the user area of the device's serial image
+ *              (--build-pack output; the area must be where it is on the
+ *              device)
+ *
+ *  device bus=1 dev=5 status=ok serial=FT0005 area=0x24-0x80 words=3 ms=20
+ *  device bus=1 dev=6 status=ok serial=FT0006 area=0x24-0x80 words=0 ms=9
+ *  device bus=1 dev=7 status=error ms=3 error=EEPROM%20is%20blank
+ *  summary devices=3 ok=2 error=1 words=3 ms=25
+ *
+ * 'words' is what was written: 0 when the area already holds the data.
+ * set_snapshot_dir(): the --snapshot-cache entry of a written device is
+ * dropped.
+ */
+typedef struct USER_DATA_DEVICE_S : RUN_DEVICE_S {
+    string          serial;
+    USER_AREA_T     area;
+    size_t          words;          /* written */
+} USER_DATA_DEVICE_T;
+
+
+class UserData {
+
+private:
+    vector<unsigned char>   blob;   /* FILE */
+    ImagePack       pack;           /* PACK, per serial */
+    bool            per_unit;
+    string          snapshot_dir;   /* empty: none */
+    vector<USER_DATA_DEVICE_T>  devs;
+
+    void    write_one( USER_DATA_DEVICE_T &d );
+
+public:
+    /* Constructor / Destructor */
+    UserData() : per_unit(false) {}
+    ~UserData() {}
+
+    /* a pack (by magic) or a plain file */
+    int     load( string fname );
+
+    void    add( int bus, int dev, int vid, int pid )
+            { DeviceRunner::add( devs, bus, dev, vid, pid ); }
+    void    set_snapshot_dir( string dir )  { snapshot_dir = dir; }
+
+    /* returns number of failed devices */
+    int     run( FILE *out );
+
+};  /* class UserData */
+
+#endif  /* _USER_DATA_HPP_ */